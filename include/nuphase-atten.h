@@ -0,0 +1,59 @@
+#ifndef _NUPHASE_ATTEN_H
+#define _NUPHASE_ATTEN_H
+
+/**
+ * \file nuphase-atten.h
+ *
+ * Attenuation tuning, in process (instead of the python set_attenuation script).
+ *
+ * Each iteration sets the attenuations, reads out a few software triggers and measures
+ * every channel's rms. All channels are tuned at once: each keeps a bracket of attenuations
+ * that could still reach its goal, and takes a Newton step assuming the rms scales by
+ * step_db per attenuation count (rms ~ 10^(-atten * step_db / 20)), falling back to bisecting
+ * the bracket if the step leaves it. Channels that can't reach the goal end at the
+ * attenuation that came closest.
+ */
+
+#include "nuphasedaq.h"
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct nuphase_atten_cfg
+{
+  double goal[NP_MAX_BOARDS];  // rms goals, in adc counts (<= 0 to leave a board alone)
+  double tolerance;            // a channel is done when within this fraction of its goal
+  double step_db;              // dB per attenuation count
+  int max_atten;               // largest attenuation setting
+  int nevents;                 // software triggers per iteration
+  int max_iterations;
+} nuphase_atten_cfg_t;
+
+typedef struct nuphase_atten_result
+{
+  uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN];  // what was left on the device
+  double rms[NP_MAX_BOARDS][NP_NUM_CHAN];     // measured with those
+  int iterations;
+  int converged;               // 1 if every channel reached its goal
+  double seconds;              // how long it took
+} nuphase_atten_result_t;
+
+/** Sets the defaults (goals are 0) */
+void nuphase_atten_cfg_init(nuphase_atten_cfg_t * cfg);
+
+/** The variance of n samples (integer sums, so it vectorizes) */
+double nuphase_atten_variance(const uint8_t * x, int n);
+
+/** Reads out nevents software triggers and fills in the rms of every channel (-1 for boards not read out).
+ *  Returns the number of events used. */
+int nuphase_atten_measure(nuphase_dev_t * dev, int nevents, double rms[NP_MAX_BOARDS][NP_NUM_CHAN]);
+
+/** Tunes the attenuations, starting from start (what's on the device, or should be, e.g. the configured
+ *  attenuations). Boards with no goal are set to start and never changed. Boards that aren't read out are
+ *  left at start too (and don't converge). Returns 0 if every channel converged. */
+int nuphase_atten_tune(nuphase_dev_t * dev, const nuphase_atten_cfg_t * cfg,
+                       const uint8_t start[NP_MAX_BOARDS][NP_NUM_CHAN], nuphase_atten_result_t * result);
+
+/** Prints the result */
+void nuphase_atten_print(FILE * f, const nuphase_atten_result_t * result);
+
+#endif
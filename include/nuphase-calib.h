@@ -0,0 +1,82 @@
+#ifndef _NUPHASE_CALIB_H
+#define _NUPHASE_CALIB_H
+
+/**
+ * \file nuphase-calib.h
+ *
+ * Calibration cache.
+ *
+ * The ADC alignment (run by nuphase-acq) and the attenuation tuning (run by
+ * nuphase-startup) are external scripts that take a long time. Each time one of them
+ * succeeds, the outcome is recorded in a small text file (key=value lines) together with
+ * the board temperatures and a firmware id (crc32 of the firmware info of both boards).
+ *
+ * The attenuation entry also keeps the per-channel attenuations that were tuned, since
+ * the boards come up with the defaults and those have to be set again.
+ *
+ * On the next start, if the entry is fresh enough, the firmware matches and the
+ * temperatures are close enough, the script is skipped, provided a quick on-device
+ * check passes (after setting the recorded attenuations): a few software triggers are read out and every channel's rms must be
+ * within a tolerance of the attenuation goal. This doesn't prove the alignment is right,
+ * but a misaligned or badly attenuated board fails it.
+ */
+
+#include "nuphasedaq.h"
+#include "nuphasehk.h"
+#include <stdint.h>
+#include <time.h>
+
+/** One calibration outcome */
+typedef struct nuphase_calib_entry
+{
+  time_t time;             // when it succeeded (0 if never)
+  uint32_t firmware_id;    // nuphase_calib_firmware_id() at the time
+  double temp_master;
+  double temp_slave;
+  double rms_master;       // the rms goals at the time
+  double rms_slave;
+  int have_atten;          // 1 if atten was recorded
+  uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN];
+} nuphase_calib_entry_t;
+
+typedef struct nuphase_calib
+{
+  nuphase_calib_entry_t alignment;
+  nuphase_calib_entry_t attenuation;
+} nuphase_calib_t;
+
+/** How much an entry may differ from now and still be used */
+typedef struct nuphase_calib_limits
+{
+  int max_age;             // seconds
+  double max_temp_diff;    // degrees C, for each board
+  double rms_tolerance;    // fractional, for the rms goals and the on-device check
+  int check_events;        // number of software triggers for the on-device check
+} nuphase_calib_limits_t;
+
+/** Reads the cache (missing entries are zeroed). Returns 0 on success. */
+int nuphase_calib_read(const char * file, nuphase_calib_t * calib);
+
+/** Writes the cache (atomically, via a rename). Returns 0 on success. */
+int nuphase_calib_write(const char * file, const nuphase_calib_t * calib);
+
+/** crc32 of the firmware info of both boards */
+uint32_t nuphase_calib_firmware_id(nuphase_dev_t * dev);
+
+/** Fills in an entry for now. atten is what was left on the device (NULL if not known) */
+void nuphase_calib_entry_set(nuphase_calib_entry_t * e, uint32_t firmware_id, const nuphase_hk_t * hk, double rms_master, double rms_slave,
+                             const uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN]);
+
+/** Returns NULL if the entry can be used for the current firmware, temperatures and rms goals,
+ *  otherwise the reason it can't. */
+const char * nuphase_calib_entry_mismatch(const nuphase_calib_entry_t * e, const nuphase_calib_limits_t * limits,
+                                          uint32_t firmware_id, const nuphase_hk_t * hk, double rms_master, double rms_slave);
+
+/** Sets the entry's attenuations on the device. Returns 1 if it has none (or they couldn't be set). */
+int nuphase_calib_apply(nuphase_dev_t * dev, const nuphase_calib_entry_t * e);
+
+/** The quick on-device check: reads out software triggers and compares each channel's rms to the goals
+ *  (a goal <= 0 skips that board). Returns 0 if it passes. */
+int nuphase_calib_check(nuphase_dev_t * dev, const nuphase_calib_limits_t * limits, double rms_master, double rms_slave);
+
+#endif
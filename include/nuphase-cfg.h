@@ -4,7 +4,10 @@
 #include "nuphase-common.h" 
 #include "nuphase.h" 
 #include "nuphasehk.h" 
+#include "nuphase-rate.h" 
+#include "nuphase-atten.h" 
 #include <stdlib.h>
+#include <sched.h>
 
 /** 
  * \file nuphase-cfg.h 
@@ -19,6 +22,15 @@
 
 
 
+/** Scheduling setup for one of the nuphase-acq threads */ 
+typedef struct nuphase_thread_cfg
+{
+  int cpu;      // the cpu to pin to, or -1 to not pin 
+  int policy;   // SCHED_OTHER, SCHED_FIFO or SCHED_RR 
+  int priority; // only used for the realtime policies 
+} nuphase_thread_cfg_t; 
+
+
 /** Configuration options for nuphase-acq */ 
 typedef struct nuphase_acq_cfg
 {
@@ -37,6 +49,18 @@ typedef struct nuphase_acq_cfg
   /* Whether  or not to load the last thresholds from the status file on startup */ 
   int load_thresholds_from_status_file; 
 
+  /* The controller checkpoint (thresholds, pid and rate estimator state), restored on startup ("" to disable) */ 
+  const char * checkpoint_file; 
+
+  /* Write the checkpoint every this many monitor updates (0 to disable) */ 
+  int checkpoint_interval; 
+
+  /* Don't restore checkpoints older than this, in seconds (0 for no limit) */ 
+  int checkpoint_max_age; 
+
+  /* Unix socket to accept control commands on ("" for none). Only read at startup. */ 
+  const char * control_socket; 
+
 
   /* The output directory for files */ 
   const char * output_directory; 
@@ -53,12 +77,27 @@ typedef struct nuphase_acq_cfg
   //channel read_mask
   uint8_t channel_read_mask[2]; 
 
-  // pid goal constats;
-  double k_p,k_i, k_d; 
+  // pid goal constants, per beam 
+  double k_p[NP_NUM_BEAMS]; 
+  double k_i[NP_NUM_BEAMS]; 
+  double k_d[NP_NUM_BEAMS]; 
 
   // the maximum the threshold can increase in a  step 
   uint16_t max_threshold_increase; 
 
+  // the maximum the threshold can decrease in a  step 
+  uint16_t max_threshold_decrease; 
+
+  // anti-windup: maximum size of the integral term (in threshold units, <= 0 for no limit) 
+  double max_integral; 
+
+  // time constant (in seconds) of the low pass filter on the derivative term 
+  double derivative_filter_tau; 
+
+  // gain scheduling: when the rate is off by more than this factor, multiply the gains by gain_schedule_factor 
+  double gain_schedule_ratio; 
+  double gain_schedule_factor; 
+
   /* The size of the circular buffers */ 
   int buffer_capacity; 
 
@@ -74,6 +113,13 @@ typedef struct nuphase_acq_cfg
   /* The maximum length of a run in seconds */ 
   int run_length; 
 
+  /* At the end of a run, start the next run in the same process (without
+   * re-aligning or reopening the device) instead of exiting */ 
+  int rollover; 
+
+  /* How often (in seconds) to log a livetime snapshot to the acq log (0 to only log at the end of a run) */ 
+  int livetime_interval; 
+
   /* The SPI clock speed, in MHz */ 
   int spi_clock; 
   
@@ -111,6 +157,7 @@ typedef struct nuphase_acq_cfg
 
   // Program called to check alignment / align the cal pulser 
   const char * alignment_command; 
+  int alignment_timeout; // seconds before alignment_command (or a reconfigure) is killed 
 
   int pretrigger; 
 
@@ -128,11 +175,34 @@ typedef struct nuphase_acq_cfg
 
   int n_fast_scaler_avg; 
 
-  int realtime_priority; 
+  // rate estimator used for the threshold control (boxcar, ewma or kalman)
+  nuphase_rate_estimator_t rate_estimator; 
+
+  // time constant of the ewma estimator (s) 
+  double rate_ewma_tau; 
+
+  // kalman estimator: fractional drift of the rate per sqrt(second) 
+  double rate_process_noise; 
+
+  // rate errors within about this many standard deviations are shrunk by the controller (0 to disable) 
+  double rate_noise_sigmas; 
+
+  // interval to sample the scalers at between monitor updates, in seconds (0 to only read them at the monitor interval) 
+  double scaler_sample_interval; 
+
+  /* Scheduling for each thread. These are set when the thread is created. 
+   * (The old realtime_priority setting maps onto acq_thread) */ 
+  nuphase_thread_cfg_t acq_thread; 
+  nuphase_thread_cfg_t monitor_thread; 
+  nuphase_thread_cfg_t write_thread; 
+
+  /* lock memory, prefault thread stacks and warn about non-isolated cpus */ 
+  int realtime_mode; 
 
   const char * copy_paths_to_rundir; 
 
   int copy_configs; 
+  const char * dedup_dir; // files copied into run dirs are hardlinked here to dedup them ("" to not). Keep outside nuphase-copy's local_path 
 
   uint16_t poll_usecs; 
 
@@ -141,6 +211,19 @@ typedef struct nuphase_acq_cfg
   /** minimum threshold */ 
   uint32_t min_threshold; 
 
+  // thresholds are only written when some beam moves at least this far from what was last written (smaller corrections accumulate) 
+  double threshold_deadband; 
+
+  // temperature feed-forward for the thresholds, using the temperatures nuphase-hk publishes in shared memory 
+  int temperature_feedforward; 
+  const char * ff_temperature_sensor;  // "master", "slave", "case" or "asps" 
+  double ff_fit_tau;           // memory of the threshold vs. temperature fit (s) 
+  double ff_temperature_tau;   // smoothing of the temperature (s) 
+  double ff_max_slope;         // don't use fits steeper than this (threshold units / degree) 
+  double ff_min_spread;        // don't use fits with less temperature spread (standard deviation, degrees) than this 
+  double ff_settled_fraction;  // only fit when the rate is within this fraction of the goal 
+  int ff_max_hk_age;           // ignore housekeeping older than this (s) 
+
 
   //surface stuff
   int surface_pretrigger; 
@@ -154,6 +237,21 @@ typedef struct nuphase_acq_cfg
   int surface_readout; 
   int surface_events_per_file; 
 
+  //disk space backpressure (free space thresholds in MB, <= 0 disables a mode) 
+  int free_space_check_interval; 
+  int free_space_compress_mb; 
+  int free_space_prescale_mb; 
+  int free_space_headers_only_mb; 
+  int free_space_hysteresis_mb; 
+  int degraded_compression_level; 
+  int forced_trigger_prescale; 
+
+  /* machine readable stats file, rewritten every print_interval (empty to disable) */ 
+  const char * stats_file; 
+
+  /* shared memory region with live metrics for nuphase-current-acq (empty to disable), updated every metrics_interval seconds */ 
+  const char * metrics_shm; 
+  int metrics_interval; 
 
 } nuphase_acq_cfg_t; 
 
@@ -177,7 +275,9 @@ typedef struct nuphase_copy_cfg
   int free_space_delete_threshold; //MB 
   int delete_files_older_than;  //days
   int wakeup_interval; //seconds
+  int command_timeout; //seconds before the rsync / delete commands are killed 
   int dummy_mode; // don't actually delete, just print files 
+  const char * dedup_dir; // nuphase-acq's dedup_dir, where entries nothing else links to are deleted ("" to not) 
 
 } nuphase_copy_cfg_t; 
 
@@ -193,13 +293,35 @@ typedef struct nuphase_start_cfg
   int heater_current; 
   int poll_interval; 
   int nchecks;
+  int fpga_boot_timeout; // seconds to wait for the boards to boot after powering on or reconfiguring 
+  int fpga_boot_min_wait; // seconds to wait for the boards to boot at least, even if they look ready 
+  int reconfigure_timeout; // seconds before giving up on reconfigure_fpga_cmd 
+  int attenuation_timeout; // seconds before giving up on set_attenuation_cmd 
   const char * set_attenuation_cmd; 
   const char * reconfigure_fpga_cmd; 
   const char * out_dir; //output directory for hk data 
   double desired_rms_master; 
   double desired_rms_slave; 
+
+  // calibration cache (see nuphase-calib.h), shared with nuphase-acq for the alignment 
+  const char * calib_cache_file; // "" to disable 
+  int calib_max_age; // seconds 
+  double calib_max_temp_diff; // degrees C 
+  double calib_rms_tolerance; // fractional 
+  int calib_check_events; // software triggers read out to check a cached calibration 
+
+  // in-process attenuation tuning (see nuphase-atten.h), instead of set_attenuation_cmd 
+  int native_attenuation; 
+  double atten_tolerance; // fractional 
+  double atten_step_db; // dB per attenuation count 
+  int atten_max; 
+  int atten_events; // software triggers per iteration 
+  int atten_max_iterations; 
 }nuphase_start_cfg_t; 
 
+/* fills in the attenuation tuning settings from the start config */ 
+void nuphase_start_config_atten(const nuphase_start_cfg_t * c, nuphase_atten_cfg_t * atten); 
+
 
 void nuphase_start_config_init(nuphase_start_cfg_t *); 
 int nuphase_start_config_read(const char * file, nuphase_start_cfg_t * ); 
@@ -212,6 +334,7 @@ typedef struct nuphase_hkd_cfg
   const char * out_dir; //output directory for hk data 
   int max_secs_per_file; // maximum number of seconds per file. Default 600
   const char * shm_name; //shared memory name
+  int shm_nsamples; // number of samples kept in the shared memory ring 
   nuphase_asps_method_t asps_method;  //asps output method 
   int print_to_screen; //1 to print to screen 
 
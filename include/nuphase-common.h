@@ -2,6 +2,8 @@
 #define _NUPHASE_COMMON_H 
 #include <time.h> 
 #include <zlib.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /** Various common things used by multiple programs */ 
 
@@ -25,12 +27,78 @@ typedef enum nuphase_program
 #define CONFIG_DIR_COPY_NAME "copy.cfg" 
 #define CONFIG_DIR_HK_NAME "hk.cfg" 
 #define CONFIG_DIR_STARTUP_NAME "startup.cfg" 
-#define CONFIG_REREAD_SIGNAL SIGUSR1; 
+#define CONFIG_REREAD_SIGNAL SIGUSR1 
+#define CONFIG_WATCH_ENV "NUPHASE_WATCH_CONFIG" 
 
 
 int nuphase_get_cfg_file(char ** name, nuphase_program_t program); 
 
 
+/** Config reloading. 
+ *
+ * Rereading the config from a signal handler isn't safe, so instead 
+ * nuphase_reload_start() blocks CONFIG_REREAD_SIGNAL (and, if on_quit is given, 
+ * SIGINT, SIGTERM and SIGUSR2) and starts a thread that waits for them on a signalfd. 
+ * If CONFIG_WATCH_ENV is set (to anything but 0), it also watches the program's 
+ * config file in the config dir with inotify, so saving it triggers a reload. 
+ *
+ * The program checks nuphase_reload_pending() at a safe point in its main loop 
+ * and rereads its config there. on_quit (if not NULL) is called from the reload 
+ * thread when an exit signal arrives. nuphase_reload_sleep() is a sleep that returns 
+ * early on either. 
+ *
+ * Call this before creating any other threads, so they inherit the signal mask. 
+ * Returns 0 on success. 
+ */ 
+int nuphase_reload_start(nuphase_program_t program, void (*on_quit)(void *), void * arg); 
+
+/** Returns 1 if a reload was requested since the last call */ 
+int nuphase_reload_pending(); 
+
+/** Returns 1 if an exit signal was received */ 
+int nuphase_quit_requested(); 
+
+/** Sleeps up to secs, returning early if a reload or exit is requested */ 
+void nuphase_reload_sleep(double secs); 
+
+
+/** Running commands. 
+ *
+ * A replacement for system(). The command is run with /bin/sh -c using posix_spawn 
+ * (so nothing big gets forked, and the child starts with the default signal 
+ * dispositions, an empty signal mask and normal scheduling), in its own process group, 
+ * so that on a timeout everything it started is killed (SIGTERM, then SIGKILL a 
+ * couple of seconds later). Stdout and stderr can be captured. 
+ */ 
+typedef struct nuphase_cmd_result
+{
+  int status;        // exit status, 128 + the signal if it was killed, or -1 if it couldn't be run 
+  int signal;        // the signal that killed it (0 if none) 
+  int timed_out;     // 1 if it was killed for taking longer than the timeout 
+  double seconds;    // how long it ran 
+  char * output;     // captured output (NUL-terminated), or NULL if not capturing 
+} nuphase_cmd_result_t; 
+
+/** Runs cmd, killing it after timeout seconds (<= 0 for no limit). If capture is nonzero, 
+ * up to capture bytes of output are kept in result->output (the rest is read and dropped). 
+ * result may be NULL. Returns the status (so 0 is success). */ 
+int nuphase_run(const char * cmd, double timeout, size_t capture, nuphase_cmd_result_t * result); 
+
+/** Like nuphase_run, but in a detached thread (with normal scheduling), calling done (if not NULL) 
+ * from that thread with the result when it's finished. Returns 0 if it was started. */ 
+int nuphase_run_async(const char * cmd, double timeout, size_t capture, 
+                      void (*done)(const char * cmd, const nuphase_cmd_result_t * result, void * arg), void * arg); 
+
+/** A done callback for nuphase_run_async that complains (with the output) if it failed */ 
+void nuphase_run_report(const char * cmd, const nuphase_cmd_result_t * result, void * arg); 
+
+/** Frees the captured output */ 
+void nuphase_cmd_result_free(nuphase_cmd_result_t * result); 
+
+/** Starts fn(arg) in a detached thread with normal (not realtime) scheduling. Returns 0 on success. */ 
+int nuphase_background_thread(void * (*fn)(void *), void * arg); 
+
+
 /* a bunch of directory making things */ 
 
 
@@ -55,4 +123,35 @@ int mkdirs_for_time(const char * prefix, const char * pattern,  time_t when);
 int do_close(gzFile gzf, char * path); 
 
 
+/** Latency histograms. 
+ *
+ * Bins are log2 in microseconds: bin 0 is < 2 us, bin i is [2^i, 2^(i+1)) us, 
+ * and the last bin also holds everything longer. 
+ * Not thread safe, so each histogram should only be filled by one thread. 
+ */ 
+#define NUPHASE_LATENCY_NBINS 24 
+
+typedef struct nuphase_latency_hist
+{
+  uint32_t counts[NUPHASE_LATENCY_NBINS]; 
+  uint64_t n; 
+  uint64_t sum_us; 
+  uint32_t max_us; 
+} nuphase_latency_hist_t; 
+
+void nuphase_latency_hist_reset(nuphase_latency_hist_t * h); 
+
+/* adds the time between start and end */ 
+void nuphase_latency_hist_add(nuphase_latency_hist_t * h, const struct timespec * start, const struct timespec * end); 
+
+/* approximate quantile (upper edge of the bin it lands in), in us */ 
+uint32_t nuphase_latency_hist_quantile(const nuphase_latency_hist_t * h, double q); 
+
+/* one line summary (n, mean, p50, p90, p99, max)  */ 
+void nuphase_latency_hist_print(FILE * f, const char * name, const nuphase_latency_hist_t * h); 
+
+/* machine readable: name.key=value lines, including the bin counts */ 
+void nuphase_latency_hist_write(FILE * f, const char * name, const nuphase_latency_hist_t * h); 
+
+
 #endif
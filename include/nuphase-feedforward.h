@@ -0,0 +1,61 @@
+#ifndef _NUPHASE_FEEDFORWARD_H
+#define _NUPHASE_FEEDFORWARD_H
+
+/**
+ * \file nuphase-feedforward.h
+ *
+ * Temperature feed-forward for the threshold control.
+ *
+ * Noise rates follow temperature, so the threshold that gives the goal rate does too.
+ * For each beam, this fits (online, with exponential forgetting) the threshold
+ * as a linear function of a smoothed temperature, using only updates where the rate
+ * was close to the goal (so the threshold was about right). Once the fit is
+ * trustworthy (enough temperature spread, and a bounded slope), each update
+ * gives a threshold step of slope * (change in smoothed temperature),
+ * which is added to the pid step so the pid loop only has to correct the residual.
+ */
+
+#include "nuphase.h"
+#include <stdio.h>
+
+typedef struct nuphase_ff_cfg
+{
+  double fit_tau;            // memory of the fit, in seconds
+  double temp_tau;           // smoothing of the temperature, in seconds
+  double max_slope;          // slopes (threshold units per degree) bigger than this aren't used
+  double min_spread;         // minimum (weighted) standard deviation of the fitted temperatures, in degrees
+  double settled_fraction;   // updates with the rate within this fraction of the goal are used in the fit
+} nuphase_ff_cfg_t;
+
+typedef struct nuphase_ff
+{
+  double temp;               // smoothed temperature
+  double dtemp;              // change in the smoothed temperature at the last update
+  int have_temp;
+
+  // exponentially weighted sums for the fit
+  double w[NP_NUM_BEAMS];
+  double sx[NP_NUM_BEAMS];
+  double sy[NP_NUM_BEAMS];
+  double sxx[NP_NUM_BEAMS];
+  double sxy[NP_NUM_BEAMS];
+
+  double slope[NP_NUM_BEAMS];   // fitted threshold units per degree
+  int valid[NP_NUM_BEAMS];      // whether the slope is being used
+  double total[NP_NUM_BEAMS];   // sum of the steps applied so far
+} nuphase_ff_t;
+
+/** Resets everything */
+void nuphase_ff_init(nuphase_ff_t * ff);
+
+/** New temperature reading, dt seconds after the last one */
+void nuphase_ff_update_temperature(nuphase_ff_t * ff, const nuphase_ff_cfg_t * cfg, double temp, double dt);
+
+/** Adds an observation for a beam (the current threshold, and the measured and goal rates)
+ *  and returns the feed-forward threshold step for the last temperature change. */
+double nuphase_ff_update_beam(nuphase_ff_t * ff, const nuphase_ff_cfg_t * cfg, int beam, double threshold, double measured, double goal, double dt);
+
+/** Prints the state */
+void nuphase_ff_print(FILE * f, const nuphase_ff_t * ff);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _NUPHASE_HKSHM_H
+#define _NUPHASE_HKSHM_H
+
+/**
+ * \file nuphase-hkshm.h
+ *
+ * The housekeeping that nuphase-hk publishes in shared memory.
+ *
+ * The region starts with a plain nuphase_hk_t holding the latest sample, so
+ * anything that reads a single record from the start of the region (the way
+ * nuphase-current-hk and nuphase-acq used to) keeps working. That copy is
+ * overwritten in place, though, so those readers can see torn values.
+ *
+ * After it comes a header and a ring of the last nrecords samples. Each record
+ * has its own seqlock: the writer makes seq odd, fills in the record, then makes
+ * it even again, and readers retry if seq was odd or changed while they copied.
+ * Every sample gets a number one more than the last (kept across restarts of
+ * nuphase-hk as long as the ring size doesn't change), so readers can tell if
+ * they missed any. Readers only ever copy the records they ask for.
+ *
+ * When nuphase-hk remakes the ring (a different shm_nsamples), it clears magic
+ * first and never shrinks the segment, so existing mappings stay valid. Readers
+ * remember the ring size and mapped size from when they mapped it, never go
+ * beyond them, and should map it again when nuphase_hk_shm_changed says so.
+ */
+
+#include "nuphasehk.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define NUPHASE_HK_SHM_MAGIC 0x4d48504e  // "NPHM"
+#define NUPHASE_HK_SHM_VERSION 1
+
+typedef struct nuphase_hk_shm_record
+{
+  uint32_t seq;          // odd while being written
+  uint32_t reserved;
+  uint64_t sample;       // sample number (0 if never written)
+  nuphase_hk_t hk;
+} nuphase_hk_shm_record_t;
+
+typedef struct nuphase_hk_shm
+{
+  nuphase_hk_t latest;   // for single-record readers (not protected)
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;  // sizeof(nuphase_hk_shm_record_t)
+  uint32_t nrecords;
+  uint64_t nsamples;     // number of the latest sample, which is in records[(nsamples-1) % nrecords]
+  nuphase_hk_shm_record_t records[];
+} nuphase_hk_shm_t;
+
+/** Size of a region with nrecords samples */
+size_t nuphase_hk_shm_size(int nrecords);
+
+/** Creates (or reuses) and maps the region read/write, for nuphase-hk. Returns NULL on failure. */
+nuphase_hk_shm_t * nuphase_hk_shm_create(const char * shm_name, int nrecords);
+
+/** Adds a sample (only one writer). Returns its sample number. */
+uint64_t nuphase_hk_shm_put(nuphase_hk_shm_t * shm, const nuphase_hk_t * hk);
+
+/** Unmaps a region from create */
+void nuphase_hk_shm_release(nuphase_hk_shm_t * shm);
+
+/** A reader's read-only mapping */
+typedef struct nuphase_hk_shm_reader
+{
+  const nuphase_hk_shm_t * shm;
+  size_t size;           // what was mapped
+  uint32_t nrecords;     // the ring size when it was mapped
+} nuphase_hk_shm_reader_t;
+
+/** Maps an existing region read-only. Returns 0 on success, 1 if it's not there or not the
+ *  right format (e.g. an old nuphase-hk that only writes the single record) */
+int nuphase_hk_shm_map(const char * shm_name, nuphase_hk_shm_reader_t * r);
+
+/** Unmaps a region from map (does nothing if it isn't mapped) */
+void nuphase_hk_shm_unmap(nuphase_hk_shm_reader_t * r);
+
+/** 1 if nuphase-hk remade the ring since it was mapped (so it has to be mapped again) */
+int nuphase_hk_shm_changed(const nuphase_hk_shm_reader_t * r);
+
+/** Copies out the latest sample consistently. sample (may be NULL) gets its number.
+ *  Returns 0 on success, 1 if there's nothing yet, the ring changed, or no consistent copy could be had. */
+int nuphase_hk_shm_latest(const nuphase_hk_shm_reader_t * r, nuphase_hk_t * hk, uint64_t * sample);
+
+/** Copies out up to the last k samples, oldest first, into hks (and their numbers into samples, which may be NULL).
+ *  Samples overwritten while reading are left out. Returns how many were copied. */
+int nuphase_hk_shm_last(const nuphase_hk_shm_reader_t * r, int k, nuphase_hk_t * hks, uint64_t * samples);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef _NUPHASE_METRICS_H
+#define _NUPHASE_METRICS_H
+
+/**
+ * \file nuphase-metrics.h
+ *
+ * nuphase-acq's live metrics, published in shared memory (like nuphase-hk does for
+ * the housekeeping) for nuphase-current-acq and anything else that wants them.
+ *
+ * The region is a single nuphase_acq_metrics_t behind a seqlock: the writer (nuphase-acq's
+ * write thread) makes seq odd, updates everything, then makes it even again, and readers
+ * copy it out and retry if seq was odd or changed under them. Readers never block the writer.
+ *
+ * magic, version and size are set once when the region is created. The version must be
+ * bumped whenever the struct changes.
+ */
+
+#include "nuphase.h"
+#include "nuphase-common.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define NUPHASE_METRICS_MAGIC 0x4d51434e  // "NCQM"
+#define NUPHASE_METRICS_VERSION 1
+
+#define NUPHASE_METRICS_NLATENCY 5
+#define NUPHASE_METRICS_NDEAD 3
+#define NUPHASE_METRICS_NBACKPRESSURE 4
+
+/** names of the latency stages, deadtime sources and backpressure modes, in the order nuphase-acq uses */
+extern const char * nuphase_metrics_latency_names[NUPHASE_METRICS_NLATENCY];
+extern const char * nuphase_metrics_dead_names[NUPHASE_METRICS_NDEAD];
+extern const char * nuphase_metrics_backpressure_names[NUPHASE_METRICS_NBACKPRESSURE];
+
+typedef struct nuphase_acq_metrics
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;               // sizeof(nuphase_acq_metrics_t)
+  uint32_t seq;                // odd while being written
+
+  uint64_t update_time;        // unix time of the last update
+  uint64_t start_time;         // unix time nuphase-acq started
+  int32_t pid;                 // of nuphase-acq
+  int32_t run;
+
+  /* acq thread */
+  uint64_t acq_readouts;       // buffers read out
+  uint64_t acq_events;         // events read out (including surface)
+
+  /* write thread */
+  uint64_t write_events;       // events popped from the buffer
+  uint64_t write_files;        // files closed
+  uint64_t write_bytes_in;     // uncompressed bytes in closed files
+  uint64_t write_bytes_out;    // compressed bytes in closed files
+  double write_rate;           // events per second since the last update
+  double compression_ratio;    // write_bytes_in / write_bytes_out
+  uint32_t buffer_occupancy;
+  uint32_t buffer_capacity;
+  int32_t backpressure_mode;
+  int32_t free_mb;
+  uint64_t nprescaled;
+  uint64_t nheaders_only;
+
+  /* monitor thread */
+  uint64_t monitor_updates;
+  uint64_t threshold_writes;
+  uint64_t threshold_suppressed;
+  uint64_t scaler_samples;
+  uint64_t scaler_overruns;
+
+  /* device scheduler */
+  uint64_t dev_readouts;
+  uint64_t dev_readout_waits;
+  uint64_t dev_max_readout_wait_ns;
+  uint64_t dev_cmds;
+
+  /* livetime of the current run */
+  uint64_t elapsed_ns;
+  uint64_t dead_ns[NUPHASE_METRICS_NDEAD];
+  double livetime_fraction;
+
+  /* per beam */
+  double rate[NP_NUM_BEAMS];       // estimated rate used for control (Hz)
+  double rate_sigma[NP_NUM_BEAMS];
+  double goal[NP_NUM_BEAMS];
+  double target[NP_NUM_BEAMS];     // controller threshold
+  uint32_t threshold[NP_NUM_BEAMS]; // applied threshold
+
+  nuphase_latency_hist_t latency[NUPHASE_METRICS_NLATENCY];
+} nuphase_acq_metrics_t;
+
+/** Fills in the header (and zeros the rest) */
+void nuphase_metrics_init(nuphase_acq_metrics_t * m);
+
+/** Brackets an update (only one writer) */
+void nuphase_metrics_write_begin(nuphase_acq_metrics_t * m);
+void nuphase_metrics_write_end(nuphase_acq_metrics_t * m);
+
+/** Copies a consistent snapshot out of the shared region. Returns 0 on success,
+ *  1 if the header doesn't match this version or no consistent copy could be had. */
+int nuphase_metrics_read(const nuphase_acq_metrics_t * shared, nuphase_acq_metrics_t * out);
+
+/** Maps the shared region read-only. Returns NULL (and complains) if it can't. */
+const nuphase_acq_metrics_t * nuphase_metrics_map(const char * shm_name);
+
+/** Human readable */
+void nuphase_metrics_print(FILE * f, const nuphase_acq_metrics_t * m);
+
+/** Prometheus text exposition format (for node_exporter's textfile collector) */
+void nuphase_metrics_prometheus(FILE * f, const nuphase_acq_metrics_t * m);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef _NUPHASE_PID_H
+#define _NUPHASE_PID_H
+
+/**
+ * \file nuphase-pid.h
+ *
+ * Per-beam threshold controller.
+ *
+ * Like the original loop in nuphase-acq, the output is a threshold step
+ * that gets added to the current threshold each update (so the threshold
+ * itself already integrates the output). The step is
+ *
+ *    k_p * e + k_i * integral(e dt) + k_d * d(measured)/dt
+ *
+ * where e = measured - goal. On top of that there is:
+ *   - per-beam gains
+ *   - anti-windup (the integral is clamped and stops integrating while the step is limited)
+ *   - symmetric (or at least separate) step limits
+ *   - the derivative is taken on the measurement, through a first-order low pass filter
+ *   - optional gain scheduling: when the measured rate is far from the goal, the gains are scaled
+ *   - errors comparable to the uncertainty of the measurement are shrunk, e * e^2 / (e^2 + (noise_sigmas * sigma)^2),
+ *     so the thresholds don't chase scaler noise
+ *
+ */
+
+#include "nuphase.h"
+#include <stdio.h>
+
+typedef struct nuphase_pid_gains
+{
+  double k_p;
+  double k_i;
+  double k_d;
+} nuphase_pid_gains_t;
+
+/** Controller settings */
+typedef struct nuphase_pid_cfg
+{
+  nuphase_pid_gains_t gains[NP_NUM_BEAMS];
+  double max_step_up;      // maximum threshold increase per update (<= 0 for no limit)
+  double max_step_down;    // maximum threshold decrease per update (<= 0 for no limit)
+  double max_integral;     // maximum |k_i * integral| (<= 0 for no limit)
+  double d_filter_tau;     // time constant of the derivative filter, in seconds (0 for none)
+  double schedule_ratio;   // if measured/goal is above this or below its inverse ... (<= 1 to disable)
+  double schedule_factor;  // ... the gains are multiplied by this
+  double noise_sigmas;     // errors of about this many standard deviations of the measurement are shrunk (0 to disable)
+} nuphase_pid_cfg_t;
+
+/** Controller state */
+typedef struct nuphase_pid
+{
+  int n[NP_NUM_BEAMS];                // number of updates
+  double error[NP_NUM_BEAMS];         // last error
+  double integral[NP_NUM_BEAMS];      // integral of the error (Hz s)
+  double last_measured[NP_NUM_BEAMS];
+  double dmeasured[NP_NUM_BEAMS];     // filtered derivative of the measurement (Hz/s)
+  double step[NP_NUM_BEAMS];          // last step
+  double sigma[NP_NUM_BEAMS];         // uncertainty of the last measurement
+  int limited[NP_NUM_BEAMS];          // 1 if the last step was limited (-1 if limited going down)
+} nuphase_pid_t;
+
+/** Sets all gains to the same thing */
+void nuphase_pid_cfg_set_gains(nuphase_pid_cfg_t * cfg, double k_p, double k_i, double k_d);
+
+/** Resets the state */
+void nuphase_pid_init(nuphase_pid_t * pid);
+
+/** Update one beam with a new measurement and its variance (dt is seconds since the last update).
+ *  Returns the threshold step. */
+double nuphase_pid_update(nuphase_pid_t * pid, const nuphase_pid_cfg_t * cfg, int beam, double measured, double variance, double goal, double dt);
+
+/** Prints the state */
+void nuphase_pid_print(FILE * f, const nuphase_pid_t * pid, const nuphase_pid_cfg_t * cfg);
+
+#endif
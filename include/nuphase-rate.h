@@ -0,0 +1,95 @@
+#ifndef _NUPHASE_RATE_H
+#define _NUPHASE_RATE_H
+
+/**
+ * \file nuphase-rate.h
+ *
+ * Trigger rate estimation from the scalers, as used by the
+ * threshold control in nuphase-acq (and the offline simulator).
+ *
+ * There are three estimators:
+ *
+ *  - boxcar: the fast scalers are averaged over the last n_fast_scaler_avg statuses,
+ *    then blended with the slow scaler using static weights (the original method)
+ *
+ *  - ewma: like boxcar, but with an exponentially weighted average of the
+ *    fast scalers, with time constant ewma_tau
+ *
+ *  - kalman: a one-state (random walk) Kalman filter per beam. The fast and slow scalers
+ *    are both measurements of the rate, each with Poisson variance given by its
+ *    counts and integration time (NP_SCALER_TIME). The slow scaler is only used
+ *    once per slow scaler period since it's read many times per period. The true rate
+ *    is allowed to drift by a fraction process_noise per sqrt(second).
+ *
+ * All of them are updated on every status (so switching between them is seamless) and give an
+ * estimate of the variance. If subtract_gated is set, the gated slow scaler is subtracted
+ * (and its variance added).
+ */
+
+#include "nuphase.h"
+#include <stdio.h>
+#include <stddef.h>
+
+typedef enum nuphase_rate_estimator
+{
+  NP_RATE_BOXCAR,
+  NP_RATE_EWMA,
+  NP_RATE_KALMAN
+} nuphase_rate_estimator_t;
+
+typedef struct nuphase_rate_cfg
+{
+  nuphase_rate_estimator_t estimator;
+  double slow_weight;    // boxcar and ewma
+  double fast_weight;    // boxcar and ewma
+  int subtract_gated;
+  double ewma_tau;       // ewma time constant, in seconds
+  double process_noise;  // kalman: expected fractional drift of the rate per sqrt(second)
+} nuphase_rate_cfg_t;
+
+/** Rate estimator state */
+typedef struct nuphase_rate
+{
+  // boxcar
+  uint16_t * buf[NP_NUM_BEAMS];
+  uint32_t sum[NP_NUM_BEAMS];
+  size_t sz;
+  size_t i;
+
+  // ewma of the fast rate (Hz) and its variance
+  double ewma[NP_NUM_BEAMS];
+  double ewma_var[NP_NUM_BEAMS];
+
+  // kalman state (Hz) and its variance
+  double x[NP_NUM_BEAMS];
+  double P[NP_NUM_BEAMS];
+  double slow_age;       // seconds since the slow scalers were last used
+
+  // the latest estimate from the selected estimator (Hz, and Hz^2)
+  nuphase_rate_estimator_t estimator;
+  double rate[NP_NUM_BEAMS];
+  double variance[NP_NUM_BEAMS];
+} nuphase_rate_t;
+
+/** Set up to average n fast scalers (for the boxcar). Returns 0 on success. */
+int nuphase_rate_init(nuphase_rate_t * r, int n);
+
+/** Frees the memory */
+void nuphase_rate_free(nuphase_rate_t * r);
+
+/** Adds a status, taken dt seconds after the last one, and updates rate[] and variance[]. */
+void nuphase_rate_update(nuphase_rate_t * r, const nuphase_rate_cfg_t * cfg, const nuphase_status_t * st, double dt);
+
+/** The boxcar average fast scaler (counts per fast scaler period) */
+double nuphase_rate_fast_avg(const nuphase_rate_t * r, int ibeam);
+
+/** Name of an estimator ("boxcar", "ewma" or "kalman") */
+const char * nuphase_rate_estimator_name(nuphase_rate_estimator_t e);
+
+/** Estimator from its name. Returns -1 if not recognized. */
+int nuphase_rate_estimator_from_name(const char * name);
+
+/** Prints the estimates */
+void nuphase_rate_print(FILE * f, const nuphase_rate_t * r);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _NUPHASE_SNAPSHOT_H
+#define _NUPHASE_SNAPSHOT_H
+
+/**
+ * \file nuphase-snapshot.h
+ *
+ * Copying configs and other files into the run directory, in process (instead of cp).
+ *
+ * Files are copied with a reflink if the filesystem can, otherwise with copy_file_range,
+ * then sendfile, then plain read/write (which is what /proc files with no size need).
+ * Directories are copied recursively. Like cp -r, symlinks given directly are followed, but ones
+ * inside directories are copied as symlinks.
+ *
+ * If a dedup directory is given, every copied file is also hardlinked there under its size
+ * and crc32. The next time a file with the same size and crc32 is copied (for example the
+ * same config at the next run), it is compared byte by byte with that one and, if identical,
+ * hardlinked instead of copied. Every linked copy shares the inode, and with it the
+ * modification time of the first one, so entries more than a day old aren't linked to but
+ * replaced by a fresh copy. That way age-based deletes (nuphase-copy's, by file mtime) still
+ * empty old run directories, and take a linked copy out at most a day before its run's data.
+ * The dedup directory has to be on the same filesystem as the destination; if the link fails,
+ * the file is just copied. It should be outside anything that's deleted by age; nuphase-copy
+ * removes entries nothing links to anymore.
+ */
+
+#include <stdint.h>
+
+typedef struct nuphase_snapshot_stats
+{
+  int files;             // files copied
+  int linked;            // files hardlinked from the dedup directory instead
+  int dirs;              // directories made
+  int errors;
+  uint64_t bytes_copied;
+  uint64_t bytes_linked;
+  double seconds;
+} nuphase_snapshot_stats_t;
+
+/** Copies src (a file, or a directory recursively) to dest_dir/basename(src).
+ *  If backup is nonzero, an existing destination file is renamed with a ~ (like cp --backup=simple).
+ *  dedup_dir may be NULL or empty to not deduplicate. stats (may be NULL) are added to.
+ *  Returns 0 if everything was copied. */
+int nuphase_snapshot_copy(const char * src, const char * dest_dir, const char * dedup_dir, int backup, nuphase_snapshot_stats_t * stats);
+
+/** Copies each entry of a colon-separated list of paths into dest_dir (made if needed),
+ *  in a detached thread with normal scheduling, printing a summary when it's done.
+ *  Returns 0 if the thread was started. */
+int nuphase_snapshot_async(const char * paths, const char * dest_dir, const char * dedup_dir, int backup);
+
+#endif
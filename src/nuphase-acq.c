@@ -10,8 +10,8 @@
  *
  * Right now the threads are: 
  *
- *  - The main thread: reads the config, sets up, tears down, and waits for
- *  signals. 
+ *  - The main thread: reads the config, sets up, tears down, rereads the config 
+ *  when asked and rolls over runs. 
  *
  * - Acquisition thread - takes the data and reads it
  * 
@@ -20,8 +20,23 @@
  *
  * - A write thread, which writes to disk and screen.
  *
- * The config is read on startup. Right now, the configuration cannot be reloaded
- * without a restart.
+ * - A control thread for the control socket (see "the control socket"). 
+ *
+ * - The reload thread (from nuphase_reload_start), which waits for signals on a 
+ *   signalfd and, if CONFIG_WATCH_ENV is set, for the config file to change (inotify). 
+ *
+ * Device access from the acquisition and monitoring threads goes through a small
+ * scheduler (see "device access scheduling") so that event readout always goes first. 
+ *
+ * The config is read on startup, and can be reloaded without a restart (SIGUSR1, or 
+ * saving the file when it's watched). The reload thread only flags it; the main thread 
+ * rereads the file, publishes it as a new config snapshot and reconfigures the device 
+ * with whatever changed. Every other thread keeps its own copy and picks up the new 
+ * snapshot (config_refresh) at the top of its loop: the acq thread before grabbing 
+ * a buffer, the monitor thread before each update, the write thread before popping 
+ * buffers and the control thread before polling its socket. A few things (e.g. the spi 
+ * devices, the buffer sizes and the thread setup) are only used at startup, so 
+ * changing them still needs a restart. 
  *
  **/ 
 
@@ -33,6 +48,13 @@
 #include "nuphase-cfg.h"
 #include "nuphasehk.h" 
 #include "nuphase-buf.h" 
+#include "nuphase-pid.h" 
+#include "nuphase-rate.h" 
+#include "nuphase-feedforward.h" 
+#include "nuphase-calib.h" 
+#include "nuphase-snapshot.h" 
+#include "nuphase-metrics.h" 
+#include "nuphase-hkshm.h" 
 #include "nuphasedaq.h"
 #include <pthread.h> 
 #include <stdlib.h>
@@ -43,48 +65,23 @@
 #include <unistd.h>
 #include <signal.h>
 #include <inttypes.h> 
+#include <stdarg.h>
+#include <sys/statvfs.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <math.h>
+#include <strings.h>
 
 
 /************** Structs /Typedefs ******************************/
 
 
-/** PID state */ 
-typedef struct pid_state
-{
-  double k_p; 
-  double k_i; 
-  double k_d; 
-  int nsum; 
-  double error[NP_NUM_BEAMS] ; 
-  double sum_error[NP_NUM_BEAMS];
-  double last_measured[NP_NUM_BEAMS];
-} pid_state_t; 
-
-static void pid_state_init (pid_state_t * c, double p, double i, double d)
-{
-  c->k_p = p; 
-  c->k_i = i; 
-  c->k_d = d; 
-
-  c->nsum =0;
-  memset(c->sum_error,0, sizeof(c->sum_error)); 
-  memset(c->last_measured,0, sizeof(c->last_measured)); 
-  memset(c->error,0, sizeof(c->error)); 
-}
-
-static void pid_state_print(FILE * f, const pid_state_t * pid) 
-{
-
-  fprintf(f,"===PID STATE (k_p=%g, k_i=%g, k_d=%g, n: %d)) \n", pid->k_p, pid->k_i, pid->k_d, pid->nsum); 
-  int ibeam; 
-  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
-  {
-    fprintf(f,"   Beam %d :: error: %g ::  sum_error: %g ::  last_measured: %g\n",ibeam , pid->error[ibeam], pid->sum_error[ibeam], pid->last_measured[ibeam] );  
-  }
-
-}
-
-
 /* This is what is stored within the acquisition buffer 
  *
  * It's a bit wasteful... we allocate space for all buffers even though
@@ -100,6 +97,11 @@ typedef struct acq_buffer
   nuphase_header_t surface_header; 
   int nfilled; 
   int surface_filled; 
+  int run;  //the run these events belong to 
+
+  /* monotonic timestamps for latency tracing */ 
+  struct timespec t_readout;  //when the data was ready, before the read started 
+  struct timespec t_commit;   //just before commit 
 } acq_buffer_t;
 
 
@@ -108,20 +110,48 @@ typedef struct monitor_buffer
 {
   nuphase_status_t status; //status before
   uint32_t thresholds[NP_NUM_BEAMS]; //thresholds when written 
-  pid_state_t control; //the pid state 
+  nuphase_pid_t control; //the pid state 
+  double rate[NP_NUM_BEAMS]; //estimated rate used for control (Hz) 
+  double rate_variance[NP_NUM_BEAMS]; //and its variance (Hz^2) 
+  nuphase_rate_estimator_t estimator; 
 } monitor_buffer_t; 
 
 /**************Static vars *******************************/
 
-/* The configuration state */ 
-static nuphase_acq_cfg_t config; 
+/* The configuration state. 
+ *
+ * Each (re)read of the config builds a new immutable snapshot with a new version
+ * and publishes it atomically. Every thread has its own copy (config is thread-local), 
+ * which it refreshes from the latest snapshot with config_refresh() at a safe point 
+ * in its loop, so a reload never changes anything under a thread mid-iteration, 
+ * and readers never take a lock. Each thread records the version it has copied,
+ * and old snapshots are freed once every thread has moved past them. 
+ */ 
+typedef struct config_snapshot 
+{
+  nuphase_acq_cfg_t cfg; 
+  uint64_t version; 
+  struct config_snapshot * older; 
+} config_snapshot_t; 
 
-/** Need this to apply attenuation */
+typedef enum config_reader 
+{
+  CFG_READER_MAIN, 
+  CFG_READER_ACQ, 
+  CFG_READER_MONITOR, 
+  CFG_READER_WRITE, 
+  CFG_READER_CONTROL, 
+  CFG_NREADERS
+} config_reader_t; 
+
+static config_snapshot_t * config_current = 0;  
+static uint64_t config_seen[CFG_NREADERS] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX }; //UINT64_MAX if not running 
+static __thread nuphase_acq_cfg_t config; 
+static __thread uint64_t config_version = 0; 
+
+/** Need this to apply attenuation (only used by the main thread) */
 static nuphase_start_cfg_t start_config; 
 
-/* Mutex protecting the configuration */
-static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER; 
-
 /* The device */
 static nuphase_dev_t* device;
 
@@ -140,7 +170,17 @@ static pthread_t the_mon_thread;
 /* Write thread handle */ 
 static pthread_t the_wri_thread; 
 
-static pid_state_t control; 
+/* which of those were actually started (only those get joined) */ 
+static int acq_thread_started = 0; 
+static int mon_thread_started = 0; 
+static int wri_thread_started = 0; 
+
+/* Control socket thread handle (if there is a control socket) */ 
+static pthread_t the_ctl_thread; 
+static int control_listen_fd = -1; 
+static char * control_socket_path = 0; // what we bound (the config could change) 
+
+static nuphase_pid_t control; 
 
 static int status_save_fd = -1; 
 static nuphase_status_t * saved_status = 0; 
@@ -148,6 +188,9 @@ static nuphase_status_t * saved_status = 0;
 /* used for exiting */ 
 static volatile int die; 
 
+/* eventfd used to wake up the monitor thread (on config reload or exit) */ 
+static int monitor_wakeup_fd = -1; 
+
 
 /************** Prototypes *********************
  Brief documentation follows. More detailed documentation
@@ -157,10 +200,21 @@ static volatile int die;
 
 static int run_number; 
 
+/* Run rollover happens without restarting: when the run is over, the main thread 
+ * bumps next_run. The acq thread changes the readout number offset between two 
+ * readouts and tags each buffer with the run it belongs to, and the write thread 
+ * switches to the new run directory when it pops the first buffer of the new run. 
+ * run_number is the run the write thread is writing. */ 
+static volatile int next_run; 
+
+/* set by the control socket to ask the main thread for a rollover */ 
+static volatile int rollover_requested; 
+
 // this sets everything up (opens device, starts threads, signal handlers, etc. ) 
 static int setup(); 
 // this cleans up 
 static int teardown(); 
+static void join_threads(); 
 
 //this reads in the config. Some things may be changed later. 
 static int read_config(int first_time); 
@@ -169,7 +223,20 @@ static int read_config(int first_time);
 // call this when we need to stop
 static void fatal(); 
 
-static void signal_handler(int, siginfo_t *, void *); 
+// start the next run (main thread only) 
+static void rollover(); 
+
+// called from the reload thread on an exit signal 
+static void on_quit(void *); 
+
+// called at the start of each thread (prefaults stack in realtime mode) 
+static void thread_init(const char * name); 
+
+/* Picks up the latest config snapshot if there is a new one. Returns 1 if it changed. */ 
+static int config_refresh(config_reader_t reader); 
+
+/* Marks a thread as no longer reading the config */ 
+static void config_release(config_reader_t reader); 
 
 /* Acquisition thread */ 
 static void * acq_thread(void * p);
@@ -180,6 +247,9 @@ static void * monitor_thread(void * p);
 /* Write thread */ 
 static void * write_thread(void * p ); 
 
+/* Control socket thread */ 
+static void * control_thread(void * p); 
+
 
 
 /* The main function... not too much here 
@@ -197,332 +267,1860 @@ int main(int nargs, char ** args)
   struct timespec now; 
   while(!die) 
   {
+    if (nuphase_reload_pending()) 
+    {
+      read_config(0); 
+    }
+
     clock_gettime(CLOCK_MONOTONIC_COARSE, &now); 
-    if ( now.tv_sec - start.tv_sec > config.run_length) 
+    if (__atomic_exchange_n(&rollover_requested, 0, __ATOMIC_ACQ_REL)) 
     {
-      fatal(); 
+      printf("Rollover requested over the control socket\n"); 
+      rollover(); 
+      start = now; 
+    }
+    else if ( now.tv_sec - start.tv_sec > config.run_length) 
+    {
+      if (config.rollover) 
+      {
+        rollover(); 
+        start = now; 
+      }
+      else
+      {
+        fatal(); 
+      }
     }
 
-    usleep(500000);  //500 ms 
-    sched_yield();
+    nuphase_reload_sleep(0.5); 
   }
 
   return teardown(); 
 }
 
 
-
-/*** Acquistion thread 
- *
- * This will wait for data, then record and it and put it into a memory buffer, awaiting to be written to disk. 
- *
- * It's remarkably simple since nuphasedaq.so does all the hard work. 
- *
- ***/ 
-void * acq_thread(void *v) 
+///////////////////////////////////////////////////
+// device access scheduling 
+//
+// The acq thread and the monitor thread share the device. Event readout
+// always goes first: other device operations are queued as commands into
+// priority lanes and run in batches in the gaps between readouts. A batch
+// yields between commands whenever a readout is waiting, so the most a
+// readout can be held up by is one command. 
+
+typedef enum dev_op
 {
+  DEV_READ_STATUS, 
+  DEV_SET_THRESHOLDS, 
+  DEV_SW_TRIGGER, 
+  DEV_PHASED_TRIGGER, 
+  DEV_NOPS 
+} dev_op_t; 
 
+static const char * dev_op_names[DEV_NOPS] = { "read_status", "set_thresholds", "sw_trigger", "phased_trigger" }; 
 
-  while(!die) 
-  {
-   /* grab a buffer to fill */ 
-    acq_buffer_t * mem = (acq_buffer_t*) nuphase_buf_getmem(acq_buffer); 
-    mem->nfilled = 0; //nothing filled
-
-    while (!mem->nfilled && !die) 
-    {
-      mem->nfilled = nuphase_wait_for_and_read_multiple_events(device, &mem->headers, &mem->events, 
-                                                               &mem->surface_header, &mem->surface_event,
-                                                               &mem->surface_filled);
-    }
-    nuphase_buf_commit(acq_buffer); // we filled it 
-  }
+typedef enum dev_lane
+{
+  LANE_CONTROL = 0,  // things that affect triggering (thresholds, sw triggers)
+  LANE_HK,           // status reads 
+  NUM_LANES
+} dev_lane_t; 
 
-  return 0; 
+typedef struct dev_cmd
+{
+  dev_op_t op; 
+  nuphase_status_t * status;  //for DEV_READ_STATUS 
+  uint32_t thresholds[NP_NUM_BEAMS];  //for DEV_SET_THRESHOLDS
+  int arg;  // surface readout for DEV_READ_STATUS, enable for DEV_PHASED_TRIGGER 
+  int ret; 
+  volatile int done; 
+  struct dev_cmd * next; 
+} dev_cmd_t; 
+
+typedef struct dev_sched_stats
+{
+  uint64_t nreadouts; 
+  uint64_t nreadout_waits;   // readouts that had to wait for a command in flight 
+  uint64_t readout_wait_ns;  
+  uint64_t max_readout_wait_ns; 
+  uint64_t ncmds; 
+  uint64_t nbatches; 
+  uint64_t nyields;          // times a batch paused to let a readout through
+  uint64_t op_count[DEV_NOPS]; 
+  uint64_t op_ns[DEV_NOPS];  // time spent executing each kind of command
+} dev_sched_stats_t; 
+
+static struct 
+{
+  pthread_mutex_t lock; 
+  pthread_cond_t readout_cond;  // signalled when a command finishes 
+  pthread_cond_t gap_cond;      // signalled when a readout finishes 
+  pthread_cond_t done_cond;     // signalled when any command is done
+  dev_cmd_t * head[NUM_LANES]; 
+  dev_cmd_t * tail[NUM_LANES]; 
+  int readout_active; 
+  int readout_waiting; 
+  int cmd_active; 
+  dev_sched_stats_t stats; 
+} dev_sched = { .readout_cond = PTHREAD_COND_INITIALIZER, .gap_cond = PTHREAD_COND_INITIALIZER, .done_cond = PTHREAD_COND_INITIALIZER }; 
+
+
+static void dev_sched_init() 
+{
+  //priority inheritance, since the acq thread may be realtime 
+  pthread_mutexattr_t attr; 
+  pthread_mutexattr_init(&attr); 
+  pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT); 
+  pthread_mutex_init(&dev_sched.lock, &attr); 
+  pthread_mutexattr_destroy(&attr); 
 }
 
+static dev_lane_t dev_cmd_lane(const dev_cmd_t * cmd) 
+{
+  return cmd->op == DEV_READ_STATUS ? LANE_HK : LANE_CONTROL; 
+}
 
+static int dev_cmd_execute(dev_cmd_t * cmd) 
+{
+  switch (cmd->op) 
+  {
+    case DEV_READ_STATUS: 
+      return nuphase_read_status(device, cmd->status, cmd->arg); 
+    case DEV_SET_THRESHOLDS: 
+      return nuphase_set_thresholds(device, cmd->thresholds, 0); 
+    case DEV_SW_TRIGGER: 
+      return nuphase_sw_trigger(device); 
+    case DEV_PHASED_TRIGGER: 
+      return nuphase_phased_trigger_readout(device, cmd->arg); 
+    default: 
+      return -1; 
+  }
+}
 
-///////////////////////////////////////////////////
-// stuff for keeping track of fast scaler averages 
+/* Queue a command. The command must stay valid until it is done. */ 
+static void dev_sched_submit(dev_cmd_t * cmd) 
+{
+  dev_lane_t lane = dev_cmd_lane(cmd); 
+  cmd->done = 0; 
+  cmd->next = 0; 
+
+  pthread_mutex_lock(&dev_sched.lock); 
+  if (dev_sched.tail[lane]) dev_sched.tail[lane]->next = cmd; 
+  else dev_sched.head[lane] = cmd; 
+  dev_sched.tail[lane] = cmd; 
+  pthread_mutex_unlock(&dev_sched.lock); 
+}
 
-static struct
+/* Runs everything queued, highest priority lane first, in the gaps between readouts */ 
+static void dev_sched_run() 
 {
-  uint16_t * buf[NP_NUM_BEAMS]; 
-  uint32_t sum[NP_NUM_BEAMS]; 
-  size_t sz; 
-  size_t i; 
-} fs_avg = { .buf = {0}, .sum={0}, .sz = 0, .i = 0 }; 
+  pthread_mutex_lock(&dev_sched.lock); 
+  int first = 1; 
+  while (1) 
+  {
+    int lane; 
+    dev_cmd_t * cmd = 0; 
 
+    // wait for a gap (or for another thread running commands to finish) 
+    while (dev_sched.readout_active || dev_sched.readout_waiting || dev_sched.cmd_active) 
+    {
+      if (!first && dev_sched.readout_waiting) dev_sched.stats.nyields++; 
+      pthread_cond_wait(&dev_sched.gap_cond, &dev_sched.lock); 
+    }
 
+    for (lane = 0; lane < NUM_LANES; lane++) 
+    {
+      if (dev_sched.head[lane]) 
+      {
+        cmd = dev_sched.head[lane]; 
+        dev_sched.head[lane] = cmd->next; 
+        if (!dev_sched.head[lane]) dev_sched.tail[lane] = 0; 
+        break; 
+      }
+    }
 
+    if (!cmd) break; 
+
+    if (first) dev_sched.stats.nbatches++; 
+    first = 0; 
+    dev_sched.cmd_active = 1; 
+    pthread_mutex_unlock(&dev_sched.lock); 
+
+    struct timespec op_start, op_end; 
+    clock_gettime(CLOCK_MONOTONIC, &op_start); 
+    int ret = dev_cmd_execute(cmd); 
+    clock_gettime(CLOCK_MONOTONIC, &op_end); 
+
+    pthread_mutex_lock(&dev_sched.lock); 
+    dev_sched.stats.op_count[cmd->op]++; 
+    dev_sched.stats.op_ns[cmd->op] += (op_end.tv_sec - op_start.tv_sec) * 1000000000ll + op_end.tv_nsec - op_start.tv_nsec; 
+    cmd->ret = ret; 
+    cmd->done = 1; 
+    dev_sched.cmd_active = 0; 
+    dev_sched.stats.ncmds++; 
+    pthread_cond_broadcast(&dev_sched.done_cond); 
+    pthread_cond_signal(&dev_sched.readout_cond); 
+    pthread_cond_broadcast(&dev_sched.gap_cond); 
+  }
+  pthread_mutex_unlock(&dev_sched.lock); 
+}
 
-static void fs_avg_init(int n) 
+/* Wait for a submitted command to be done (another thread's dev_sched_run may have picked it up). 
+ * Returns what the command returned. */ 
+static int dev_sched_wait(dev_cmd_t * cmd) 
 {
-  int ibeam = 0;
-
-  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
-  {
-    fs_avg.buf[ibeam] = calloc(n * sizeof(*fs_avg.buf[ibeam]),1); 
-    fs_avg.sum[ibeam] = 0;
-  }
+  pthread_mutex_lock(&dev_sched.lock); 
+  while (!cmd->done) pthread_cond_wait(&dev_sched.done_cond, &dev_sched.lock); 
+  pthread_mutex_unlock(&dev_sched.lock); 
+  return cmd->ret; 
+}
 
- fs_avg.sz = n; 
- fs_avg.i = 0; 
+/* Queue a command, run the queue and wait for it to be done. */ 
+static int dev_sched_do(dev_cmd_t * cmd) 
+{
+  dev_sched_submit(cmd); 
+  dev_sched_run(); 
+  return dev_sched_wait(cmd); 
 }
 
-static void fs_avg_add(const nuphase_status_t *st) 
+/* Called by the acq thread around a readout. Only waits for a command already in flight */ 
+static void dev_sched_readout_begin() 
 {
-  int ibeam = 0; 
-  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  pthread_mutex_lock(&dev_sched.lock); 
+  dev_sched.readout_waiting = 1; 
+  if (dev_sched.cmd_active) 
   {
-    uint16_t val = st->beam_scalers[SCALER_FAST][ibeam]; 
-    fs_avg.sum[ibeam] -= fs_avg.buf[ibeam][fs_avg.i % fs_avg.sz];
-    fs_avg.sum[ibeam] += val; 
-    fs_avg.buf[ibeam][fs_avg.i % fs_avg.sz] = val; 
+    struct timespec start, end; 
+    clock_gettime(CLOCK_MONOTONIC, &start); 
+    while (dev_sched.cmd_active) pthread_cond_wait(&dev_sched.readout_cond, &dev_sched.lock); 
+    clock_gettime(CLOCK_MONOTONIC, &end); 
+
+    uint64_t waited = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec; 
+    dev_sched.stats.nreadout_waits++; 
+    dev_sched.stats.readout_wait_ns += waited; 
+    if (waited > dev_sched.stats.max_readout_wait_ns) dev_sched.stats.max_readout_wait_ns = waited; 
   }
-  fs_avg.i++;
+  dev_sched.readout_waiting = 0; 
+  dev_sched.readout_active = 1; 
+  dev_sched.stats.nreadouts++; 
+  pthread_mutex_unlock(&dev_sched.lock); 
 }
 
-static double fs_avg_get(int ibeam) 
+static void dev_sched_readout_end() 
 {
-  int max = fs_avg.i < fs_avg.sz ? fs_avg.i : fs_avg.sz; 
-  return ((double) fs_avg.sum[ibeam]) / max; 
+  pthread_mutex_lock(&dev_sched.lock); 
+  dev_sched.readout_active = 0; 
+  pthread_cond_broadcast(&dev_sched.gap_cond); 
+  pthread_mutex_unlock(&dev_sched.lock); 
 }
 
-static void fs_avg_print(FILE * f) 
+static void dev_sched_get_stats(dev_sched_stats_t * stats) 
 {
-  int ibeam;
-  fprintf(f,"Running average of %zu fast scalers:\n\t", fs_avg.i < fs_avg.sz ? fs_avg.i : fs_avg.sz); 
-  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
-  {
-    fprintf(f,"%0.4g  ", fs_avg_get(ibeam) ); 
-  }
-  fprintf(f,"\n"); 
+  pthread_mutex_lock(&dev_sched.lock); 
+  memcpy(stats, &dev_sched.stats, sizeof(*stats)); 
+  pthread_mutex_unlock(&dev_sched.lock); 
+}
+
+static void dev_sched_print(FILE * f) 
+{
+  dev_sched_stats_t st; 
+  dev_sched_get_stats(&st); 
+  fprintf(f,"  device access: %"PRIu64" readouts (%"PRIu64" waited, total %g ms, max %g ms), %"PRIu64" commands in %"PRIu64" batches, %"PRIu64" yields\n", 
+          st.nreadouts, st.nreadout_waits, st.readout_wait_ns * 1e-6, st.max_readout_wait_ns * 1e-6, st.ncmds, st.nbatches, st.nyields); 
 }
 
 ///
 /////////////////////////////////////////////////////
 
 
-
-/***********************************************************************
- * Monitor thread
- *
- * This will periodically grab the status / adjust thresholds / send software triggers
- *
- *  The PID loops lies within here. 
- ***************************************************************************************/
-void * monitor_thread(void *v) 
+///////////////////////////////////////////////////
+// livetime accounting 
+//
+// Time we could not trigger, integrated with monotonic timestamps, by source: 
+//   buffer_full: the acq thread waiting for a free slot in the acq buffer (so not reading out the board) 
+//   rollover: the acq thread switching the readout number offset to the next run (the board 
+//             keeps triggering across a rollover otherwise). It's counted in the old run. 
+//   phased_off: the phased trigger not enabled (e.g. before secs_before_phased_trigger) 
+// Each source has one writer thread. Totals are since startup; the write thread 
+// subtracts what they were at the start of each run. Sources can overlap, so the 
+// livetime from the sum is a lower bound. 
+
+enum
 {
+  DEAD_BUFFER_FULL, 
+  DEAD_ROLLOVER, 
+  DEAD_PHASED_OFF, 
+  DEAD_NSOURCES
+}; 
 
-  //The start time 
-  struct timespec start; 
-  clock_gettime(CLOCK_MONOTONIC, &start); 
-
+// (the names are shared with the metrics readers) 
+_Static_assert(DEAD_NSOURCES == NUPHASE_METRICS_NDEAD, "deadtime sources don't match nuphase-metrics.h"); 
+static const char ** dead_source_names = nuphase_metrics_dead_names; 
 
-  // this keeps track of when we sent the last sw trigger
-  struct timespec last_sw_trig = { .tv_sec = 0, .tv_nsec = 0};
+static struct 
+{
+  uint64_t total_ns[DEAD_NSOURCES];  // closed intervals 
+  uint64_t since_ns[DEAD_NSOURCES];  // start of the open interval, or 0 
+} deadtime; 
 
-  //this keeps track of the last time we monitored
-  struct timespec last_mon = { .tv_sec = 0, .tv_nsec = 0}; //dont' read scalers yet! 
+static uint64_t monotonic_ns() 
+{
+  struct timespec now; 
+  clock_gettime(CLOCK_MONOTONIC, &now); 
+  return now.tv_sec * 1000000000ull + now.tv_nsec; 
+}
 
+static void dead_begin(int src) 
+{
+  if (__atomic_load_n(&deadtime.since_ns[src], __ATOMIC_RELAXED)) return; 
+  __atomic_store_n(&deadtime.since_ns[src], monotonic_ns(), __ATOMIC_RELEASE); 
+}
 
+static void dead_end(int src) 
+{
+  uint64_t since = __atomic_load_n(&deadtime.since_ns[src], __ATOMIC_RELAXED); 
+  if (!since) return; 
+  __atomic_add_fetch(&deadtime.total_ns[src], monotonic_ns() - since, __ATOMIC_RELEASE); 
+  __atomic_store_n(&deadtime.since_ns[src], 0, __ATOMIC_RELEASE); 
+}
 
-  // the phased trigger status, so that we can turn it on or off as appropriate
-  // start as undefined
-  int phased_trigger_status = -1; 
+/* deadtime from a source since startup, including any open interval */ 
+static uint64_t dead_ns(int src, uint64_t now) 
+{
+  uint64_t since = __atomic_load_n(&deadtime.since_ns[src], __ATOMIC_ACQUIRE); 
+  uint64_t total = __atomic_load_n(&deadtime.total_ns[src], __ATOMIC_ACQUIRE); 
+  return total + (since && now > since ? now - since : 0); 
+}
 
-  while(!die) 
-  {
-    //figure out the current time
-    struct timespec now; 
-    clock_gettime(CLOCK_MONOTONIC, &now); 
+/* The livetime of a run, kept by the write thread */ 
+typedef struct livetime
+{
+  int run; 
+  time_t start_time; 
+  uint64_t start_ns; 
+  uint64_t dead_at_start[DEAD_NSOURCES]; 
+} livetime_t; 
 
+// the current run's, only used by the write thread 
+static livetime_t run_livetime; 
 
-    /////////////////////////////////////////////////////
-    //turn on and off phased trigger as necessary
-    //  this is more complicated than it could be because the config
-    //  could be reread in the middle of the run. 
-    /////////////////////////////////////////////////////
-    if (config.enable_phased_trigger && phased_trigger_status != 1)
-    {
-      if (config.secs_before_phased_trigger)
-      {
-        struct timespec now; 
-        clock_gettime(CLOCK_MONOTONIC, &now); 
-        if (timespec_difference_float(&now,&start) > config.secs_before_phased_trigger)
-        {
-          nuphase_phased_trigger_readout(device, 1); 
-          phased_trigger_status = 1; 
-        }
-      }
-      else
-      {
-          nuphase_phased_trigger_readout(device, 1); 
-          phased_trigger_status = 1; 
-      }
-    }
-    else if (!config.enable_phased_trigger && phased_trigger_status == 1)
-    {
-      nuphase_phased_trigger_readout(device, 0); 
-      phased_trigger_status = 0; 
-    }
+static void livetime_start(livetime_t * lt, int run) 
+{
+  int i; 
+  lt->run = run; 
+  lt->start_time = time(0); 
+  lt->start_ns = monotonic_ns(); 
+  for (i = 0; i < DEAD_NSOURCES; i++) lt->dead_at_start[i] = dead_ns(i, lt->start_ns); 
+}
 
- 
-    /// Figure out how long it's been since last time we monitored and sent a software trigger
-    float diff_mon = timespec_difference_float(&now, &last_mon); 
-    float diff_swtrig = timespec_difference_float(&now, &last_sw_trig); 
+/* fills dead[] with the per-source deadtime of the run and returns the elapsed time, both in ns */ 
+static uint64_t livetime_get(const livetime_t * lt, uint64_t * dead, uint64_t * dead_sum) 
+{
+  int i; 
+  uint64_t now = monotonic_ns(); 
+  *dead_sum = 0; 
+  for (i = 0; i < DEAD_NSOURCES; i++) 
+  {
+    dead[i] = dead_ns(i, now) - lt->dead_at_start[i]; 
+    *dead_sum += dead[i]; 
+  }
+  return now - lt->start_ns; 
+}
 
-    //////////////////////////////////////////////////////
-    //read the status, and react to it 
-    // herein lies the PID loop and all those wonderful things
-    //////////////////////////////////////////////////////
-    if (config.monitor_interval &&  diff_mon > config.monitor_interval)
-    {
-      monitor_buffer_t mb; 
-      nuphase_status_t *st = &mb.status;
+static double livetime_fraction(uint64_t elapsed, uint64_t dead_sum) 
+{
+  if (!elapsed) return 1; 
+  return dead_sum >= elapsed ? 0 : 1 - ((double) dead_sum) / elapsed; 
+}
 
-      nuphase_read_status(device, st, config.surface_readout); 
- //     nuphase_status_print(stdout,st); 
+/* one line, for the screen and the acq log */ 
+static void livetime_format(const livetime_t * lt, char * buf, size_t len) 
+{
+  uint64_t dead[DEAD_NSOURCES], dead_sum; 
+  uint64_t elapsed = livetime_get(lt, dead, &dead_sum); 
+  int i; 
+  size_t n = snprintf(buf, len, "livetime: run %d, %0.1f s elapsed, fraction %0.5f, dead (s):", 
+                      lt->run, elapsed * 1e-9, livetime_fraction(elapsed, dead_sum)); 
+  for (i = 0; i < DEAD_NSOURCES && n < len; i++) 
+  {
+    n += snprintf(buf + n, len - n, " %s=%0.3f", dead_source_names[i], dead[i] * 1e-9); 
+  }
+}
 
-      int ibeam; 
-      fs_avg_add(st); 
-      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
-      {
+/* Writes the livetime record of a run to run%d/aux/livetime (atomically, via a rename) */ 
+static void livetime_write(const livetime_t * lt) 
+{
+  char path[strlen(config.output_directory) + 512]; 
+  char tmp[sizeof(path) + sizeof(tmp_suffix)]; 
+  snprintf(path, sizeof(path), "%s/run%d/aux/livetime", config.output_directory, lt->run); 
+  snprintf(tmp, sizeof(tmp), "%s%s", path, tmp_suffix); 
 
-       
-        ///// REVISIT THIS 
-        ///// We need to figure out how to use both the fast and slow scalers
-        ///// For now, take a weighted average of the fast and slow scalers to determine the rate. 
-        double measured_slow = ((double) st->beam_scalers[SCALER_SLOW][ibeam]) / NP_SCALER_TIME(SCALER_SLOW); 
-        double measured_fast = fs_avg_get(ibeam) / NP_SCALER_TIME(SCALER_FAST); 
-        double measured =  (config.slow_scaler_weight * measured_slow + config.fast_scaler_weight * measured_fast) / (config.slow_scaler_weight + config.fast_scaler_weight); 
-
-        if (config.subtract_gated) 
-        {
-          double measured_gated_slow = ((double) st->beam_scalers[SCALER_SLOW_GATED][ibeam]) / NP_SCALER_TIME(SCALER_SLOW_GATED); 
-          measured -= measured_gated_slow; 
-        }
+  FILE * f = fopen(tmp,"w"); 
+  if (!f) 
+  {
+    fprintf(stderr,"Could not write %s: %s\n", tmp, strerror(errno)); 
+    return; 
+  }
 
-        double e =  measured - config.scaler_goal[ibeam]; 
-        control.error[ibeam] = e; 
-        double de = 0;
+  uint64_t dead[DEAD_NSOURCES], dead_sum; 
+  uint64_t elapsed = livetime_get(lt, dead, &dead_sum); 
+  int i; 
 
-        // only compute difference after first iteration
-        if (control.nsum > 0) 
-        {
-          de = (measured - control.last_measured[ibeam]) / diff_mon; 
-        }
+  fprintf(f,"run=%d\n", lt->run); 
+  fprintf(f,"start_time=%u\n", (unsigned) lt->start_time); 
+  fprintf(f,"end_time=%u\n", (unsigned) time(0)); 
+  fprintf(f,"elapsed_ns=%"PRIu64"\n", elapsed); 
+  for (i = 0; i < DEAD_NSOURCES; i++) 
+  {
+    fprintf(f,"dead.%s_ns=%"PRIu64"\n", dead_source_names[i], dead[i]); 
+  }
+  fprintf(f,"dead_ns=%"PRIu64"\n", dead_sum); 
+  fprintf(f,"livetime_fraction=%0.6f\n", livetime_fraction(elapsed, dead_sum)); 
+  fclose(f); 
+  rename(tmp, path); 
+}
 
-        control.sum_error[ibeam] += e; 
-        control.nsum++; 
-        double ie = control.sum_error[ibeam]; 
+///
+/////////////////////////////////////////////////////
 
-        control.last_measured[ibeam] = measured; 
 
-        // modify threshold 
-        double dthreshold =   control.k_p * e + control.k_i * ie * control.k_d * de; 
-        
-        //cap the threshold increase at each step 
-        if (dthreshold > config.max_threshold_increase) dthreshold = config.max_threshold_increase; 
+/*** Acquistion thread 
+ *
+ * This will wait for data, then record and it and put it into a memory buffer, awaiting to be written to disk. 
+ *
+ * It's remarkably simple since nuphasedaq.so does all the hard work. 
+ *
+ ***/ 
 
-        mb.thresholds[ibeam] = st->trigger_thresholds[ibeam] + dthreshold; 
+/* how long (in seconds) to wait for data before checking if we should stop */ 
+#define ACQ_WAIT_TIMEOUT 0.5 
 
+/* counters for the metrics (only the acq thread writes them) */ 
+static struct 
+{
+  volatile uint64_t nreadouts; 
+  volatile uint64_t nevents; 
+} acq_counters; 
 
-//        printf("BEAM %d\n", ibeam); 
-//        printf("  slow scaler: %f, fast_scaler: %f, avg: %f\n", measured_slow, measured_fast, measured); 
-//        printf("  e: %f, ie: %f , de: %f\n", e,ie,de); 
-//        printf("  new threshold %d (old: %d)\n", mb.thresholds[ibeam], st->trigger_thresholds[ibeam]); 
-      }
+void * acq_thread(void *v) 
+{
+  config_refresh(CFG_READER_ACQ); 
+  thread_init("acq"); 
+  int acq_run = next_run; 
 
-      //apply the thresholds 
-      nuphase_set_thresholds(device, mb.thresholds,0); 
-      
-      //copy over the current control status 
-      memcpy(&mb.control, &control, sizeof(control)); 
+  while(!die) 
+  {
+    config_refresh(CFG_READER_ACQ); 
 
-      nuphase_buf_push(mon_buffer, &mb);
-      memcpy(&last_mon,&now, sizeof(now)); 
-      diff_mon = 0; 
+    // new run? switch the event numbering between readouts 
+    int want_run = __atomic_load_n(&next_run, __ATOMIC_ACQUIRE); 
+    if (want_run != acq_run) 
+    {
+      dev_sched_readout_begin(); 
+      dead_begin(DEAD_ROLLOVER); 
+      nuphase_set_readout_number_offset(device, ((uint64_t) want_run) * 1000000000); 
+      dead_end(DEAD_ROLLOVER); 
+      dev_sched_readout_end(); 
+      acq_run = want_run; 
     }
 
-    if (config.sw_trigger_interval && diff_swtrig > config.sw_trigger_interval)
+   /* grab a buffer to fill (if it's full, we're dead until the write thread catches up) */ 
+    if (nuphase_buf_occupancy(acq_buffer) >= nuphase_buf_capacity(acq_buffer)) dead_begin(DEAD_BUFFER_FULL); 
+    acq_buffer_t * mem = (acq_buffer_t*) nuphase_buf_getmem(acq_buffer); 
+    dead_end(DEAD_BUFFER_FULL); 
+    mem->nfilled = 0; //nothing filled
+    mem->run = acq_run; 
+
+    while (!mem->nfilled && !die) 
     {
-      nuphase_sw_trigger(device); 
-      memcpy(&last_sw_trig,&now, sizeof(now)); 
-      diff_swtrig = 0;
-    }
+      // wait for data without claiming the device, so other commands can go in the gaps
+      nuphase_buffer_mask_t ready = 0; 
+      nuphase_wait(device, &ready, ACQ_WAIT_TIMEOUT, MASTER); 
+      if (!ready) continue; 
 
-    //now figure out how long to sleep 
-    //
-    float how_long_to_sleep = 0.1; //don't sleep longer than 100 ms 
+      clock_gettime(CLOCK_MONOTONIC, &mem->t_readout); 
+      dev_sched_readout_begin(); 
+      mem->nfilled = nuphase_wait_for_and_read_multiple_events(device, &mem->headers, &mem->events, 
+                                                               &mem->surface_header, &mem->surface_event,
+                                                               &mem->surface_filled);
+      dev_sched_readout_end(); 
+    }
 
-    if (config.monitor_interval && config.monitor_interval - diff_mon  < how_long_to_sleep) how_long_to_sleep = config.monitor_interval - diff_mon; 
-    if (config.sw_trigger_interval && config.sw_trigger_interval - diff_swtrig  < how_long_to_sleep) how_long_to_sleep = config.sw_trigger_interval - diff_swtrig; 
+    acq_counters.nreadouts++; 
+    acq_counters.nevents += mem->nfilled + (mem->surface_filled > 0); 
 
-    usleep(how_long_to_sleep * 1e6); 
+    clock_gettime(CLOCK_MONOTONIC, &mem->t_commit); 
+    nuphase_buf_commit(acq_buffer); // we filled it 
   }
 
+  config_release(CFG_READER_ACQ); 
   return 0; 
 }
 
 
-const char * subdirs[] = {"event","header","status","aux","cfg"}; 
-const int nsubdirs = sizeof(subdirs) / sizeof(*subdirs); 
-
-//this makes the necessary directories for a time 
-//returns 0 on success. 
-static int make_dirs_for_output(const char * prefix) 
-{ 
-  char buf[strlen(prefix) + 512];  
 
-  //check to see that prefix exists and is a directory
-  if (mkdir_if_needed(prefix))
+/* Threshold writes. The controller's thresholds are tracked as doubles so that 
+ * small corrections accumulate, and are only written to the device when some beam
+ * moves by at least threshold_deadband from what was last applied (or the device 
+ * doesn't have what we last applied). */ 
+static struct 
+{
+  double target[NP_NUM_BEAMS];     // where the controller wants the thresholds 
+  uint32_t applied[NP_NUM_BEAMS];  // what we last wrote
+  int have_target; 
+  int force;  // write them even if within the deadband (set over the control socket) 
+  volatile uint64_t nwrites; 
+  volatile uint64_t nsuppressed; 
+  volatile uint64_t nupdates;  // monitor updates 
+} thresholds; 
+
+/* returns 1 if the target thresholds need to be written */ 
+static int thresholds_need_write(const nuphase_status_t * st) 
+{
+  int ibeam; 
+  if (thresholds.force) return 1; 
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
   {
-    fprintf(stderr,"Couldn't find %s or it's not a directory. Bad things will happen!\n",prefix); 
-    return 1; 
+    if (st->trigger_thresholds[ibeam] != thresholds.applied[ibeam]) return 1; 
+    if (fabs(thresholds.target[ibeam] - thresholds.applied[ibeam]) >= (config.threshold_deadband > 1 ? config.threshold_deadband : 1)) return 1; 
   }
+  return 0; 
+}
 
+/* estimated device time saved by suppressed threshold writes, in ms */ 
+static double thresholds_saved_ms(const dev_sched_stats_t * st) 
+{
+  if (!st->op_count[DEV_SET_THRESHOLDS]) return 0; 
+  return 1e-6 * thresholds.nsuppressed * st->op_ns[DEV_SET_THRESHOLDS] / st->op_count[DEV_SET_THRESHOLDS]; 
+}
 
-  int i;
+/* The housekeeping that nuphase-hk publishes in shared memory (see nuphase-hkshm.h), mapped read-only 
+ * (for the temperature feed-forward). If it's not there yet, we try again every once in a while. 
+ * If nuphase-hk remakes it (e.g. a different shm_nsamples), it's mapped again right away. */ 
+static nuphase_hk_shm_reader_t hk_shared; 
+static time_t hk_last_try = 0; 
 
-  for (i = 0; i < nsubdirs; i++)
+static const nuphase_hk_shm_reader_t * hk_map() 
+{
+  if (hk_shared.shm) 
   {
-    snprintf(buf,sizeof(buf), "%s/%s",prefix,subdirs[i]); 
-    if (mkdir_if_needed(buf))
-    {
-        fprintf(stderr,"Couldn't make %s. Bad things will happen!\n",buf); 
-        return 1; 
-    }
+    if (!nuphase_hk_shm_changed(&hk_shared)) return &hk_shared; 
+    nuphase_hk_shm_unmap(&hk_shared); 
+    hk_last_try = 0; 
   }
 
-  return 0; 
-}
-
+  time_t now = time(0); 
+  if (now - hk_last_try < 60) return 0; 
+  hk_last_try = now; 
 
-static char * output_dir = 0;
+  nuphase_hk_cfg_t hk_cfg; 
+  nuphase_hk_config_init(&hk_cfg); 
+  char * hk_cfg_file = 0; 
+  if (!nuphase_get_cfg_file(&hk_cfg_file, NUPHASE_HK))
+  {
+    nuphase_hk_config_read(hk_cfg_file, &hk_cfg); 
+  }
 
-void copy_configs() 
+  //nuphase-hk may not have made it yet 
+  if (nuphase_hk_shm_map(hk_cfg.shm_name, &hk_shared)) 
+  {
+    fprintf(stderr,"Could not map housekeeping shared memory %s. No temperature feed-forward for now.\n", hk_cfg.shm_name); 
+    return 0; 
+  }
+  return &hk_shared; 
+}
+
+/* the latest housekeeping from nuphase-hk. Returns 0 on success */ 
+static int hk_latest(nuphase_hk_t * hk) 
+{
+  const nuphase_hk_shm_reader_t * shared = hk_map(); 
+  return !shared || nuphase_hk_shm_latest(shared, hk, 0); 
+}
+
+/* the configured temperature from the live housekeeping. Returns 0 on success */ 
+static int hk_temperature(double * temp) 
+{
+  nuphase_hk_t hk; 
+  if (hk_latest(&hk)) return 1; 
+
+  //stale (e.g. nuphase-hk isn't running) 
+  if (time(0) - (time_t) hk.unixTime > config.ff_max_hk_age) return 1; 
+
+  const char * sensor = config.ff_temperature_sensor; 
+  *temp = !strcasecmp(sensor,"slave") ? hk.temp_slave : 
+          !strcasecmp(sensor,"case") ? hk.temp_case : 
+          !strcasecmp(sensor,"asps") ? hk.temp_asps_uc : 
+          hk.temp_master; 
+  return 0; 
+}
+
+/* the temperature feed-forward */ 
+static nuphase_ff_t feedforward; 
+
+static void ff_cfg_from_config(nuphase_ff_cfg_t * ff_cfg) 
+{
+  ff_cfg->fit_tau = config.ff_fit_tau; 
+  ff_cfg->temp_tau = config.ff_temperature_tau; 
+  ff_cfg->max_slope = config.ff_max_slope; 
+  ff_cfg->min_spread = config.ff_min_spread; 
+  ff_cfg->settled_fraction = config.ff_settled_fraction; 
+}
+
+/* the fast scaler averages */ 
+static nuphase_rate_t fs_avg; 
+
+/* fills in the rate estimation settings from the config */ 
+static void rate_cfg_from_config(nuphase_rate_cfg_t * rate_cfg) 
+{
+  rate_cfg->slow_weight = config.slow_scaler_weight; 
+  rate_cfg->fast_weight = config.fast_scaler_weight; 
+  rate_cfg->subtract_gated = config.subtract_gated; 
+  rate_cfg->estimator = config.rate_estimator; 
+  rate_cfg->ewma_tau = config.rate_ewma_tau; 
+  rate_cfg->process_noise = config.rate_process_noise; 
+}
+
+/* fills in the controller settings from the config */ 
+static void pid_cfg_from_config(nuphase_pid_cfg_t * pid_cfg) 
+{
+  int ibeam; 
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+  {
+    pid_cfg->gains[ibeam].k_p = config.k_p[ibeam]; 
+    pid_cfg->gains[ibeam].k_i = config.k_i[ibeam]; 
+    pid_cfg->gains[ibeam].k_d = config.k_d[ibeam]; 
+  }
+  pid_cfg->max_step_up = config.max_threshold_increase; 
+  pid_cfg->max_step_down = config.max_threshold_decrease; 
+  pid_cfg->max_integral = config.max_integral; 
+  pid_cfg->d_filter_tau = config.derivative_filter_tau; 
+  pid_cfg->schedule_ratio = config.gain_schedule_ratio; 
+  pid_cfg->schedule_factor = config.gain_schedule_factor; 
+  pid_cfg->noise_sigmas = config.rate_noise_sigmas; 
+}
+
+
+/* Controller checkpoint. 
+ *
+ * The status save file only has the thresholds, so after a restart the controller 
+ * would have to relearn everything else. The monitor thread periodically writes 
+ * the full controller state (threshold targets, pid state, rate estimator state 
+ * including the boxcar history, and the feed-forward fit) to checkpoint_file, 
+ * atomically via a rename. On startup, it's restored if it's recent enough, 
+ * has the right version and size and the crc32 matches. 
+ *
+ * The structs are written as they are in memory, so CHECKPOINT_VERSION must be bumped
+ * if any of them change (a size mismatch is also rejected). */ 
+
+#define CHECKPOINT_MAGIC 0x4b43504e  // "NPCK" 
+#define CHECKPOINT_VERSION 1 
+
+typedef struct checkpoint_header
+{
+  uint32_t magic; 
+  uint32_t version; 
+  uint32_t size;      // of what follows 
+  uint32_t crc;       // crc32 of what follows 
+  uint64_t time;      // unix time it was written 
+} checkpoint_header_t; 
+
+typedef struct checkpoint
+{
+  double target[NP_NUM_BEAMS]; 
+  uint32_t applied[NP_NUM_BEAMS]; 
+  nuphase_pid_t control; 
+  nuphase_ff_t feedforward; 
+
+  //the rate estimator, except for the boxcar history, which follows (boxcar_sz * NP_NUM_BEAMS uint16_t's) 
+  double ewma[NP_NUM_BEAMS]; 
+  double ewma_var[NP_NUM_BEAMS]; 
+  double x[NP_NUM_BEAMS]; 
+  double P[NP_NUM_BEAMS]; 
+  double slow_age; 
+  double rate[NP_NUM_BEAMS]; 
+  double variance[NP_NUM_BEAMS]; 
+  uint32_t boxcar_sum[NP_NUM_BEAMS]; 
+  uint64_t boxcar_i; 
+  uint64_t boxcar_sz; 
+} checkpoint_t; 
+
+/* Writes the checkpoint. Only called from the monitor thread (which owns the controller state). Returns 0 on success */ 
+static int checkpoint_write() 
+{
+  if (!config.checkpoint_file || !*config.checkpoint_file || !thresholds.have_target) return 1; 
+
+  size_t history_size = fs_avg.sz * NP_NUM_BEAMS * sizeof(uint16_t); 
+  size_t size = sizeof(checkpoint_t) + history_size; 
+  char * payload = malloc(size); 
+  if (!payload) return 1; 
+
+  checkpoint_t * ck = (checkpoint_t*) payload; 
+  memset(ck, 0, sizeof(*ck)); 
+  memcpy(ck->target, thresholds.target, sizeof(ck->target)); 
+  memcpy(ck->applied, thresholds.applied, sizeof(ck->applied)); 
+  memcpy(&ck->control, &control, sizeof(control)); 
+  memcpy(&ck->feedforward, &feedforward, sizeof(feedforward)); 
+  memcpy(ck->ewma, fs_avg.ewma, sizeof(ck->ewma)); 
+  memcpy(ck->ewma_var, fs_avg.ewma_var, sizeof(ck->ewma_var)); 
+  memcpy(ck->x, fs_avg.x, sizeof(ck->x)); 
+  memcpy(ck->P, fs_avg.P, sizeof(ck->P)); 
+  ck->slow_age = fs_avg.slow_age; 
+  memcpy(ck->rate, fs_avg.rate, sizeof(ck->rate)); 
+  memcpy(ck->variance, fs_avg.variance, sizeof(ck->variance)); 
+  memcpy(ck->boxcar_sum, fs_avg.sum, sizeof(ck->boxcar_sum)); 
+  ck->boxcar_i = fs_avg.i; 
+  ck->boxcar_sz = fs_avg.sz; 
+
+  int ibeam; 
+  uint16_t * history = (uint16_t*) (payload + sizeof(checkpoint_t)); 
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+  {
+    memcpy(history + ibeam * fs_avg.sz, fs_avg.buf[ibeam], fs_avg.sz * sizeof(uint16_t)); 
+  }
+
+  checkpoint_header_t hdr; 
+  hdr.magic = CHECKPOINT_MAGIC; 
+  hdr.version = CHECKPOINT_VERSION; 
+  hdr.size = size; 
+  hdr.crc = crc32(0, (const Bytef*) payload, size); 
+  hdr.time = time(0); 
+
+  char tmp[strlen(config.checkpoint_file) + sizeof(tmp_suffix)]; 
+  sprintf(tmp,"%s%s", config.checkpoint_file, tmp_suffix); 
+
+  int ret = 1; 
+  FILE * f = fopen(tmp,"w"); 
+  if (f) 
+  {
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(payload, size, 1, f) == 1; 
+    if (fclose(f)) ok = 0; 
+    if (ok && !rename(tmp, config.checkpoint_file)) ret = 0; 
+    else unlink(tmp); 
+  }
+
+  free(payload); 
+  return ret; 
+}
+
+/* Restores the controller state from the checkpoint, if it's good and recent enough. 
+ * Called from setup (after the first config read, before the threads start). Returns 0 if restored */ 
+static int checkpoint_restore() 
+{
+  if (!config.checkpoint_file || !*config.checkpoint_file) return 1; 
+
+  FILE * f = fopen(config.checkpoint_file,"r"); 
+  if (!f) return 1; 
+
+  checkpoint_header_t hdr; 
+  char * payload = 0; 
+  const char * why = 0; 
+
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CHECKPOINT_MAGIC) why = "not a checkpoint"; 
+  else if (hdr.version != CHECKPOINT_VERSION) why = "wrong version"; 
+  else if (hdr.size < sizeof(checkpoint_t) || hdr.size > sizeof(checkpoint_t) + (1<<24)) why = "wrong size"; 
+  else if (config.checkpoint_max_age > 0 && time(0) - (time_t) hdr.time > config.checkpoint_max_age) why = "too old"; 
+  else if (!(payload = malloc(hdr.size)) || fread(payload, hdr.size, 1, f) != 1) why = "truncated"; 
+  else if (crc32(0, (const Bytef*) payload, hdr.size) != hdr.crc) why = "bad checksum"; 
+  fclose(f); 
+
+  checkpoint_t * ck = (checkpoint_t*) payload; 
+  if (!why && hdr.size != sizeof(checkpoint_t) + ck->boxcar_sz * NP_NUM_BEAMS * sizeof(uint16_t)) why = "wrong size"; 
+
+  if (why) 
+  {
+    fprintf(stderr,"Not restoring controller state from %s: %s\n", config.checkpoint_file, why); 
+    free(payload); 
+    return 1; 
+  }
+
+  memcpy(thresholds.target, ck->target, sizeof(ck->target)); 
+  memcpy(thresholds.applied, ck->applied, sizeof(ck->applied)); 
+  thresholds.have_target = 1; 
+  memcpy(&control, &ck->control, sizeof(control)); 
+  memcpy(&feedforward, &ck->feedforward, sizeof(feedforward)); 
+  memcpy(fs_avg.ewma, ck->ewma, sizeof(ck->ewma)); 
+  memcpy(fs_avg.ewma_var, ck->ewma_var, sizeof(ck->ewma_var)); 
+  memcpy(fs_avg.x, ck->x, sizeof(ck->x)); 
+  memcpy(fs_avg.P, ck->P, sizeof(ck->P)); 
+  fs_avg.slow_age = ck->slow_age; 
+  memcpy(fs_avg.rate, ck->rate, sizeof(ck->rate)); 
+  memcpy(fs_avg.variance, ck->variance, sizeof(ck->variance)); 
+
+  //the boxcar history only if it's the same length (otherwise it starts over) 
+  if (ck->boxcar_sz == fs_avg.sz) 
+  {
+    int ibeam; 
+    const uint16_t * history = (const uint16_t*) (payload + sizeof(checkpoint_t)); 
+    for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+    {
+      memcpy(fs_avg.buf[ibeam], history + ibeam * fs_avg.sz, fs_avg.sz * sizeof(uint16_t)); 
+    }
+    memcpy(fs_avg.sum, ck->boxcar_sum, sizeof(ck->boxcar_sum)); 
+    fs_avg.i = ck->boxcar_i; 
+  }
+  else if (fs_avg.i == 0) 
+  {
+    //the estimators treat i == 0 as the first update, which would throw away the restored state 
+    fs_avg.i = 1; 
+  }
+
+  printf("Restored controller state from %s (written %u seconds ago)\n", config.checkpoint_file, (unsigned) (time(0) - (time_t) hdr.time)); 
+  free(payload); 
+  return 0; 
+}
+
+
+/* The control socket (see control_thread) and the monitor thread talk through this. 
+ * The monitor thread publishes the controller state after every update and 
+ * picks up threshold and goal changes at its safe point. It only ever trylocks, 
+ * so the control socket can never hold it up (it just tries again next time). */ 
+static struct 
+{
+  pthread_mutex_t lock; 
+
+  //published by the monitor thread 
+  int valid; 
+  double target[NP_NUM_BEAMS]; 
+  uint32_t applied[NP_NUM_BEAMS]; 
+  double goal[NP_NUM_BEAMS]; 
+  double rate[NP_NUM_BEAMS]; 
+  double rate_variance[NP_NUM_BEAMS]; 
+  nuphase_pid_t pid; 
+
+  //requested over the control socket 
+  int set_threshold[NP_NUM_BEAMS]; 
+  double threshold_request[NP_NUM_BEAMS]; 
+  int set_goal[NP_NUM_BEAMS]; 
+  double goal_request[NP_NUM_BEAMS]; 
+} control_shared = { .lock = PTHREAD_MUTEX_INITIALIZER }; 
+
+/* publishes the controller state (monitor thread only) */ 
+static void control_publish() 
+{
+  if (pthread_mutex_trylock(&control_shared.lock)) return; 
+  memcpy(control_shared.target, thresholds.target, sizeof(control_shared.target)); 
+  memcpy(control_shared.applied, thresholds.applied, sizeof(control_shared.applied)); 
+  memcpy(control_shared.goal, config.scaler_goal, sizeof(control_shared.goal)); 
+  memcpy(control_shared.rate, fs_avg.rate, sizeof(control_shared.rate)); 
+  memcpy(control_shared.rate_variance, fs_avg.variance, sizeof(control_shared.rate_variance)); 
+  memcpy(&control_shared.pid, &control, sizeof(control)); 
+  control_shared.valid = thresholds.have_target; 
+  pthread_mutex_unlock(&control_shared.lock); 
+}
+
+/* applies threshold and goal changes from the control socket (monitor thread only). 
+ * Goals go into the monitor thread's copy of the config, so they last until the config is reread. 
+ * New thresholds are where the controller continues from. Returns 1 if anything changed. */ 
+static int control_take_requests() 
+{
+  if (pthread_mutex_trylock(&control_shared.lock)) return 0; 
+
+  int changed = 0; 
+  int ibeam; 
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+  {
+    if (control_shared.set_goal[ibeam]) 
+    {
+      config.scaler_goal[ibeam] = control_shared.goal_request[ibeam]; 
+      control_shared.set_goal[ibeam] = 0; 
+      changed = 1; 
+    }
+
+    //(the first update starts from what the device has, so these wait until after it) 
+    if (control_shared.set_threshold[ibeam] && thresholds.have_target) 
+    {
+      double t = control_shared.threshold_request[ibeam]; 
+      thresholds.target[ibeam] = t > config.min_threshold ? t : config.min_threshold; 
+      thresholds.force = 1; 
+      control_shared.set_threshold[ibeam] = 0; 
+      changed = 1; 
+    }
+  }
+
+  pthread_mutex_unlock(&control_shared.lock); 
+  return changed; 
+}
+
+
+/***********************************************************************
+ * Monitor thread
+ *
+ * This will periodically grab the status / adjust thresholds / send software triggers
+ *
+ *  The PID loops lies within here. 
+ *
+ *  Everything is driven by timerfd's (monitor interval, sw trigger interval,
+ *  scaler sampling and the phased trigger delay) multiplexed with epoll, together with 
+ *  monitor_wakeup_fd, which is poked on config reloads and when exiting. 
+ *  The interval timers are periodic on an absolute schedule, so they don't drift, 
+ *  and the thread sleeps until one of them goes off. 
+ ***************************************************************************************/
+
+typedef enum monitor_event
+{
+  MON_EV_MONITOR, 
+  MON_EV_SW_TRIGGER, 
+  MON_EV_PHASED_TRIGGER, 
+  MON_EV_SCALERS, 
+  MON_EV_WAKEUP, 
+  MON_NEV 
+} monitor_event_t; 
+
+/* Scaler samples. 
+ *
+ * The scalers update much more often than the monitor interval, so (if
+ * scaler_sample_interval > 0) the monitor thread also samples them on their own
+ * timer into this ring. Each sample is a full nuphase_read_status (libnuphase has no
+ * scaler-only read), which is why it's off by default. Each monitor update the rate estimator consumes 
+ * everything sampled since the last one (including the status read for the update itself), 
+ * so the controller sees every fast scaler value while running at its own cadence. 
+ * Only touched by the monitor thread, except for the counters. 
+ */ 
+#define SCALER_RING_SIZE 1024 
+
+typedef struct scaler_sample 
+{
+  struct timespec t; 
+  uint16_t beam_scalers[NP_NUM_SCALERS][NP_NUM_BEAMS]; 
+} scaler_sample_t; 
+
+static struct 
+{
+  scaler_sample_t samples[SCALER_RING_SIZE]; 
+  uint64_t head;   // next to write
+  uint64_t tail;   // next to consume 
+  struct timespec last;  // time of the last consumed sample 
+  volatile uint64_t nsamples; 
+  volatile uint64_t noverruns; 
+} scaler_ring; 
+
+static void scaler_ring_push(const nuphase_status_t * st, const struct timespec * t) 
+{
+  scaler_sample_t * s = &scaler_ring.samples[scaler_ring.head % SCALER_RING_SIZE]; 
+  s->t = *t; 
+  memcpy(s->beam_scalers, st->beam_scalers, sizeof(s->beam_scalers)); 
+  scaler_ring.head++; 
+  scaler_ring.nsamples++; 
+
+  //drop the oldest if we lapped it 
+  if (scaler_ring.head - scaler_ring.tail > SCALER_RING_SIZE) 
+  {
+    scaler_ring.tail = scaler_ring.head - SCALER_RING_SIZE; 
+    scaler_ring.noverruns++; 
+  }
+}
+
+/* feeds everything in the ring to the rate estimator. st is the latest full status, 
+ * which supplies everything other than the scalers. Returns the number of samples used. */ 
+static int scaler_ring_consume(nuphase_rate_t * rate, const nuphase_rate_cfg_t * rate_cfg, const nuphase_status_t * st, double default_dt) 
+{
+  int n = 0; 
+  nuphase_status_t tmp; 
+  memcpy(&tmp, st, sizeof(tmp)); 
+
+  while (scaler_ring.tail != scaler_ring.head) 
+  {
+    const scaler_sample_t * s = &scaler_ring.samples[scaler_ring.tail % SCALER_RING_SIZE]; 
+    double dt = scaler_ring.last.tv_sec ? timespec_difference_float(&s->t, &scaler_ring.last) : default_dt; 
+    memcpy(tmp.beam_scalers, s->beam_scalers, sizeof(tmp.beam_scalers)); 
+    nuphase_rate_update(rate, rate_cfg, &tmp, dt); 
+    scaler_ring.last = s->t; 
+    scaler_ring.tail++; 
+    n++; 
+  }
+
+  return n; 
+}
+
+/* arms a timerfd to go off at first (absolute, CLOCK_MONOTONIC), then every interval seconds (if > 0) */ 
+static void arm_timer(int fd, const struct timespec * first, double interval) 
+{
+  struct itimerspec its; 
+  its.it_value = *first; 
+  its.it_interval.tv_sec = (time_t) interval; 
+  its.it_interval.tv_nsec = (interval - its.it_interval.tv_sec) * 1e9; 
+  timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, 0); 
+}
+
+static void disarm_timer(int fd) 
+{
+  struct itimerspec its; 
+  memset(&its,0,sizeof(its)); 
+  timerfd_settime(fd, 0, &its, 0); 
+}
+
+/* a time some number of seconds after t */ 
+static struct timespec timespec_after(const struct timespec * t, double secs) 
+{
+  struct timespec ans = *t; 
+  long long nsecs = ans.tv_nsec + (long long) (secs * 1e9); 
+  ans.tv_sec += nsecs / 1000000000; 
+  ans.tv_nsec = nsecs % 1000000000; 
+  return ans; 
+}
+
+/* (re)arms the periodic timers if their intervals changed, starting a period from now */ 
+static void monitor_arm_periodic(int fd, double * current, double interval) 
+{
+  if (*current == interval) return; 
+  *current = interval; 
+
+  if (interval > 0) 
+  {
+    struct timespec now; 
+    clock_gettime(CLOCK_MONOTONIC, &now); 
+    struct timespec first = timespec_after(&now, interval); 
+    arm_timer(fd, &first, interval); 
+  }
+  else
+  {
+    disarm_timer(fd); 
+  }
+}
+
+/* returns the number of expirations, (or 0 if none) */ 
+static uint64_t read_timer(int fd) 
+{
+  uint64_t n = 0; 
+  if (read(fd, &n, sizeof(n)) != sizeof(n)) return 0; 
+  return n; 
+}
+
+void * monitor_thread(void *v) 
+{
+  config_refresh(CFG_READER_MONITOR); 
+  thread_init("monitor"); 
+
+  //The start time 
+  struct timespec start; 
+  clock_gettime(CLOCK_MONOTONIC, &start); 
+
+  //this keeps track of the last time we monitored
+  struct timespec last_mon = { .tv_sec = 0, .tv_nsec = 0}; //dont' read scalers yet! 
+
+  // the phased trigger status, so that we can turn it on or off as appropriate
+  // start as undefined
+  int phased_trigger_status = -1; 
+
+  // monitor updates since the last checkpoint 
+  int ncheckpoint_cycles = 0; 
+  dead_begin(DEAD_PHASED_OFF); 
+
+  // device commands
+  dev_cmd_t phased_cmd = { .op = DEV_PHASED_TRIGGER }; 
+  dev_cmd_t status_cmd = { .op = DEV_READ_STATUS }; 
+  dev_cmd_t thresholds_cmd = { .op = DEV_SET_THRESHOLDS }; 
+  dev_cmd_t sw_trigger_cmd = { .op = DEV_SW_TRIGGER }; 
+
+  // scratch status for the scaler sampler 
+  nuphase_status_t sample_status; 
+  dev_cmd_t sample_cmd = { .op = DEV_READ_STATUS, .status = &sample_status }; 
+
+  // the timers 
+  int fds[MON_NEV]; 
+  fds[MON_EV_MONITOR] = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK); 
+  fds[MON_EV_SW_TRIGGER] = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK); 
+  fds[MON_EV_PHASED_TRIGGER] = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK); 
+  fds[MON_EV_SCALERS] = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK); 
+  fds[MON_EV_WAKEUP] = monitor_wakeup_fd; 
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC); 
+  int i; 
+  for (i = 0; i < MON_NEV; i++) 
+  {
+    struct epoll_event ev; 
+    ev.events = EPOLLIN; 
+    ev.data.u32 = i; 
+    if (fds[i] < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev))
+    {
+      fprintf(stderr,"Could not set up monitor thread event loop (%s)!\n", strerror(errno)); 
+      fatal(); 
+      return 0; 
+    }
+  }
+
+  double current_monitor_interval = 0; 
+  double current_sw_trigger_interval = 0; 
+  double current_scaler_sample_interval = 0; 
+  uint64_t missed_sw_triggers = 0; 
+
+  //force everything to be set up the first time around
+  int reconfigure = 1; 
+
+  while(!die) 
+  {
+    int do_monitor = 0; 
+    int do_sw_trigger = 0; 
+    int do_phased = 0; 
+    int do_sample = 0; 
+    int thresholds_set = 0; 
+
+    if (!reconfigure) 
+    {
+      struct epoll_event evs[MON_NEV]; 
+      int nev = epoll_wait(epfd, evs, MON_NEV, -1); 
+      if (nev < 0) continue; //probably EINTR 
+
+      for (i = 0; i < nev; i++) 
+      {
+        uint64_t n = read_timer(fds[evs[i].data.u32]); 
+        switch (evs[i].data.u32) 
+        {
+          case MON_EV_MONITOR: 
+            do_monitor = n > 0; 
+            break; 
+          case MON_EV_SW_TRIGGER: 
+            do_sw_trigger = n > 0; 
+            if (n > 1) missed_sw_triggers += n-1; 
+            break; 
+          case MON_EV_PHASED_TRIGGER: 
+            do_phased = n > 0; 
+            break; 
+          case MON_EV_SCALERS: 
+            do_sample = n > 0; 
+            break; 
+          case MON_EV_WAKEUP: 
+            reconfigure = n > 0; 
+            break; 
+        }
+      }
+    }
+
+    if (die) break; 
+
+    //a safe point to pick up a new config (a reload also pokes us, setting reconfigure) 
+    config_refresh(CFG_READER_MONITOR); 
+
+    //and anything asked for over the control socket (which also pokes us) 
+    int publish = control_take_requests(); 
+
+    if (reconfigure) 
+    {
+      monitor_arm_periodic(fds[MON_EV_MONITOR], &current_monitor_interval, config.monitor_interval); 
+      monitor_arm_periodic(fds[MON_EV_SW_TRIGGER], &current_sw_trigger_interval, config.sw_trigger_interval); 
+      monitor_arm_periodic(fds[MON_EV_SCALERS], &current_scaler_sample_interval, config.scaler_sample_interval); 
+
+      /////////////////////////////////////////////////////
+      //turn on and off phased trigger as necessary
+      //  this is more complicated than it could be because the config
+      //  could be reread in the middle of the run. 
+      /////////////////////////////////////////////////////
+      if (config.enable_phased_trigger && phased_trigger_status != 1)
+      {
+        if (config.secs_before_phased_trigger)
+        {
+          //if this is already in the past, it goes off right away 
+          struct timespec when = timespec_after(&start, config.secs_before_phased_trigger); 
+          arm_timer(fds[MON_EV_PHASED_TRIGGER], &when, 0); 
+        }
+        else
+        {
+          do_phased = 1; 
+        }
+      }
+      else if (!config.enable_phased_trigger && phased_trigger_status == 1)
+      {
+        disarm_timer(fds[MON_EV_PHASED_TRIGGER]); 
+        phased_cmd.arg = 0; 
+        dev_sched_do(&phased_cmd); 
+        phased_trigger_status = 0; 
+        dead_begin(DEAD_PHASED_OFF); 
+      }
+      reconfigure = 0; 
+    }
+
+    if (do_phased && config.enable_phased_trigger && phased_trigger_status != 1) 
+    {
+      phased_cmd.arg = 1; 
+      dev_sched_do(&phased_cmd); 
+      phased_trigger_status = 1; 
+      dead_end(DEAD_PHASED_OFF); 
+    }
+
+    //figure out the current time
+    struct timespec now; 
+    clock_gettime(CLOCK_MONOTONIC, &now); 
+
+    // sample the scalers (not when we're about to read the status anyway) 
+    if (do_sample && !do_monitor) 
+    {
+      sample_cmd.arg = config.surface_readout; 
+      if (!dev_sched_do(&sample_cmd)) scaler_ring_push(&sample_status, &now); 
+    }
+
+    //////////////////////////////////////////////////////
+    //read the status, and react to it 
+    // herein lies the PID loop and all those wonderful things
+    //////////////////////////////////////////////////////
+    if (do_monitor)
+    {
+      //time since the last update (or the nominal interval the first time) 
+      double dt = last_mon.tv_sec ? timespec_difference_float(&now, &last_mon) : config.monitor_interval; 
+      nuphase_pid_cfg_t pid_cfg; 
+      pid_cfg_from_config(&pid_cfg); 
+      nuphase_rate_cfg_t rate_cfg; 
+      rate_cfg_from_config(&rate_cfg); 
+      monitor_buffer_t mb; 
+      nuphase_status_t *st = &mb.status;
+      status_cmd.status = st; 
+      status_cmd.arg = config.surface_readout; 
+      dev_sched_do(&status_cmd); 
+ //     nuphase_status_print(stdout,st); 
+
+      int ibeam; 
+      scaler_ring_push(st, &now); 
+      scaler_ring_consume(&fs_avg, &rate_cfg, st, config.monitor_interval); 
+
+      //temperature feed-forward, if we have a temperature 
+      nuphase_ff_cfg_t ff_cfg; 
+      ff_cfg_from_config(&ff_cfg); 
+      double temperature; 
+      int use_ff = config.temperature_feedforward && !hk_temperature(&temperature); 
+      if (use_ff) nuphase_ff_update_temperature(&feedforward, &ff_cfg, temperature, dt); 
+
+      //start from whatever the device has the first time 
+      if (!thresholds.have_target) 
+      {
+        for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+        {
+          thresholds.target[ibeam] = st->trigger_thresholds[ibeam]; 
+          thresholds.applied[ibeam] = st->trigger_thresholds[ibeam]; 
+        }
+        thresholds.have_target = 1; 
+      }
+
+      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+      {
+
+        double measured = fs_avg.rate[ibeam]; 
+        mb.rate[ibeam] = measured; 
+        mb.rate_variance[ibeam] = fs_avg.variance[ibeam]; 
+
+        // modify threshold 
+        double dthreshold = nuphase_pid_update(&control, &pid_cfg, ibeam, measured, fs_avg.variance[ibeam], config.scaler_goal[ibeam], dt); 
+        double ff_step = use_ff ? nuphase_ff_update_beam(&feedforward, &ff_cfg, ibeam, thresholds.target[ibeam], measured, config.scaler_goal[ibeam], dt) : 0; 
+        double new_threshold = thresholds.target[ibeam] + dthreshold + ff_step; 
+
+        //the device won't go below min_threshold, so don't ask it to 
+        thresholds.target[ibeam] = new_threshold > config.min_threshold ? new_threshold : config.min_threshold; 
+
+
+//        printf("BEAM %d\n", ibeam); 
+//        printf("  new threshold %d (old: %d)\n", mb.thresholds[ibeam], st->trigger_thresholds[ibeam]); 
+      }
+
+      //apply the thresholds if they changed enough (queued, so it goes in the same batch as a sw trigger if there is one) 
+      if (thresholds_need_write(st)) 
+      {
+        for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+        {
+          thresholds.applied[ibeam] = (uint32_t) (thresholds.target[ibeam] + 0.5); 
+        }
+        memcpy(thresholds_cmd.thresholds, thresholds.applied, sizeof(thresholds.applied)); 
+        dev_sched_submit(&thresholds_cmd); 
+        thresholds_set = 1; 
+        thresholds.force = 0; 
+        thresholds.nwrites++; 
+      }
+      else
+      {
+        thresholds.nsuppressed++; 
+      }
+      memcpy(mb.thresholds, thresholds.applied, sizeof(mb.thresholds)); 
+      publish = 1; 
+
+      //copy over the current control status 
+      memcpy(&mb.control, &control, sizeof(control)); 
+      mb.estimator = fs_avg.estimator; 
+
+      nuphase_buf_push(mon_buffer, &mb);
+      memcpy(&last_mon,&now, sizeof(now)); 
+      thresholds.nupdates++; 
+
+      if (config.checkpoint_interval > 0 && ++ncheckpoint_cycles >= config.checkpoint_interval) 
+      {
+        if (checkpoint_write()) fprintf(stderr,"Could not write checkpoint to %s\n", config.checkpoint_file); 
+        ncheckpoint_cycles = 0; 
+      }
+    }
+
+    //thresholds set over the control socket go out right away 
+    if (thresholds.force && !thresholds_set) 
+    {
+      int ibeam; 
+      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+      {
+        thresholds.applied[ibeam] = (uint32_t) (thresholds.target[ibeam] + 0.5); 
+      }
+      memcpy(thresholds_cmd.thresholds, thresholds.applied, sizeof(thresholds.applied)); 
+      dev_sched_submit(&thresholds_cmd); 
+      thresholds_set = 1; 
+      thresholds.force = 0; 
+      thresholds.nwrites++; 
+    }
+
+    if (publish) control_publish(); 
+
+    if (do_sw_trigger)
+    {
+      dev_sched_submit(&sw_trigger_cmd); 
+    }
+
+    //run whatever we queued up in one batch 
+    dev_sched_run(); 
+    if (thresholds_set) dev_sched_wait(&thresholds_cmd); 
+    if (do_sw_trigger) dev_sched_wait(&sw_trigger_cmd); 
+  }
+
+  if (missed_sw_triggers) 
+  {
+    fprintf(stderr,"Monitor thread missed %"PRIu64" software triggers\n", missed_sw_triggers); 
+  }
+
+  for (i = 0; i < MON_EV_WAKEUP; i++) close(fds[i]); 
+  close(epfd); 
+
+  config_release(CFG_READER_MONITOR); 
+  return 0; 
+}
+
+
+const char * subdirs[] = {"event","header","status","aux","cfg"}; 
+const int nsubdirs = sizeof(subdirs) / sizeof(*subdirs); 
+
+//this makes the necessary directories for a time 
+//returns 0 on success. 
+static int make_dirs_for_output(const char * prefix) 
+{ 
+  char buf[strlen(prefix) + 512];  
+
+  //check to see that prefix exists and is a directory
+  if (mkdir_if_needed(prefix))
+  {
+    fprintf(stderr,"Couldn't find %s or it's not a directory. Bad things will happen!\n",prefix); 
+    return 1; 
+  }
+
+
+  int i;
+
+  for (i = 0; i < nsubdirs; i++)
+  {
+    snprintf(buf,sizeof(buf), "%s/%s",prefix,subdirs[i]); 
+    if (mkdir_if_needed(buf))
+    {
+        fprintf(stderr,"Couldn't make %s. Bad things will happen!\n",buf); 
+        return 1; 
+    }
+  }
+
+  return 0; 
+}
+
+
+static char * output_dir = 0;
+
+void copy_configs() 
 {
 
   char * cfgpath = 0; 
-  char bigbuf[1024];
+  char paths[4096] = ""; 
+  char dest[1024];
   if (!output_dir) return; 
 
   nuphase_program_t prog;
   for (prog = NUPHASE_STARTUP; prog <= NUPHASE_COPY; prog++)
   {
     nuphase_get_cfg_file(&cfgpath, prog); 
-    snprintf(bigbuf,sizeof(bigbuf), "cp --backup=simple %s %s/cfg", cfgpath, output_dir); 
-    system(bigbuf); 
+    if (*paths) strncat(paths, ":", sizeof(paths) - strlen(paths) - 1); 
+    strncat(paths, cfgpath, sizeof(paths) - strlen(paths) - 1); 
+    free(cfgpath); 
+  }
+
+  //in the background, keeping the old ones like cp --backup=simple 
+  snprintf(dest,sizeof(dest), "%s/cfg", output_dir); 
+  nuphase_snapshot_async(paths, dest, config.dedup_dir, 1); 
+}
+
+
+///////////////////////////////////////////////////
+// the acq status log 
+//
+// A text log written next to the status files, for things
+// that don't fit in a nuphase_status_t (e.g. mode transitions). 
+// Only the write thread writes to it. 
+
+static gzFile acq_log_file = 0; 
+static char * acq_log_file_name = 0; 
+
+static void acq_log_close() 
+{
+  if (acq_log_file) do_close(acq_log_file, acq_log_file_name); 
+  acq_log_file = 0; 
+  acq_log_file_name = 0; 
+}
+
+static void acq_log(const char * fmt, ...) 
+{
+  time_t now = time(0); 
+  va_list ap; 
+
+  if (!acq_log_file) 
+  {
+    char buf[strlen(config.output_directory) + 512]; 
+    snprintf(buf,sizeof(buf),"%s/run%d/status/%u.acqlog.gz%s", config.output_directory, run_number, (unsigned) now, tmp_suffix); 
+    acq_log_file = gzopen(buf,"w"); 
+    if (acq_log_file) acq_log_file_name = strdup(buf); 
+  }
+
+  //also echo to screen so it ends up in the journal 
+  printf("[%u] ", (unsigned) now); 
+  va_start(ap, fmt); 
+  vprintf(fmt,ap); 
+  va_end(ap); 
+  printf("\n"); 
+
+  if (!acq_log_file) return; 
+
+  char line[1024]; 
+  va_start(ap, fmt); 
+  vsnprintf(line, sizeof(line), fmt, ap); 
+  va_end(ap); 
+  gzprintf(acq_log_file,"%u %s\n", (unsigned) now, line); 
+}
+
+/* The rate estimates used by the threshold control go alongside the status files
+ * (one line per status: readout time, estimator, then rate and variance for each beam).
+ * Only used by the write thread. Rotates with the status file. */
+static gzFile rate_log_file = 0; 
+static char * rate_log_file_name = 0; 
+
+static void rate_log_close() 
+{
+  if (rate_log_file) do_close(rate_log_file, rate_log_file_name); 
+  rate_log_file = 0; 
+  rate_log_file_name = 0; 
+}
+
+static void rate_log(const monitor_buffer_t * mb) 
+{
+  int ibeam; 
+  if (!rate_log_file) 
+  {
+    char buf[strlen(config.output_directory) + 512]; 
+    snprintf(buf,sizeof(buf),"%s/run%d/status/%u.rate.gz%s", config.output_directory, run_number, mb->status.readout_time, tmp_suffix); 
+    rate_log_file = gzopen(buf,"w"); 
+    if (!rate_log_file) return; 
+    rate_log_file_name = strdup(buf); 
+  }
+
+  gzprintf(rate_log_file,"%u.%09u %s", mb->status.readout_time, mb->status.readout_time_ns, nuphase_rate_estimator_name(mb->estimator)); 
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+  {
+    gzprintf(rate_log_file," %g %g", mb->rate[ibeam], mb->rate_variance[ibeam]); 
+  }
+  gzprintf(rate_log_file,"\n"); 
+}
+
+///
+/////////////////////////////////////////////////////
+
+
+///////////////////////////////////////////////////
+// disk space backpressure 
+//
+// Rather than writing until the disk is full, the write thread 
+// steps through progressively more degraded modes as the free 
+// space in output_directory drops below the configured thresholds. 
+
+typedef enum backpressure_mode
+{
+  BP_NORMAL = 0,    // write everything
+  BP_COMPRESS,      // raise the compression level
+  BP_PRESCALE,      // ...and prescale forced triggers 
+  BP_HEADERS_ONLY,  // ...and only write headers 
+  BP_NMODES
+} backpressure_mode_t; 
+
+_Static_assert(BP_NMODES == NUPHASE_METRICS_NBACKPRESSURE, "backpressure modes don't match nuphase-metrics.h"); 
+static const char ** backpressure_mode_names = nuphase_metrics_backpressure_names; 
+
+static struct 
+{
+  backpressure_mode_t mode; 
+  time_t last_check; 
+  int free_mb; 
+  uint64_t nforced; 
+  uint64_t nprescaled; 
+  uint64_t nheaders_only; 
+} backpressure = { .mode = BP_NORMAL, .last_check = 0, .free_mb = -1, .nforced = 0, .nprescaled = 0, .nheaders_only = 0 }; 
+
+
+/* Checks the free space (at most every free_space_check_interval seconds) 
+ * and updates the mode. Returns 1 if the mode changed. */ 
+static int backpressure_update(time_t now) 
+{
+  if (backpressure.free_mb >= 0 && now - backpressure.last_check < config.free_space_check_interval) 
+    return 0; 
+
+  struct statvfs vfs; 
+  backpressure.last_check = now; 
+  if (statvfs(config.output_directory, &vfs))
+  {
+    return 0; 
+  }
+  backpressure.free_mb = ((uint64_t) vfs.f_bavail * vfs.f_frsize) >> 20; 
+
+  int thresholds[BP_NMODES] = { 0, config.free_space_compress_mb, config.free_space_prescale_mb, config.free_space_headers_only_mb }; 
+
+  backpressure_mode_t mode = BP_NORMAL; 
+  int i; 
+  for (i = BP_COMPRESS; i < BP_NMODES; i++) 
+  {
+    if (thresholds[i] <= 0) continue; 
+
+    //entering a mode happens at the threshold, but leaving it requires some hysteresis 
+    int threshold = thresholds[i] + (i <= backpressure.mode ? config.free_space_hysteresis_mb : 0); 
+    if (backpressure.free_mb < threshold) mode = i; 
+  }
+
+  if (mode == backpressure.mode) return 0; 
+
+  acq_log("backpressure: %s -> %s (free space: %d MB)", backpressure_mode_names[backpressure.mode], backpressure_mode_names[mode], backpressure.free_mb); 
+  backpressure.mode = mode; 
+  return 1; 
+}
+
+/* the mode to open gz files with */ 
+static const char * backpressure_gzmode() 
+{
+  static char mode[4]; 
+  if (backpressure.mode >= BP_COMPRESS && config.degraded_compression_level > 0 && config.degraded_compression_level <= 9) 
+  {
+    snprintf(mode,sizeof(mode),"w%d", config.degraded_compression_level); 
+  }
+  else
+  {
+    snprintf(mode,sizeof(mode),"w"); 
+  }
+  return mode; 
+}
+
+/* change the compression level of an already open file */ 
+static void backpressure_setparams(gzFile f) 
+{
+  if (!f) return; 
+  int level = backpressure.mode >= BP_COMPRESS && config.degraded_compression_level > 0 ? config.degraded_compression_level : Z_DEFAULT_COMPRESSION; 
+  gzsetparams(f, level, Z_DEFAULT_STRATEGY); 
+}
+
+/* returns 0 if this forced trigger should be dropped */ 
+static int backpressure_keep_forced() 
+{
+  if (backpressure.mode < BP_PRESCALE || config.forced_trigger_prescale <= 1) return 1; 
+  if (backpressure.nforced++ % config.forced_trigger_prescale == 0) return 1; 
+  backpressure.nprescaled++; 
+  return 0; 
+}
+
+///
+/////////////////////////////////////////////////////
+
+
+///////////////////////////////////////////////////
+// latency tracing 
+//
+// Each acq_buffer_t slot carries timestamps from the acq thread, 
+// the write thread adds its own, and per-stage histograms are 
+// accumulated here (only by the write thread). 
+
+typedef enum latency_stage
+{
+  LAT_READOUT_TO_COMMIT,  // data ready -> read out and committed to acq_buffer 
+  LAT_COMMIT_TO_POP,      // committed -> popped by write thread 
+  LAT_POP_TO_WRITTEN,     // popped -> gzwrite done 
+  LAT_CLOSE,              // time spent in do_close (gzclose + rename) 
+  LAT_READOUT_TO_RENAMED, // oldest event in a file -> file renamed 
+  LAT_NSTAGES
+} latency_stage_t; 
+
+_Static_assert(LAT_NSTAGES == NUPHASE_METRICS_NLATENCY, "latency stages don't match nuphase-metrics.h"); 
+static const char ** latency_stage_names = nuphase_metrics_latency_names; 
+
+static nuphase_latency_hist_t latency[LAT_NSTAGES]; 
+
+/* what the write thread has written, for the metrics (only the write thread touches these) */ 
+static struct 
+{
+  uint64_t nevents; 
+  uint64_t nfiles; 
+  uint64_t bytes_in;   // uncompressed 
+  uint64_t bytes_out;  // on disk 
+} write_counters; 
+
+/* do_close, but keeps track of how long it took, how long the oldest event in the file waited
+ * and how well it compressed */ 
+static void timed_close(gzFile f, char * path, const struct timespec * oldest) 
+{
+  struct timespec before, after; 
+  z_off_t bytes_in = gztell(f); 
+
+  //do_close renames it without the tmp suffix and frees path, so work out where it ends up first 
+  size_t len = strlen(path); 
+  char final_path[len+1]; 
+  strcpy(final_path, path); 
+  if (len > tmp_suffix_len && !strcasecmp(final_path + len - tmp_suffix_len, tmp_suffix)) final_path[len - tmp_suffix_len] = 0; 
+
+  clock_gettime(CLOCK_MONOTONIC, &before); 
+  do_close(f,path); 
+  clock_gettime(CLOCK_MONOTONIC, &after); 
+
+  nuphase_latency_hist_add(&latency[LAT_CLOSE], &before, &after); 
+  if (oldest) nuphase_latency_hist_add(&latency[LAT_READOUT_TO_RENAMED], oldest, &after); 
+
+  struct stat st; 
+  write_counters.nfiles++; 
+  if (bytes_in > 0 && !stat(final_path, &st)) 
+  {
+    write_counters.bytes_in += bytes_in; 
+    write_counters.bytes_out += st.st_size; 
+  }
+}
+
+static void latency_print(FILE *f) 
+{
+  int i; 
+  fprintf(f,"  latencies:\n"); 
+  for (i = 0; i < LAT_NSTAGES; i++) 
+  {
+    nuphase_latency_hist_print(f, latency_stage_names[i], &latency[i]); 
+  }
+}
+
+/* the counters, as key=value lines (for the stats file and the control socket) */ 
+static void stats_print(FILE * f, time_t now) 
+{
+  fprintf(f,"time=%u\n", (unsigned) now); 
+  fprintf(f,"run=%d\n", run_number); 
+  fprintf(f,"buffer_capacity=%d\n", config.buffer_capacity); 
+  fprintf(f,"buffer_occupancy=%zu\n", nuphase_buf_occupancy(acq_buffer)); 
+
+  dev_sched_stats_t st; 
+  dev_sched_get_stats(&st); 
+  fprintf(f,"device.nreadouts=%"PRIu64"\n", st.nreadouts); 
+  fprintf(f,"device.nreadout_waits=%"PRIu64"\n", st.nreadout_waits); 
+  fprintf(f,"device.readout_wait_ns=%"PRIu64"\n", st.readout_wait_ns); 
+  fprintf(f,"device.max_readout_wait_ns=%"PRIu64"\n", st.max_readout_wait_ns); 
+  fprintf(f,"device.ncmds=%"PRIu64"\n", st.ncmds); 
+  fprintf(f,"device.nbatches=%"PRIu64"\n", st.nbatches); 
+  fprintf(f,"device.nyields=%"PRIu64"\n", st.nyields); 
+  int i; 
+  for (i = 0; i < DEV_NOPS; i++) 
+  {
+    fprintf(f,"device.%s.count=%"PRIu64"\n", dev_op_names[i], st.op_count[i]); 
+    fprintf(f,"device.%s.ns=%"PRIu64"\n", dev_op_names[i], st.op_ns[i]); 
+  }
+  fprintf(f,"thresholds.nwrites=%"PRIu64"\n", thresholds.nwrites); 
+  fprintf(f,"thresholds.nsuppressed=%"PRIu64"\n", thresholds.nsuppressed); 
+  fprintf(f,"thresholds.saved_ms=%g\n", thresholds_saved_ms(&st)); 
+  fprintf(f,"scalers.nsamples=%"PRIu64"\n", scaler_ring.nsamples); 
+  fprintf(f,"scalers.noverruns=%"PRIu64"\n", scaler_ring.noverruns); 
+  uint64_t dead[DEAD_NSOURCES], dead_sum; 
+  uint64_t elapsed = livetime_get(&run_livetime, dead, &dead_sum); 
+  fprintf(f,"livetime.elapsed_ns=%"PRIu64"\n", elapsed); 
+  for (i = 0; i < DEAD_NSOURCES; i++) 
+  {
+    fprintf(f,"livetime.dead.%s_ns=%"PRIu64"\n", dead_source_names[i], dead[i]); 
+  }
+  fprintf(f,"livetime.fraction=%0.6f\n", livetime_fraction(elapsed, dead_sum)); 
+  for (i = 0; i < LAT_NSTAGES; i++) 
+  {
+    char name[64]; 
+    snprintf(name,sizeof(name),"latency.%s", latency_stage_names[i]); 
+    nuphase_latency_hist_write(f, name, &latency[i]); 
+  }
+}
+
+/* The stats as last printed by the write thread (which owns the latency histograms and the livetime), 
+ * for the control socket, which can't print them itself. Republished every second. */ 
+static struct 
+{
+  pthread_mutex_t lock; 
+  char * text; 
+} stats_shared = { .lock = PTHREAD_MUTEX_INITIALIZER, .text = 0 }; 
+
+/* write thread only */ 
+static void stats_publish(time_t now) 
+{
+  char * text = 0; 
+  size_t len = 0; 
+  FILE * f = open_memstream(&text, &len); 
+  if (!f) return; 
+  stats_print(f, now); 
+  if (fclose(f)) 
+  {
+    free(text); 
+    return; 
   }
 
+  pthread_mutex_lock(&stats_shared.lock); 
+  char * old = stats_shared.text; 
+  stats_shared.text = text; 
+  pthread_mutex_unlock(&stats_shared.lock); 
+  free(old); 
 }
 
+/* rewrites the stats file (atomically, via a rename) */ 
+static void write_stats_file(time_t now) 
+{
+  if (!config.stats_file || !*config.stats_file) return; 
+
+  char tmp[strlen(config.stats_file) + sizeof(tmp_suffix)]; 
+  sprintf(tmp,"%s%s", config.stats_file, tmp_suffix); 
+  FILE * f = fopen(tmp,"w"); 
+  if (!f) return; 
+
+  stats_print(f, now); 
+  fclose(f); 
+  rename(tmp, config.stats_file); 
+}
+
+
+/* The metrics in shared memory (see nuphase-metrics.h), for nuphase-current-acq. 
+ * Mapped in setup, updated by the write thread every metrics_interval. */ 
+static nuphase_acq_metrics_t * metrics = 0; 
+
+static int metrics_open() 
+{
+  if (!config.metrics_shm || !*config.metrics_shm) return 1; 
+
+  int fd = shm_open(config.metrics_shm, O_CREAT | O_RDWR, 0644); 
+  if (fd < 0 || ftruncate(fd, sizeof(nuphase_acq_metrics_t))) 
+  {
+    fprintf(stderr,"Could not set up shared memory region %s (%s). No metrics.\n", config.metrics_shm, strerror(errno)); 
+    if (fd >= 0) close(fd); 
+    return 1; 
+  }
+
+  void * mem = mmap(0, sizeof(nuphase_acq_metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); 
+  close(fd); 
+  if (mem == MAP_FAILED) return 1; 
+
+  metrics = mem; 
+  nuphase_metrics_init(metrics); 
+  metrics->pid = getpid(); 
+  metrics->start_time = time(0); 
+  return 0; 
+}
+
+/* write thread only. dt is the time since the last update */ 
+static void metrics_update(time_t now, double dt) 
+{
+  static uint64_t last_nevents = 0; 
+  if (!metrics) return; 
+
+  dev_sched_stats_t st; 
+  dev_sched_get_stats(&st); 
+  uint64_t dead[DEAD_NSOURCES], dead_sum; 
+  uint64_t elapsed = livetime_get(&run_livetime, dead, &dead_sum); 
+
+  nuphase_metrics_write_begin(metrics); 
+
+  metrics->update_time = now; 
+  metrics->run = run_number; 
+
+  metrics->acq_readouts = acq_counters.nreadouts; 
+  metrics->acq_events = acq_counters.nevents; 
+
+  metrics->write_events = write_counters.nevents; 
+  metrics->write_files = write_counters.nfiles; 
+  metrics->write_bytes_in = write_counters.bytes_in; 
+  metrics->write_bytes_out = write_counters.bytes_out; 
+  metrics->write_rate = dt > 0 ? (write_counters.nevents - last_nevents) / dt : 0; 
+  metrics->compression_ratio = write_counters.bytes_out ? ((double) write_counters.bytes_in) / write_counters.bytes_out : 0; 
+  metrics->buffer_occupancy = nuphase_buf_occupancy(acq_buffer); 
+  metrics->buffer_capacity = nuphase_buf_capacity(acq_buffer); 
+  metrics->backpressure_mode = backpressure.mode; 
+  metrics->free_mb = backpressure.free_mb; 
+  metrics->nprescaled = backpressure.nprescaled; 
+  metrics->nheaders_only = backpressure.nheaders_only; 
+
+  metrics->monitor_updates = thresholds.nupdates; 
+  metrics->threshold_writes = thresholds.nwrites; 
+  metrics->threshold_suppressed = thresholds.nsuppressed; 
+  metrics->scaler_samples = scaler_ring.nsamples; 
+  metrics->scaler_overruns = scaler_ring.noverruns; 
+
+  metrics->dev_readouts = st.nreadouts; 
+  metrics->dev_readout_waits = st.nreadout_waits; 
+  metrics->dev_max_readout_wait_ns = st.max_readout_wait_ns; 
+  metrics->dev_cmds = st.ncmds; 
+
+  metrics->elapsed_ns = elapsed; 
+  memcpy(metrics->dead_ns, dead, sizeof(metrics->dead_ns)); 
+  metrics->livetime_fraction = livetime_fraction(elapsed, dead_sum); 
+
+  //what the monitor thread last published (if it's busy, the old values stay) 
+  if (!pthread_mutex_trylock(&control_shared.lock)) 
+  {
+    int ibeam; 
+    for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+    {
+      metrics->rate[ibeam] = control_shared.rate[ibeam]; 
+      metrics->rate_sigma[ibeam] = sqrt(control_shared.rate_variance[ibeam]); 
+      metrics->goal[ibeam] = control_shared.goal[ibeam]; 
+      metrics->target[ibeam] = control_shared.target[ibeam]; 
+      metrics->threshold[ibeam] = control_shared.applied[ibeam]; 
+    }
+    pthread_mutex_unlock(&control_shared.lock); 
+  }
+
+  memcpy(metrics->latency, latency, sizeof(metrics->latency)); 
+
+  nuphase_metrics_write_end(metrics); 
+  last_nevents = write_counters.nevents; 
+}
+
+///
+/////////////////////////////////////////////////////
+
+
+/* Makes the output directory for run_number and copies the configs
+ * and anything else we want into it. Called by the write thread
+ * at the start and at each rollover. */ 
+static int start_run_output() 
+{
+  char bigbuf[strlen(config.output_directory)+512];
+
+  snprintf(bigbuf, sizeof(bigbuf),"%s/run%d/", config.output_directory, run_number); 
+  if (make_dirs_for_output(bigbuf))
+  {
+    return 1; 
+  }
+
+  //the old one is not freed, since the main thread may be copying configs into it
+  output_dir = strdup(bigbuf); 
+
+  if (config.copy_configs) 
+  {
+    copy_configs(); 
+  }
+
+
+  //Copy any other things we want to the run directory 
+  // (in the background, so we can start draining the buffers right away) 
+  snprintf(bigbuf, sizeof(bigbuf),"%s/aux", output_dir); 
+  nuphase_snapshot_async(config.copy_paths_to_rundir, bigbuf, config.dedup_dir, 0); 
+
+  return 0; 
+}
+
+
 /** Will write output to disk and some status info to screen */ 
 void * write_thread(void *v) 
 {
+  config_refresh(CFG_READER_WRITE); 
+  thread_init("write"); 
   time_t start_time = time(0);
   time_t last_print_out =start_time ; 
 
@@ -545,64 +2143,102 @@ void * write_thread(void *v)
   char * status_file_name = 0; 
   char * surface_file_name = 0; 
 
+  // readout time of the oldest event in each file 
+  struct timespec data_file_oldest, header_file_oldest, surface_file_oldest, surface_header_file_oldest; 
+  struct timespec t_pop, t_written; 
+
   acq_buffer_t *events= 0; 
   monitor_buffer_t *mon= 0;
 
   nuphase_status_t * last_status = (saved_status && saved_status != MAP_FAILED)  ? saved_status : malloc(sizeof(nuphase_status_t)); 
 
-  pid_state_t last_pid; 
-  pid_state_init(&last_pid,-1,-1,-1); 
+  nuphase_pid_t last_pid; 
+  nuphase_pid_init(&last_pid); 
 
-  nuphase_read_status(device, last_status,config.surface_readout); 
+  dev_cmd_t status_cmd = { .op = DEV_READ_STATUS, .status = last_status, .arg = config.surface_readout }; 
+  dev_sched_do(&status_cmd); 
 
   
   int num_events = 0; 
   int ntotal_surface_events = 0; 
   int ntotal_events = 0;
 
-  snprintf(bigbuf, sizeof(bigbuf),"%s/run%d/", config.output_directory, run_number); 
-  if (make_dirs_for_output(bigbuf))
-  {
-      fatal(); 
-  }
-  output_dir = strdup(bigbuf); 
-
-  if (config.copy_configs) 
-  {
-    copy_configs(); 
-  }
+  // event numbers of the last and first events of the run, for rollovers 
+  uint64_t last_event_number = 0; 
 
-
-  //Copy any other things we want to the run directory 
-  char * thing_to_copy; 
-  char * tmp_str = strdup(config.copy_paths_to_rundir); 
-  char * save_ptr = 0;
-  thing_to_copy = strtok_r(tmp_str,":",&save_ptr); 
-  while (thing_to_copy!=NULL)
+  if (start_run_output())
   {
-     snprintf(bigbuf,sizeof(bigbuf), "cp -r %s %s/aux", thing_to_copy, output_dir); 
-     system(bigbuf); 
-     thing_to_copy = strtok_r(NULL,":",&save_ptr);
+      fatal(); 
   }
-  free(tmp_str); 
+  livetime_start(&run_livetime, run_number); 
+  time_t last_livetime_log = start_time; 
+  time_t last_metrics = start_time; 
+  time_t last_stats_publish = 0; 
+  char livetime_line[512]; 
 
  
   while(1) 
   {
+    config_refresh(CFG_READER_WRITE); 
     time_t now; 
     time(&now); 
     int have_data= 0; 
     int have_status = 0;
+
+    if (backpressure_update(now))
+    {
+      backpressure_setparams(data_file); 
+      backpressure_setparams(header_file); 
+      backpressure_setparams(surface_file); 
+      backpressure_setparams(surface_header_file); 
+    }
     
     size_t occupancy = nuphase_buf_occupancy(acq_buffer); 
     if (nuphase_buf_occupancy(acq_buffer))
     {
         events = nuphase_buf_pop(acq_buffer, events); 
+        clock_gettime(CLOCK_MONOTONIC, &t_pop); 
+        nuphase_latency_hist_add(&latency[LAT_READOUT_TO_COMMIT], &events->t_readout, &events->t_commit); 
+        nuphase_latency_hist_add(&latency[LAT_COMMIT_TO_POP], &events->t_commit, &t_pop); 
         int num_surface= events->surface_filled > 0 ? 1 : 0; 
         num_events += events->nfilled + num_surface; 
         ntotal_events += events->nfilled + num_surface;
+        write_counters.nevents += events->nfilled + num_surface; 
         ntotal_surface_events += num_surface; 
         have_data=1;
+
+        //first buffer of a new run: close everything and move to the new run directory 
+        if (events->run != run_number) 
+        {
+          uint64_t first_event_number = events->nfilled ? events->headers[0].event_number : events->surface_header.event_number; 
+          int old_run = run_number; 
+
+          if (data_file)  timed_close(data_file,data_file_name, &data_file_oldest); 
+          if (header_file)  timed_close(header_file, header_file_name, &header_file_oldest); 
+          if (surface_header_file)  timed_close(surface_header_file, surface_header_file_name, &surface_header_file_oldest); 
+          if (status_file)  timed_close(status_file, status_file_name, 0); 
+          if (surface_file)  timed_close(surface_file, surface_file_name, &surface_file_oldest); 
+          data_file = header_file = surface_header_file = status_file = surface_file = 0; 
+
+          acq_log("run %d ends after event %"PRIu64", continuing in run %d", old_run, last_event_number, events->run); 
+
+          livetime_write(&run_livetime); 
+          livetime_format(&run_livetime, livetime_line, sizeof(livetime_line)); 
+          acq_log("%s", livetime_line); 
+          acq_log_close(); 
+          rate_log_close(); 
+
+          run_number = events->run; 
+          if (start_run_output()) 
+          {
+            fatal(); 
+          }
+          livetime_start(&run_livetime, run_number); 
+          acq_log("run %d continues from run %d (last event %"PRIu64"), first event %"PRIu64, run_number, old_run, last_event_number, first_event_number); 
+        }
+
+        if (events->nfilled) last_event_number = events->headers[events->nfilled-1].event_number; 
+        if (num_surface && events->surface_header.event_number > last_event_number) last_event_number = events->surface_header.event_number; 
     }
 
     if (nuphase_buf_occupancy(mon_buffer)) 
@@ -614,243 +2250,930 @@ void * write_thread(void *v)
     //print something to screen
     if (config.print_interval > 0 && now - last_print_out > config.print_interval)  
     {
-      printf("---------after %u seconds-----------\n", (unsigned) (now - start_time)); 
-      printf("  total events written (including %d surface): %d\n", ntotal_events, ntotal_surface_events); 
-      printf("  write rate:  %g Hz\n", (num_events == 0) ? 0. :  ((float) num_events) / (now - last_print_out)); 
-      printf("  write buffer occupancy: %zu \n", occupancy); 
-      fs_avg_print(stdout); 
-      nuphase_status_print(stdout, last_status); 
-      pid_state_print(stdout, &last_pid); 
-      last_print_out = now; 
-      num_events = 0;
+      printf("---------after %u seconds-----------\n", (unsigned) (now - start_time)); 
+      printf("  total events written (including %d surface): %d\n", ntotal_events, ntotal_surface_events); 
+      printf("  write rate:  %g Hz\n", (num_events == 0) ? 0. :  ((float) num_events) / (now - last_print_out)); 
+      printf("  write buffer occupancy: %zu \n", occupancy); 
+      printf("  free space: %d MB, write mode: %s (prescaled: %"PRIu64", headers only: %"PRIu64")\n", backpressure.free_mb, 
+             backpressure_mode_names[backpressure.mode], backpressure.nprescaled, backpressure.nheaders_only); 
+      nuphase_rate_print(stdout, &fs_avg); 
+      printf("  scaler samples: %"PRIu64" (%"PRIu64" dropped)\n", scaler_ring.nsamples, scaler_ring.noverruns); 
+      dev_sched_stats_t dst; 
+      dev_sched_get_stats(&dst); 
+      printf("  threshold writes: %"PRIu64" (%"PRIu64" suppressed, saving ~%g ms)\n", thresholds.nwrites, thresholds.nsuppressed, thresholds_saved_ms(&dst)); 
+      nuphase_status_print(stdout, last_status); 
+      nuphase_pid_cfg_t pid_cfg; 
+      pid_cfg_from_config(&pid_cfg); 
+      nuphase_pid_print(stdout, &last_pid, &pid_cfg); 
+      if (config.temperature_feedforward) nuphase_ff_print(stdout, &feedforward); 
+      latency_print(stdout); 
+      dev_sched_print(stdout); 
+      livetime_format(&run_livetime, livetime_line, sizeof(livetime_line)); 
+      printf("  %s\n", livetime_line); 
+      write_stats_file(now); 
+      last_print_out = now; 
+      num_events = 0;
+    }
+
+
+    if (now != last_stats_publish) 
+    {
+      stats_publish(now); 
+      last_stats_publish = now; 
+    }
+
+    if (config.metrics_interval > 0 && now - last_metrics >= config.metrics_interval) 
+    {
+      metrics_update(now, now - last_metrics); 
+      last_metrics = now; 
+    }
+
+    //periodic livetime snapshot in the acq log, alongside the status files 
+    if (config.livetime_interval > 0 && now - last_livetime_log >= config.livetime_interval) 
+    {
+      livetime_format(&run_livetime, livetime_line, sizeof(livetime_line)); 
+      acq_log("%s", livetime_line); 
+      last_livetime_log = now; 
+    }
+
+    if (!have_data && !have_status)
+    {
+      if (die) 
+      {
+        if (data_file)  timed_close(data_file,data_file_name, &data_file_oldest); 
+        if (header_file)  timed_close(header_file, header_file_name, &header_file_oldest); 
+        if (surface_header_file)  timed_close(surface_header_file, surface_header_file_name, &surface_header_file_oldest); 
+        if (status_file)  timed_close(status_file, status_file_name, 0); 
+        if (surface_file)  timed_close(surface_file, surface_file_name, &surface_file_oldest); 
+        write_stats_file(now); 
+        metrics_update(now, now - last_metrics); 
+        livetime_write(&run_livetime); 
+        livetime_format(&run_livetime, livetime_line, sizeof(livetime_line)); 
+        acq_log("%s", livetime_line); 
+        acq_log_close(); 
+        rate_log_close(); 
+
+        break; 
+      }
+
+      //no data, so sleep a lot
+      usleep(50000);  //50 ms 
+      continue; 
+    }
+   
+    //make sure we have the right dirs
+  
+        
+    if (have_data)
+    {
+      int j; 
+
+      for (j = 0; j < events->nfilled; j++)
+      {
+
+        if (events->headers[j].trig_type == NP_TRIG_SW && !backpressure_keep_forced()) 
+        {
+          continue; 
+        }
+
+        int write_event = backpressure.mode < BP_HEADERS_ONLY; 
+
+        if (write_event && (!data_file || data_file_size >= config.events_per_file))
+        {
+          if (data_file) timed_close(data_file, data_file_name, &data_file_oldest); 
+          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/event/%"PRIu64".event.gz%s", config.output_directory,run_number,  events->events[j].event_number, tmp_suffix ); 
+          data_file = gzopen(bigbuf,backpressure_gzmode());  //TODO add error check
+          data_file_name = strdup(bigbuf); 
+          data_file_size = 0; 
+          data_file_oldest = events->t_readout; 
+        }
+
+        if (!header_file || header_file_size >= config.events_per_file)
+        {
+          if (header_file) timed_close(header_file, header_file_name, &header_file_oldest); 
+          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/header/%"PRIu64".header.gz%s", config.output_directory,run_number, events->headers[j].event_number, tmp_suffix ); 
+          header_file = gzopen(bigbuf,backpressure_gzmode());  //TODO add error check
+          header_file_name = strdup(bigbuf); 
+          header_file_size = 0; 
+          header_file_oldest = events->t_readout; 
+        }
+       
+        if (write_event) 
+        {
+          nuphase_event_gzwrite(data_file, &events->events[j]); 
+          data_file_size++; 
+        }
+        else
+        {
+          backpressure.nheaders_only++; 
+        }
+
+        nuphase_header_gzwrite(header_file, &events->headers[j]); 
+        header_file_size++; 
+
+      }
+      int nsurface = events->surface_filled > 0 ? 1 : 0; 
+
+      if (nsurface) 
+      {
+        int write_event = backpressure.mode < BP_HEADERS_ONLY; 
+
+        if (write_event && (!surface_file || surface_file_size >= config.surface_events_per_file))
+        {
+          if (surface_file) timed_close(surface_file, surface_file_name, &surface_file_oldest); 
+          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/event/%"PRIu64".surface_event.gz%s", config.output_directory,run_number,  events->surface_event.event_number, tmp_suffix ); 
+          surface_file = gzopen(bigbuf,backpressure_gzmode());  //TODO add error check
+          surface_file_name = strdup(bigbuf); 
+          surface_file_size = 0; 
+          surface_file_oldest = events->t_readout; 
+        }
+
+        if (!surface_header_file || surface_header_file_size >= config.surface_events_per_file) 
+        {
+          if (surface_header_file) timed_close(surface_header_file, surface_header_file_name, &surface_header_file_oldest); 
+          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/header/%"PRIu64".surface_header.gz%s", config.output_directory,run_number,  events->surface_header.event_number, tmp_suffix ); 
+          surface_header_file = gzopen(bigbuf,backpressure_gzmode());  //TODO add error check
+          surface_header_file_name = strdup(bigbuf); 
+          surface_header_file_size = 0; 
+          surface_header_file_oldest = events->t_readout; 
+        }
+
+        if (write_event) 
+        {
+          nuphase_event_gzwrite(surface_file, &events->surface_event); 
+          surface_file_size++; 
+        }
+        else
+        {
+          backpressure.nheaders_only++; 
+        }
+        nuphase_header_gzwrite(surface_header_file, &events->surface_header); 
+        surface_header_file_size++; 
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &t_written); 
+      nuphase_latency_hist_add(&latency[LAT_POP_TO_WRITTEN], &t_pop, &t_written); 
+    }
+
+    if (have_status)
+    {
+      if (!status_file || status_file_size >= config.status_per_file)
+      {
+        if (status_file) timed_close(status_file, status_file_name, 0); 
+        acq_log_close(); //rotate the acq log along with the status file
+        rate_log_close(); 
+        snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/status/%u.status.gz%s", config.output_directory, run_number,  (unsigned) now, tmp_suffix); 
+        status_file = gzopen(bigbuf,"w");  //TODO add error check
+        status_file_name = strdup(bigbuf); 
+        status_file_size = 0; 
+      }
+
+      memcpy(last_status, &mon->status, sizeof(*last_status)); 
+      memcpy(&last_pid, &mon->control, sizeof(last_pid)); 
+
+      //update the mmaped file if necessary 
+      if ( saved_status == last_status) msync(saved_status, sizeof(nuphase_status_t),MS_ASYNC); 
+
+
+      //write out the file 
+      nuphase_status_gzwrite(status_file, &mon->status); 
+      rate_log(mon); 
+
+      status_file_size++; 
+    }
+    
+    //had data, so sleep just a little (unless occupancy is too high) 
+    if (nuphase_buf_occupancy(acq_buffer) < config.buffer_capacity/3)  usleep(25000);  //25 ms 
+  }
+
+  if (last_status != saved_status)  free(last_status); 
+
+  config_release(CFG_READER_WRITE); 
+  return 0; 
+
+}
+
+
+/* wakes up the monitor thread. This is async-signal-safe. */ 
+static void wakeup_monitor() 
+{
+  uint64_t one = 1; 
+  if (monitor_wakeup_fd >= 0) 
+  {
+    if (write(monitor_wakeup_fd, &one, sizeof(one)) < 0) 
+    {
+      //nothing to do, it's already been poked 
+    }
+  }
+}
+
+void fatal()
+{
+  die = 1; 
+  wakeup_monitor(); 
+
+  //cancel any waits 
+  if (device) 
+    nuphase_cancel_wait(device); 
+
+}
+
+void on_quit(void * v) 
+{
+  fatal(); 
+}
+
+const char * tmp_run_file = "/tmp/.runfile"; 
+
+void rollover() 
+{
+  int run = next_run + 1; 
+
+  //claim the run after it in the run file first
+  FILE * run_file = fopen(tmp_run_file,"w"); 
+  if (!run_file) 
+  {
+    fprintf(stderr,"Could not write %s, so not rolling over. Stopping instead.\n", tmp_run_file); 
+    fatal(); 
+    return; 
+  }
+  fprintf(run_file,"%d\n", run+1); 
+  fclose(run_file); 
+  rename(tmp_run_file, config.run_file); 
+
+  printf("Run %d is over, rolling over to run %d\n", next_run, run); 
+  __atomic_store_n(&next_run, run, __ATOMIC_RELEASE); 
+}
+
+
+///////////////////////////////////////////////////
+// the control socket 
+//
+// A line protocol on a unix socket (config.control_socket), so things can be 
+// looked at and changed without rewriting the config or restarting, e.g. 
+//
+//    echo "goal all 1.5" | socat - UNIX-CONNECT:/tmp/nuphase-acq.sock 
+//
+// Each command gets its output followed by a line with "ok" or "error: why". 
+// The thread never touches the acquisition directly: thresholds and goals go 
+// through control_shared to the monitor thread, forced triggers go through the 
+// device scheduler (so readouts always go first) and rollovers are done by the 
+// main thread. Clients that send too much or don't read their replies are dropped. 
+
+#define CONTROL_MAX_CLIENTS 8 
+#define CONTROL_LINE_MAX 256 
+#define CONTROL_MAX_TRIGGERS 1000 
+#define CONTROL_MAX_TRIGGERS_STR "1000" 
+
+typedef struct control_client 
+{
+  int fd; 
+  size_t len; 
+  char line[CONTROL_LINE_MAX]; 
+} control_client_t; 
+
+static const char * control_help = 
+  "help                      this\n"
+  "stats                     counters, buffer occupancy, livetime and latencies (like the stats file)\n"
+  "thresholds                per beam: target and applied threshold, goal and measured rate\n"
+  "threshold <beam|all> <n>  set thresholds (the controller carries on from there)\n"
+  "goal <beam|all> <hz>      set rate goals (until the config is reread)\n"
+  "trigger [n]               send n (default 1) forced triggers\n"
+  "rollover                  start a new run now\n"
+  "pid                       dump the controller state\n"; 
+
+/* parses "all" or a beam number into a range. Returns 0 on success */ 
+static int control_parse_beams(const char * s, int * first, int * last) 
+{
+  if (!strcmp(s,"all")) 
+  {
+    *first = 0; 
+    *last = NP_NUM_BEAMS-1; 
+    return 0; 
+  }
+
+  char * end; 
+  long beam = strtol(s, &end, 10); 
+  if (*end || end == s || beam < 0 || beam >= NP_NUM_BEAMS) return 1; 
+  *first = *last = beam; 
+  return 0; 
+}
+
+/* copies what the monitor thread last published. Returns 0 if there is anything yet */ 
+static int control_get_published(double * target, uint32_t * applied, double * goal, double * rate, double * rate_variance, nuphase_pid_t * pid) 
+{
+  pthread_mutex_lock(&control_shared.lock); 
+  int valid = control_shared.valid; 
+  if (target) memcpy(target, control_shared.target, sizeof(control_shared.target)); 
+  if (applied) memcpy(applied, control_shared.applied, sizeof(control_shared.applied)); 
+  if (goal) memcpy(goal, control_shared.goal, sizeof(control_shared.goal)); 
+  if (rate) memcpy(rate, control_shared.rate, sizeof(control_shared.rate)); 
+  if (rate_variance) memcpy(rate_variance, control_shared.rate_variance, sizeof(control_shared.rate_variance)); 
+  if (pid) memcpy(pid, &control_shared.pid, sizeof(*pid)); 
+  pthread_mutex_unlock(&control_shared.lock); 
+  return !valid; 
+}
+
+/* runs one command, writing the reply to f. Returns 0 or an error message */ 
+static const char * control_command(char * line, FILE * f) 
+{
+  char * save_ptr = 0; 
+  const char * cmd = strtok_r(line, " \t\r", &save_ptr); 
+  const char * arg1 = cmd ? strtok_r(NULL, " \t\r", &save_ptr) : 0; 
+  const char * arg2 = arg1 ? strtok_r(NULL, " \t\r", &save_ptr) : 0; 
+
+  if (!cmd) return 0; 
+
+  if (!strcmp(cmd,"help")) 
+  {
+    fputs(control_help, f); 
+    return 0; 
+  }
+
+  if (!strcmp(cmd,"stats")) 
+  {
+    //whatever the write thread last published (time= says when) 
+    pthread_mutex_lock(&stats_shared.lock); 
+    int have = stats_shared.text != 0; 
+    if (have) fputs(stats_shared.text, f); 
+    pthread_mutex_unlock(&stats_shared.lock); 
+    return have ? 0 : "no stats yet"; 
+  }
+
+  if (!strcmp(cmd,"thresholds")) 
+  {
+    double target[NP_NUM_BEAMS], goal[NP_NUM_BEAMS], rate[NP_NUM_BEAMS], rate_variance[NP_NUM_BEAMS]; 
+    uint32_t applied[NP_NUM_BEAMS]; 
+    if (control_get_published(target, applied, goal, rate, rate_variance, 0)) return "no controller update yet"; 
+
+    int ibeam; 
+    fprintf(f,"beam target applied goal rate rate_sigma\n"); 
+    for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++) 
+    {
+      fprintf(f,"%d %0.2f %u %g %g %g\n", ibeam, target[ibeam], applied[ibeam], goal[ibeam], rate[ibeam], sqrt(rate_variance[ibeam])); 
+    }
+    return 0; 
+  }
+
+  if (!strcmp(cmd,"threshold") || !strcmp(cmd,"goal")) 
+  {
+    int first, last; 
+    char * end = 0; 
+    double val = arg2 ? strtod(arg2, &end) : 0; 
+    if (!arg1 || !arg2 || *end || control_parse_beams(arg1, &first, &last)) return "usage: threshold|goal <beam|all> <value>"; 
+    if (val < 0) return "must not be negative"; 
+
+    int is_goal = !strcmp(cmd,"goal"); 
+    if (!is_goal && control_get_published(0,0,0,0,0,0)) return "no controller update yet"; 
+
+    int ibeam; 
+    pthread_mutex_lock(&control_shared.lock); 
+    for (ibeam = first; ibeam <= last; ibeam++) 
+    {
+      if (is_goal) 
+      {
+        control_shared.goal_request[ibeam] = val; 
+        control_shared.set_goal[ibeam] = 1; 
+      }
+      else
+      {
+        control_shared.threshold_request[ibeam] = val; 
+        control_shared.set_threshold[ibeam] = 1; 
+      }
+    }
+    pthread_mutex_unlock(&control_shared.lock); 
+
+    wakeup_monitor(); 
+    printf("control socket: %s %s %g\n", cmd, arg1, val); 
+    return 0; 
+  }
+
+  if (!strcmp(cmd,"trigger")) 
+  {
+    char * end = 0; 
+    long n = arg1 ? strtol(arg1, &end, 10) : 1; 
+    if ((arg1 && *end) || n < 1 || n > CONTROL_MAX_TRIGGERS) return "usage: trigger [n], with 1 <= n <= " CONTROL_MAX_TRIGGERS_STR; 
+
+    dev_cmd_t trig = { .op = DEV_SW_TRIGGER }; 
+    long i, nsent = 0; 
+    for (i = 0; i < n && !die; i++) 
+    {
+      if (!dev_sched_do(&trig)) nsent++; 
+    }
+    fprintf(f,"sent %ld forced triggers\n", nsent); 
+    printf("control socket: sent %ld forced triggers\n", nsent); 
+    return nsent == n ? 0 : "not all triggers were sent"; 
+  }
+
+  if (!strcmp(cmd,"rollover")) 
+  {
+    if (!config.rollover) fprintf(f,"(rollover is off in the config, but doing it anyway)\n"); 
+    __atomic_store_n(&rollover_requested, 1, __ATOMIC_RELEASE); 
+    fprintf(f,"rolling over to run %d\n", next_run + 1); 
+    return 0; 
+  }
+
+  if (!strcmp(cmd,"pid")) 
+  {
+    nuphase_pid_t pid; 
+    if (control_get_published(0,0,0,0,0,&pid)) return "no controller update yet"; 
+    nuphase_pid_cfg_t pid_cfg; 
+    pid_cfg_from_config(&pid_cfg); 
+    nuphase_pid_print(f, &pid, &pid_cfg); 
+    return 0; 
+  }
+
+  return "unknown command (try help)"; 
+}
+
+/* handles whatever a client sent. Returns 1 if the client should be dropped */ 
+static int control_client_read(control_client_t * c) 
+{
+  ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len); 
+  if (n < 0) return errno != EAGAIN && errno != EINTR; 
+  if (n == 0) return 1; 
+  c->len += n; 
+  c->line[c->len] = 0; 
+
+  char * nl; 
+  while ((nl = strchr(c->line, '\n'))) 
+  {
+    *nl = 0; 
+
+    char * reply = 0; 
+    size_t reply_len = 0; 
+    FILE * f = open_memstream(&reply, &reply_len); 
+    if (!f) return 1; 
+    const char * err = control_command(c->line, f); 
+    if (err) fprintf(f,"error: %s\n", err); 
+    else fprintf(f,"ok\n"); 
+    fclose(f); 
+
+    //never wait for a client 
+    ssize_t sent = send(c->fd, reply, reply_len, MSG_NOSIGNAL | MSG_DONTWAIT); 
+    free(reply); 
+    if (sent != (ssize_t) reply_len) return 1; 
+
+    size_t used = nl + 1 - c->line; 
+    memmove(c->line, nl + 1, c->len - used + 1); 
+    c->len -= used; 
+  }
+
+  //too long without a newline 
+  return c->len >= sizeof(c->line) - 1; 
+}
+
+/* makes the listening socket. Returns 0 on success */ 
+static int control_listen() 
+{
+  if (!config.control_socket || !*config.control_socket) return 1; 
+
+  struct sockaddr_un addr; 
+  memset(&addr,0,sizeof(addr)); 
+  addr.sun_family = AF_UNIX; 
+  if (strlen(config.control_socket) >= sizeof(addr.sun_path)) 
+  {
+    fprintf(stderr,"Control socket path %s is too long\n", config.control_socket); 
+    return 1; 
+  }
+  strcpy(addr.sun_path, config.control_socket); 
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0); 
+  if (fd < 0) return 1; 
+
+  //left over from last time 
+  unlink(config.control_socket); 
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, CONTROL_MAX_CLIENTS)) 
+  {
+    fprintf(stderr,"Could not listen on %s (%s). No control socket.\n", config.control_socket, strerror(errno)); 
+    close(fd); 
+    return 1; 
+  }
+  chmod(config.control_socket, 0660); 
+
+  control_listen_fd = fd; 
+  control_socket_path = strdup(config.control_socket); 
+  printf("Listening for control commands on %s\n", config.control_socket); 
+  return 0; 
+}
+
+void * control_thread(void * v) 
+{
+  config_refresh(CFG_READER_CONTROL); 
+
+  control_client_t clients[CONTROL_MAX_CLIENTS]; 
+  int nclients = 0; 
+
+  while (!die) 
+  {
+    config_refresh(CFG_READER_CONTROL); 
+
+    //the clients, then the listening socket 
+    struct pollfd pfds[CONTROL_MAX_CLIENTS + 1]; 
+    int npolled = nclients; 
+    int i; 
+    for (i = 0; i < nclients; i++) 
+    {
+      pfds[i].fd = clients[i].fd; 
+      pfds[i].events = POLLIN; 
     }
+    pfds[npolled].fd = control_listen_fd; 
+    pfds[npolled].events = nclients < CONTROL_MAX_CLIENTS ? POLLIN : 0; 
 
+    //wake up every once in a while to check if we should stop 
+    if (poll(pfds, npolled + 1, 500) <= 0) continue; 
 
-    if (!have_data && !have_status)
+    //backwards, so dropping one (by moving the last one into its place) doesn't skip any 
+    for (i = npolled - 1; i >= 0; i--) 
     {
-      if (die) 
+      if (!pfds[i].revents) continue; 
+      if (control_client_read(&clients[i])) 
       {
-        if (data_file)  do_close(data_file,data_file_name); 
-        if (header_file)  do_close(header_file, header_file_name); 
-        if (surface_header_file)  do_close(surface_header_file, surface_header_file_name); 
-        if (status_file)  do_close(status_file, status_file_name); 
-        if (surface_file)  do_close(surface_file, surface_file_name); 
-
-        break; 
+        close(clients[i].fd); 
+        clients[i] = clients[--nclients]; 
       }
-
-      //no data, so sleep a lot
-      usleep(50000);  //50 ms 
-      continue; 
     }
-   
-    //make sure we have the right dirs
-  
-        
-    if (have_data)
-    {
-      int j; 
 
-      for (j = 0; j < events->nfilled; j++)
+    if (pfds[npolled].revents & POLLIN) 
+    {
+      int fd = accept4(control_listen_fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK); 
+      if (fd >= 0 && nclients < CONTROL_MAX_CLIENTS) 
+      {
+        clients[nclients].fd = fd; 
+        clients[nclients].len = 0; 
+        nclients++; 
+      }
+      else if (fd >= 0) 
       {
+        close(fd); 
+      }
+    }
+  }
 
-        if (!data_file || data_file_size >= config.events_per_file)
-        {
-          if (data_file) do_close(data_file, data_file_name); 
-          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/event/%"PRIu64".event.gz%s", config.output_directory,run_number,  events->events[j].event_number, tmp_suffix ); 
-          data_file = gzopen(bigbuf,"w");  //TODO add error check
-          data_file_name = strdup(bigbuf); 
-          data_file_size = 0; 
-        }
+  int i; 
+  for (i = 0; i < nclients; i++) close(clients[i].fd); 
+  config_release(CFG_READER_CONTROL); 
+  return 0; 
+}
 
-        if (!header_file || header_file_size >= config.events_per_file)
-        {
-          if (header_file) do_close(header_file, header_file_name); 
-          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/header/%"PRIu64".header.gz%s", config.output_directory,run_number, events->headers[j].event_number, tmp_suffix ); 
-          header_file = gzopen(bigbuf,"w");  //TODO add error check
-          header_file_name = strdup(bigbuf); 
-          header_file_size = 0; 
-        }
-       
-        nuphase_event_gzwrite(data_file, &events->events[j]); 
-        nuphase_header_gzwrite(header_file, &events->headers[j]); 
-        data_file_size++; 
-        header_file_size++; 
 
-      }
-      int nsurface = events->surface_filled > 0 ? 1 : 0; 
+/* This is to avoid repeating code
+ * twice for device things that may be changed on a reread. 
+ *
+ * Only the settings that differ between old and c are sent to the device
+ * (everything is if old is NULL), and what was applied is printed. */ 
+static int configure_device(const nuphase_acq_cfg_t * old, const nuphase_acq_cfg_t * c) 
+{
+#define CHANGED(field) (!old || memcmp(&old->field, &c->field, sizeof(c->field)))
+  char applied[1024] = ""; 
+#define APPLIED(what) strncat(applied, " " what, sizeof(applied) - strlen(applied) - 1)
 
-      if (nsurface) 
-      {
-        if (!surface_file || surface_file_size >= config.surface_events_per_file) 
-        {
-          if (surface_file) do_close(surface_file, surface_file_name); 
-          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/event/%"PRIu64".surface_event.gz%s", config.output_directory,run_number,  events->surface_event.event_number, tmp_suffix ); 
-          surface_file = gzopen(bigbuf,"w");  //TODO add error check
-          surface_file_name = strdup(bigbuf); 
-          surface_file_size = 0; 
+  if (CHANGED(spi_clock)) 
+  {
+    nuphase_set_spi_clock(device, c->spi_clock); 
+    APPLIED("spi_clock"); 
+  }
 
-        }
+  if (CHANGED(waveform_length)) 
+  {
+    nuphase_set_buffer_length(device, c->waveform_length); 
+    APPLIED("waveform_length"); 
+  }
 
-        if (!surface_header_file || surface_header_file_size >= config.surface_events_per_file) 
-        {
-          if (surface_header_file) do_close(surface_header_file, surface_header_file_name); 
-          snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/header/%"PRIu64".surface_header.gz%s", config.output_directory,run_number,  events->surface_header.event_number, tmp_suffix ); 
-          surface_header_file = gzopen(bigbuf,"w");  //TODO add error check
-          surface_header_file_name = strdup(bigbuf); 
-          surface_header_file_size = 0; 
-        }
+  if (CHANGED(surface_waveform_length)) 
+  {
+    nuphase_set_surface_buffer_length(device, c->surface_waveform_length); 
+    APPLIED("surface_waveform_length"); 
+  }
 
-        nuphase_event_gzwrite(surface_file, &events->surface_event); 
-        nuphase_header_gzwrite(surface_header_file, &events->surface_header); 
-        surface_file_size++; 
-        surface_header_file_size++; 
-      }
+  //setup the external trigger
+  if (CHANGED(enable_trigout) || CHANGED(trigout_width)) 
+  {
+    nuphase_trigger_output_config_t trigo; 
+    nuphase_get_trigger_output(device,&trigo); 
+    trigo.enable = c->enable_trigout; 
+    trigo.width = c->trigout_width; 
+    nuphase_configure_trigger_output(device,trigo); 
+    APPLIED("trigger_output"); 
+  }
 
-    }
+  if (CHANGED(enable_extin)) 
+  {
+    nuphase_ext_input_config_t trigi; 
+    nuphase_get_ext_trigger_in(device,&trigi); 
+    trigi.use_as_trigger = c->enable_extin; 
+    nuphase_configure_ext_trigger_in(device,trigi); 
+    APPLIED("ext_trigger_in"); 
+  }
 
-    if (have_status)
-    {
-      if (!status_file || status_file_size >= config.status_per_file)
-      {
-        if (status_file) do_close(status_file, status_file_name); 
-        snprintf(bigbuf,sizeof(bigbuf),"%s/run%d/status/%u.status.gz%s", config.output_directory, run_number,  (unsigned) now, tmp_suffix); 
-        status_file = gzopen(bigbuf,"w");  //TODO add error check
-        status_file_name = strdup(bigbuf); 
-        status_file_size = 0; 
-      }
+  //set up the calpulser
+  if (CHANGED(calpulser_state)) 
+  {
+    nuphase_calpulse(device,c->calpulser_state); 
+    APPLIED("calpulser"); 
+  }
 
-      memcpy(last_status, &mon->status, sizeof(*last_status)); 
-      memcpy(&last_pid, &mon->control, sizeof(last_pid)); 
+  //set up the pretrigger
+  if (CHANGED(pretrigger) || CHANGED(surface_pretrigger)) 
+  {
+    nuphase_set_pretrigger(device, (uint8_t) c->pretrigger & 0x7, (uint8_t) c->surface_pretrigger & 0x7); 
+    APPLIED("pretrigger"); 
+  }
 
-      //update the mmaped file if necessary 
-      if ( saved_status == last_status) msync(saved_status, sizeof(nuphase_status_t),MS_ASYNC); 
+  //set up the trigger delays 
+  if (CHANGED(trig_delays)) 
+  {
+    nuphase_set_trigger_delays(device, c->trig_delays); 
+    APPLIED("trig_delays"); 
+  }
 
+  if (c->apply_attenuations && (CHANGED(apply_attenuations) || CHANGED(attenuation)))
+  {
+    nuphase_set_attenuation(device, c->attenuation[0], c->attenuation[1]); 
+    APPLIED("attenuation"); 
+  }
 
-      //write out the file 
-      nuphase_status_gzwrite(status_file, &mon->status); 
+  if (CHANGED(trigger_mask)) 
+  {
+    nuphase_set_trigger_mask(device, c->trigger_mask); 
+    APPLIED("trigger_mask"); 
+  }
 
-      status_file_size++; 
-    }
-    
-    //had data, so sleep just a little (unless occupancy is too high) 
-    if (nuphase_buf_occupancy(acq_buffer) < config.buffer_capacity/3)  usleep(25000);  //25 ms 
+  if (CHANGED(channel_mask)) 
+  {
+    nuphase_set_channel_mask(device, c->channel_mask); 
+    APPLIED("channel_mask"); 
   }
 
-  if (last_status != saved_status)  free(last_status); 
+  if (CHANGED(channel_read_mask)) 
+  {
+    nuphase_set_channel_read_mask(device, MASTER, c->channel_read_mask[0]);
+    nuphase_set_channel_read_mask(device, SLAVE, c->channel_read_mask[1]);
+    APPLIED("channel_read_mask"); 
+  }
+
+  if (CHANGED(poll_usecs)) 
+  {
+    nuphase_set_poll_interval(device, c->poll_usecs); 
+    APPLIED("poll_usecs"); 
+  }
+
+  if (CHANGED(min_threshold)) 
+  {
+    nuphase_set_min_threshold(device, c->min_threshold); 
+    APPLIED("min_threshold"); 
+  }
+
+  if (CHANGED(surface_readout)) 
+  {
+    nuphase_enable_surface_readout(device, c->surface_readout); 
+    APPLIED("surface_readout"); 
+  }
+
+  if (CHANGED(surface_read_mask)) 
+  {
+    nuphase_set_surface_channel_read_mask(device, c->surface_read_mask); 
+    APPLIED("surface_read_mask"); 
+  }
+
+  if (CHANGED(surface_vpp_threshold) || CHANGED(surface_coincidence_window) || CHANGED(surface_antenna_mask) || CHANGED(surface_num_coincidences)) 
+  {
+    struct nuphase_surface_setup s;
+    s.vpp_threshold = c->surface_vpp_threshold; 
+    s.coincident_window_length = c->surface_coincidence_window;
+    s.antenna_mask = c->surface_antenna_mask; 
+    s.n_coincident_channels = c->surface_num_coincidences;
+
+    nuphase_configure_surface(device,&s); 
+    APPLIED("surface_setup"); 
+  }
 
+  printf("Configured device:%s\n", *applied ? applied : " nothing changed"); 
+
+#undef APPLIED
+#undef CHANGED
   return 0; 
 
 }
 
 
-void fatal()
+///////////////////////////////////////////////////
+// thread scheduling 
+
+/* how much stack to ask for (and prefault) in realtime mode */ 
+#define RT_STACK_SIZE (512*1024) 
+#define RT_STACK_PREFAULT (128*1024) 
+
+/* returns 1 if the cpu is listed in /sys/devices/system/cpu/isolated */ 
+static int cpu_is_isolated(int cpu) 
 {
-  die = 1; 
+  FILE * f = fopen("/sys/devices/system/cpu/isolated","r"); 
+  if (!f) return 0; 
 
-  //cancel any waits 
-  if (device) 
-    nuphase_cancel_wait(device); 
+  char buf[256] = {0}; 
+  if (!fgets(buf,sizeof(buf),f)) buf[0] = 0; 
+  fclose(f); 
 
+  // the format is something like 1-3,5 
+  char * save_ptr = 0; 
+  char * range = strtok_r(buf,",\n",&save_ptr); 
+  while (range) 
+  {
+    int lo,hi; 
+    int n = sscanf(range,"%d-%d", &lo, &hi); 
+    if (n == 1) hi = lo; 
+    if (n >= 1 && cpu >= lo && cpu <= hi) return 1; 
+    range = strtok_r(NULL,",\n",&save_ptr); 
+  }
+  return 0; 
 }
 
-void signal_handler(int signal, siginfo_t * sig, void * v) 
+/* Called at the start of each thread. In realtime mode, 
+ * touches the stack so we don't page fault on it later and
+ * complains if we're not on an isolated cpu. */ 
+static void thread_init(const char * name) 
 {
-  switch (signal)
+  if (!config.realtime_mode) return; 
+
+  volatile char prefault[RT_STACK_PREFAULT]; 
+  memset((char*) prefault, 0, sizeof(prefault)); 
+
+  int cpu = sched_getcpu(); 
+  if (!cpu_is_isolated(cpu))
   {
-    case SIGUSR1: 
-      read_config(0); 
-      break; 
-    case SIGTERM: 
-    case SIGUSR2: 
-    case SIGINT: 
-    default: 
-      fprintf(stderr,"Caught deadly signal %d\n", signal); 
-      fatal(); 
+    fprintf(stderr,"WARNING: %s thread is running on cpu %d, which is not isolated\n", name, cpu); 
   }
 }
 
-const char * tmp_run_file = "/tmp/.runfile"; 
-
-
-/* This is to avoid repeating code
- * twice for device things that may be changed on a reread */ 
-static int configure_device() 
+/* Creates a thread with its scheduling attributes already set, so it never runs with the wrong ones */ 
+static int create_thread(pthread_t * thread, void * (*fn)(void *), const nuphase_thread_cfg_t * tcfg, const char * name) 
 {
-  nuphase_set_spi_clock(device, config.spi_clock); 
-  nuphase_set_buffer_length(device, config.waveform_length); 
-  nuphase_set_surface_buffer_length(device, config.surface_waveform_length); 
-
-  //setup the external trigger
-  nuphase_trigger_output_config_t trigo; 
-  nuphase_get_trigger_output(device,&trigo); 
-  trigo.enable = config.enable_trigout; 
-  trigo.width = config.trigout_width; 
-  nuphase_configure_trigger_output(device,trigo); 
+  pthread_attr_t attr; 
+  pthread_attr_init(&attr); 
 
-  nuphase_ext_input_config_t trigi; 
+  if (tcfg->policy != SCHED_OTHER) 
+  {
+    struct sched_param sp; 
+    sp.sched_priority = tcfg->priority; 
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED); 
+    pthread_attr_setschedpolicy(&attr, tcfg->policy); 
+    pthread_attr_setschedparam(&attr, &sp); 
+  }
 
-  nuphase_get_ext_trigger_in(device,&trigi); 
-  trigi.use_as_trigger = config.enable_extin; 
-  nuphase_configure_ext_trigger_in(device,trigi); 
+  if (tcfg->cpu >= 0) 
+  {
+    cpu_set_t cpus; 
+    CPU_ZERO(&cpus); 
+    CPU_SET(tcfg->cpu, &cpus); 
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus); 
+  }
 
+  if (config.realtime_mode) 
+  {
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE); 
+  }
 
-  //set up the calpulser
-  nuphase_calpulse(device,config.calpulser_state); 
+  int ret = pthread_create(thread, &attr, fn, 0); 
 
-  //set up the pretrigger
-  nuphase_set_pretrigger(device, (uint8_t) config.pretrigger & 0x7, (uint8_t) config.surface_pretrigger & 0x7); 
+  if (ret == EPERM && tcfg->policy != SCHED_OTHER) 
+  {
+    //probably not allowed to use realtime scheduling, but better to run at all 
+    fprintf(stderr,"WARNING: not permitted to create %s thread with realtime priority. Using the default.\n", name); 
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED); 
+    ret = pthread_create(thread, &attr, fn, 0); 
+  }
 
-  //set up the trigger delays 
-  nuphase_set_trigger_delays(device, config.trig_delays); 
+  if (ret == EINVAL || ret == EPERM) 
+  {
+    //a bad cpu or priority (e.g. SCHED_FIFO with priority 0). Again, better to run at all 
+    fprintf(stderr,"WARNING: could not create %s thread with the configured cpu/policy/priority (%s). Using the defaults.\n", name, strerror(ret)); 
+    pthread_attr_destroy(&attr); 
+    pthread_attr_init(&attr); 
+    if (config.realtime_mode) pthread_attr_setstacksize(&attr, RT_STACK_SIZE); 
+    ret = pthread_create(thread, &attr, fn, 0); 
+  }
 
-  if (config.apply_attenuations)
+  if (ret) 
+  {
+    fprintf(stderr,"Could not create %s thread: %s\n", name, strerror(ret)); 
+  }
+  else
   {
-    nuphase_set_attenuation(device, config.attenuation[0], config.attenuation[1]); 
+    pthread_setname_np(*thread, name); 
   }
 
-  nuphase_set_trigger_mask(device, config.trigger_mask); 
-  nuphase_set_channel_mask(device, config.channel_mask); 
+  pthread_attr_destroy(&attr); 
+  return ret; 
+}
+
+///
+/////////////////////////////////////////////////////
+
+/* Tunes the attenuations in process (only used before the device is opened for the run) */ 
+static int tune_attenuation() 
+{
+  nuphase_dev_t * dev = nuphase_open(config.spi_devices[0], config.spi_devices[1], 0, 1); 
+  if (!dev) return 1; 
+
+  nuphase_atten_cfg_t atten_cfg; 
+  nuphase_start_config_atten(&start_config, &atten_cfg); 
+  nuphase_atten_result_t result; 
+  int ret = nuphase_atten_tune(dev, &atten_cfg, config.attenuation, &result); 
+  nuphase_close(dev); 
+  nuphase_atten_print(stdout, &result); 
+  return ret; 
+}
 
-  nuphase_set_channel_read_mask(device, MASTER, config.channel_read_mask[0]);
-  nuphase_set_channel_read_mask(device, SLAVE, config.channel_read_mask[1]);
+/* Calibration cache (see nuphase-calib.h) for the alignment. 
+ * The temperatures come from nuphase-hk's shared memory, so if that's not 
+ * there the alignment is always run. */ 
+static int alignment_cache_usable(nuphase_hk_t * hk) 
+{
+  if (!start_config.calib_cache_file || !*start_config.calib_cache_file) return 0; 
 
-  nuphase_set_poll_interval(device, config.poll_usecs); 
+  return !hk_latest(hk); 
+}
 
-  nuphase_set_min_threshold(device, config.min_threshold); 
+static void calib_limits_from_config(nuphase_calib_limits_t * limits) 
+{
+  limits->max_age = start_config.calib_max_age; 
+  limits->max_temp_diff = start_config.calib_max_temp_diff; 
+  limits->rms_tolerance = start_config.calib_rms_tolerance; 
+  limits->check_events = start_config.calib_check_events; 
+}
 
-  nuphase_enable_surface_readout(device, config.surface_readout); 
-  nuphase_set_surface_channel_read_mask(device, config.surface_read_mask); 
+/* Returns 1 if the cached alignment still applies and passes the on-device check 
+ * (leaving the device open), otherwise 0 */ 
+static int alignment_cached() 
+{
+  nuphase_hk_t hk; 
+  nuphase_calib_t calib; 
+  if (!alignment_cache_usable(&hk) || nuphase_calib_read(start_config.calib_cache_file, &calib)) return 0; 
 
-  struct nuphase_surface_setup s;
-  s.vpp_threshold = config.surface_vpp_threshold; 
-  s.coincident_window_length = config.surface_coincidence_window;
-  s.antenna_mask = config.surface_antenna_mask; 
-  s.n_coincident_channels = config.surface_num_coincidences;
+  nuphase_calib_limits_t limits; 
+  calib_limits_from_config(&limits); 
 
-  nuphase_configure_surface(device,&s); 
+  device = nuphase_open(config.spi_devices[0], config.spi_devices[1], 0, 1); 
+  if (!device) return 0; 
 
- 
-  return 0; 
+  const char * why = nuphase_calib_entry_mismatch(&calib.alignment, &limits, nuphase_calib_firmware_id(device), &hk, 
+                                                  start_config.desired_rms_master, start_config.desired_rms_slave); 
+  if (!why && nuphase_calib_check(device, &limits, start_config.desired_rms_master, start_config.desired_rms_slave)) 
+  {
+    why = "on-device check failed"; 
+  }
+
+  if (why) 
+  {
+    printf("Not using cached alignment: %s\n", why); 
+    nuphase_close(device); 
+    device = 0; 
+    return 0; 
+  }
 
+  printf("Cached alignment still good, not running: %s\n", config.alignment_command); 
+  return 1; 
 }
 
-static int setup()
+/* records a successful alignment in the cache (the device must be open) */ 
+static void alignment_record() 
 {
-  //let's do signal handlers. 
-  //My understanding is that the main thread gets all the signals it doesn't block first, so we'll just handle it that way. 
+  nuphase_hk_t hk; 
+  if (!alignment_cache_usable(&hk)) return; 
+
+  nuphase_calib_t calib; 
+  nuphase_calib_read(start_config.calib_cache_file, &calib); 
+  nuphase_calib_entry_set(&calib.alignment, nuphase_calib_firmware_id(device), &hk, start_config.desired_rms_master, start_config.desired_rms_slave, 0); 
+  if (nuphase_calib_write(start_config.calib_cache_file, &calib))
+  {
+    fprintf(stderr,"Could not write %s\n", start_config.calib_cache_file); 
+  }
+}
 
-  sigset_t empty;
-  sigemptyset(&empty); 
-  struct sigaction sa; 
-  sa.sa_mask = empty; 
-  sa.sa_flags = 0; 
-  sa.sa_sigaction = signal_handler; 
+/* Runs the alignment command. Returns 1 if it aligned. 
+ * Like it always has been with system(), the alignment script exits non-zero when it succeeded, 
+ * but being killed for taking too long (or not being able to run at all) is never success. */ 
+static int run_alignment() 
+{
+  nuphase_cmd_result_t result; 
+  nuphase_run(config.alignment_command, config.alignment_timeout, 0, &result); 
+  if (result.timed_out || result.signal || result.status < 0) 
+  {
+    fprintf(stderr,"%s %s\n", config.alignment_command, result.timed_out ? "timed out" : result.signal ? "was killed" : "could not run"); 
+    return 0; 
+  }
+  return result.status != 0; 
+}
 
-  sigaction(SIGINT,  &sa,0); 
-  sigaction(SIGTERM, &sa,0); 
-  sigaction(SIGUSR1, &sa,0); 
-  sigaction(SIGUSR2, &sa,0); 
+static int setup()
+{
+  //signals (config reread and exit) are handled on the reload thread. 
+  //This has to happen before any other threads are started so they don't get them. 
+  if (nuphase_reload_start(NUPHASE_ACQ, on_quit, 0))
+  {
+    fprintf(stderr,"Could not set up signal handling!\n"); 
+    return 1; 
+  }
 
 
   //Read configuration 
@@ -870,10 +3193,13 @@ static int setup()
 
   //run the reconfiguration / alignment program, if necessary 
   // In the future, this might be replaced by a less hacky way of doing this 
-  if (config.alignment_command) 
+  // (unless the cached alignment still applies, in which case the device is already open) 
+  int aligned_now = 0; 
+  if (config.alignment_command && !alignment_cached()) 
   {
+    aligned_now = 1; 
     printf("Running: %s\n", config.alignment_command); 
-    int success = system(config.alignment_command); 
+    int success = run_alignment(); 
     while (!success) 
     {
       fprintf(stderr,"Alignment not successful. Trying a reset.\n"); 
@@ -883,16 +3209,23 @@ static int setup()
       if (start_config.reconfigure_fpga_cmd)
       {
         printf("Reconfiguring FPGA's"); 
-        system(start_config.reconfigure_fpga_cmd); 
+        nuphase_run(start_config.reconfigure_fpga_cmd, config.alignment_timeout, 0, 0); 
       }
 
-      success = system(config.alignment_command); 
+      success = run_alignment(); 
 
       if (success && !config.apply_attenuations)
       {
-        char cmd[1024]; 
-        sprintf(cmd,"%s %g %g", start_config.set_attenuation_cmd, start_config.desired_rms_master, start_config.desired_rms_slave); 
-        system(cmd); 
+        if (start_config.native_attenuation) 
+        {
+          tune_attenuation(); 
+        }
+        else
+        {
+          char cmd[1024]; 
+          sprintf(cmd,"%s %g %g", start_config.set_attenuation_cmd, start_config.desired_rms_master, start_config.desired_rms_slave); 
+          nuphase_run(cmd, start_config.attenuation_timeout, 0, 0); 
+        }
       }
     }
 
@@ -901,7 +3234,7 @@ static int setup()
 
   //open the devices and configure properly
   // the gpio state should already have been set 
-  device = nuphase_open(config.spi_devices[0], config.spi_devices[1], 0, 1); 
+  if (!device) device = nuphase_open(config.spi_devices[0], config.spi_devices[1], 0, 1); 
 
 
   if (!device)
@@ -911,6 +3244,8 @@ static int setup()
     exit(1); 
   }
 
+  if (aligned_now) alignment_record(); 
+
   //If we are loading the thresholds from the status file,
   //we'll mmap the file and copy thresholds over there. 
   if (config.load_thresholds_from_status_file) 
@@ -950,13 +3285,20 @@ static int setup()
     }
   }
 
+  //restore the rest of the controller state if we have a checkpoint (its thresholds win) 
+  if (!checkpoint_restore()) 
+  {
+    nuphase_set_thresholds(device, thresholds.applied, 0); 
+  }
+
+  next_run = run_number; 
   uint64_t run64 = run_number; 
 
   //Set event number offset
   nuphase_set_readout_number_offset(device, run64 * 1000000000); 
 
   if (config.surface_shutdown) nuphase_surface_powerdown(device); 
-  configure_device(); 
+  configure_device(0, &config); 
 
   //set up the beamforming trigger 
   //Right now, this will just always be on. 
@@ -969,35 +3311,69 @@ static int setup()
   nuphase_set_trigger_enables(device, master_enables, MASTER); 
  
 
+  dev_sched_init(); 
+  monitor_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); 
+
   // set up the buffers
   acq_buffer = nuphase_buf_init( config.buffer_capacity, sizeof(acq_buffer_t)); 
   mon_buffer = nuphase_buf_init( config.buffer_capacity, sizeof(monitor_buffer_t)); 
 
+  metrics_open(); 
+
 
   // set up the threads 
+  if (config.realtime_mode) 
+  {
+    //lock everything in memory, including whatever we map later (e.g. thread stacks) 
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+      fprintf(stderr,"WARNING: mlockall failed (%s). Continuing without locked memory.\n", strerror(errno)); 
+    }
+  }
  
-  pthread_create(&the_mon_thread, 0, monitor_thread, 0); 
-  pthread_create(&the_acq_thread, 0, acq_thread, 0); 
-  pthread_create(&the_wri_thread, 0, write_thread, 0); 
-  
+  mon_thread_started = !create_thread(&the_mon_thread, monitor_thread, &config.monitor_thread, "monitor"); 
+  acq_thread_started = mon_thread_started && !create_thread(&the_acq_thread, acq_thread, &config.acq_thread, "acq"); 
+  wri_thread_started = acq_thread_started && !create_thread(&the_wri_thread, write_thread, &config.write_thread, "write"); 
 
-  //increase priority of acquistion thread
-  if (config.realtime_priority > 0) 
+  if (!wri_thread_started) 
   {
-    struct sched_param sp;
-    sp.sched_priority = config.realtime_priority; 
-    pthread_setschedparam(the_acq_thread, SCHED_FIFO, &sp); 
+    //no point running without all of them. Stop whatever did start 
+    fprintf(stderr,"Could not start all the threads. Aborting!\n"); 
+    die = 1; 
+    wakeup_monitor(); 
+    join_threads(); 
+    return 1; 
   }
 
+  //the control socket thread is not realtime 
+  if (!control_listen() && pthread_create(&the_ctl_thread, 0, control_thread, 0)) 
+  {
+    fprintf(stderr,"Could not start the control socket thread\n"); 
+    close(control_listen_fd); 
+    control_listen_fd = -1; 
+  }
 
   return 0;
 }
 
+/* joins the threads that were started */ 
+static void join_threads() 
+{
+  if (acq_thread_started) pthread_join(the_acq_thread,0); 
+  if (mon_thread_started) pthread_join(the_mon_thread,0); 
+  if (wri_thread_started) pthread_join(the_wri_thread,0); 
+  acq_thread_started = mon_thread_started = wri_thread_started = 0; 
+}
+
 int teardown() 
 {
-  pthread_join(the_acq_thread,0); 
-  pthread_join(the_mon_thread,0); 
-  pthread_join(the_wri_thread,0); 
+  join_threads(); 
+  if (control_listen_fd >= 0) 
+  {
+    pthread_join(the_ctl_thread,0); 
+    close(control_listen_fd); 
+    unlink(control_socket_path); 
+  }
 
   //Turn off calpulser 
   nuphase_calpulse(device,0); 
@@ -1023,20 +3399,70 @@ int teardown()
 }
 
 
+static int config_refresh(config_reader_t reader) 
+{
+  config_snapshot_t * snap = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE); 
+  if (!snap || snap->version == config_version) return 0; 
+
+  memcpy(&config, &snap->cfg, sizeof(config)); 
+  config_version = snap->version; 
+
+  //only now can the older ones go 
+  __atomic_store_n(&config_seen[reader], snap->version, __ATOMIC_RELEASE); 
+  return 1; 
+}
+
+static void config_release(config_reader_t reader) 
+{
+  __atomic_store_n(&config_seen[reader], UINT64_MAX, __ATOMIC_RELEASE); 
+}
+
+/* publishes a new snapshot and frees any old ones no one can still be copying. Only called by the main thread. */ 
+static void config_publish(config_snapshot_t * snap) 
+{
+  config_snapshot_t * old = config_current; 
+  snap->version = old ? old->version + 1 : 1; 
+  snap->older = old; 
+  __atomic_store_n(&config_current, snap, __ATOMIC_RELEASE); 
+
+  uint64_t oldest_seen = UINT64_MAX; 
+  int i; 
+  for (i = 0; i < CFG_NREADERS; i++) 
+  {
+    uint64_t seen = __atomic_load_n(&config_seen[i], __ATOMIC_ACQUIRE); 
+    if (seen < oldest_seen) oldest_seen = seen; 
+  }
+
+  // everything older than what every thread has copied is unreachable 
+  config_snapshot_t * keep = snap; 
+  while (keep->older && keep->older->version >= oldest_seen) keep = keep->older; 
+  config_snapshot_t * dead = keep->older; 
+  keep->older = 0; 
+  while (dead) 
+  {
+    config_snapshot_t * next = dead->older; 
+    free(dead); 
+    dead = next; 
+  }
+}
+
 int read_config(int first_time)
 {
 
   char * cfgpath = 0;  
   char * start_cfgpath = 0;  
   
-
-  pthread_mutex_lock(&config_lock); 
-
+  //new configs start from the old one, so things not in the file stay the same 
+  config_snapshot_t * snap = malloc(sizeof(config_snapshot_t)); 
   if (first_time)
   {
-    nuphase_acq_config_init(&config); 
+    nuphase_acq_config_init(&snap->cfg); 
     nuphase_start_config_init(&start_config); 
   }
+  else
+  {
+    memcpy(&snap->cfg, &config_current->cfg, sizeof(snap->cfg)); 
+  }
 
   if (!nuphase_get_cfg_file(&cfgpath, NUPHASE_ACQ))
   {
@@ -1050,25 +3476,32 @@ int read_config(int first_time)
   
 
 
-  nuphase_acq_config_read( cfgpath, &config); 
+  nuphase_acq_config_read( cfgpath, &snap->cfg); 
   nuphase_start_config_read(start_cfgpath, &start_config); 
-  pthread_mutex_unlock(&config_lock); 
 
-  pid_state_init(&control, config.k_p, config.k_i, config.k_d); 
+  //keep the old one around to see what changed 
+  nuphase_acq_cfg_t old_config; 
+  memcpy(&old_config, &config, sizeof(config)); 
+
+  config_publish(snap); 
+  config_refresh(CFG_READER_MAIN); 
 
   if (first_time)
   {
-    fs_avg_init(config.n_fast_scaler_avg); 
+    nuphase_pid_init(&control); 
+    nuphase_rate_init(&fs_avg, config.n_fast_scaler_avg); 
   }
 
   if (!first_time) 
   {
+    //let the monitor thread pick up any new intervals
+    wakeup_monitor(); 
 
-    configure_device(); 
+    configure_device(&old_config, &config); 
 
     //rewrite run number in case we are using a different file 
     FILE * run_file = fopen(tmp_run_file,"w"); 
-    fprintf(run_file,"%d\n", run_number+1); 
+    fprintf(run_file,"%d\n", next_run+1); 
     fclose(run_file); 
     rename(tmp_run_file, config.run_file); 
   }
@@ -0,0 +1,218 @@
+#include "nuphase-atten.h"
+#include "nuphase-common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+
+void nuphase_atten_cfg_init(nuphase_atten_cfg_t * cfg)
+{
+  memset(cfg,0,sizeof(*cfg));
+  cfg->tolerance = 0.05;
+  cfg->step_db = 0.25;
+  cfg->max_atten = 127;
+  cfg->nevents = 8;
+  cfg->max_iterations = 12;
+}
+
+/* -O2 doesn't vectorize this by itself */
+__attribute__((optimize("tree-vectorize")))
+double nuphase_atten_variance(const uint8_t * x, int n)
+{
+  // fits in 32 bits for n < 66000
+  uint32_t sum = 0;
+  uint32_t sum2 = 0;
+  int i;
+  if (n <= 0) return 0;
+
+  for (i = 0; i < n; i++)
+  {
+    uint32_t v = x[i];
+    sum += v;
+    sum2 += v*v;
+  }
+
+  double mean = ((double) sum) / n;
+  double var = ((double) sum2) / n - mean * mean;
+  return var > 0 ? var : 0;
+}
+
+int nuphase_atten_measure(nuphase_dev_t * dev, int nevents, double rms[NP_MAX_BOARDS][NP_NUM_CHAN])
+{
+  double var[NP_MAX_BOARDS][NP_NUM_CHAN];
+  int n[NP_MAX_BOARDS];
+  memset(var,0,sizeof(var));
+  memset(n,0,sizeof(n));
+
+  nuphase_header_t (*headers)[NP_NUM_BUFFER] = malloc(sizeof(*headers));
+  nuphase_event_t (*events)[NP_NUM_BUFFER] = malloc(sizeof(*events));
+  nuphase_header_t * surface_header = malloc(sizeof(*surface_header));
+  nuphase_event_t * surface_event = malloc(sizeof(*surface_event));
+  int nread = 0;
+
+  while (headers && events && surface_header && surface_event && nread < nevents)
+  {
+    nuphase_buffer_mask_t ready = 0;
+    int surface_filled = 0;
+    nuphase_sw_trigger(dev);
+    nuphase_wait(dev, &ready, 1, MASTER);
+    if (!ready) break;
+
+    int nfilled = nuphase_wait_for_and_read_multiple_events(dev, headers, events, surface_header, surface_event, &surface_filled);
+    if (nfilled <= 0) break;
+
+    int iev, ib, ich;
+    for (iev = 0; iev < nfilled; iev++)
+    {
+      const nuphase_event_t * ev = &(*events)[iev];
+      for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+      {
+        if (!ev->board_id[ib]) continue;
+        for (ich = 0; ich < NP_NUM_CHAN; ich++)
+        {
+          var[ib][ich] += nuphase_atten_variance(ev->data[ib][ich], ev->buffer_length);
+        }
+        n[ib]++;
+      }
+    }
+    nread += nfilled;
+  }
+
+  int ib, ich;
+  for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+  {
+    for (ich = 0; ich < NP_NUM_CHAN; ich++)
+    {
+      rms[ib][ich] = n[ib] ? sqrt(var[ib][ich] / n[ib]) : -1;
+    }
+  }
+
+  free(headers);
+  free(events);
+  free(surface_header);
+  free(surface_event);
+  return nread;
+}
+
+int nuphase_atten_tune(nuphase_dev_t * dev, const nuphase_atten_cfg_t * cfg,
+                       const uint8_t start[NP_MAX_BOARDS][NP_NUM_CHAN], nuphase_atten_result_t * result)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN];
+  int lo[NP_MAX_BOARDS][NP_NUM_CHAN];
+  int hi[NP_MAX_BOARDS][NP_NUM_CHAN];
+  double best_err[NP_MAX_BOARDS][NP_NUM_CHAN];
+  double rms[NP_MAX_BOARDS][NP_NUM_CHAN];
+  int ib, ich;
+
+  memset(result,0,sizeof(*result));
+
+  //without knowing what's there, boards with no goal can't be left alone
+  if (!start)
+  {
+    fprintf(stderr,"Attenuation tuning: no starting attenuations\n");
+    return 1;
+  }
+
+  for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+  {
+    for (ich = 0; ich < NP_NUM_CHAN; ich++)
+    {
+      atten[ib][ich] = start[ib][ich];
+      lo[ib][ich] = 0;
+      hi[ib][ich] = cfg->max_atten;
+      best_err[ib][ich] = -1;
+      result->atten[ib][ich] = atten[ib][ich];
+    }
+  }
+
+  while (result->iterations < cfg->max_iterations)
+  {
+    result->iterations++;
+    nuphase_set_attenuation(dev, atten[0], atten[1]);
+    usleep(10000); // let it settle
+
+    if (!nuphase_atten_measure(dev, cfg->nevents, rms))
+    {
+      fprintf(stderr,"Attenuation tuning: no software trigger readout\n");
+      break;
+    }
+
+    int done = 1;
+    for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+    {
+      double goal = cfg->goal[ib];
+      if (goal <= 0) continue;
+
+      //not read out, so nothing to go on (it stays at start)
+      if (rms[ib][0] < 0) continue;
+
+      for (ich = 0; ich < NP_NUM_CHAN; ich++)
+      {
+        double r = rms[ib][ich];
+        int a = atten[ib][ich];
+        double err = fabs(r - goal);
+
+        if (best_err[ib][ich] < 0 || err < best_err[ib][ich])
+        {
+          best_err[ib][ich] = err;
+          result->atten[ib][ich] = a;
+          result->rms[ib][ich] = r;
+        }
+
+        if (err <= cfg->tolerance * goal) continue;
+
+        //more attenuation lowers the rms
+        if (r > goal) lo[ib][ich] = a + 1;
+        else hi[ib][ich] = a - 1;
+
+        //nowhere left to go, so it stays at the best one
+        if (lo[ib][ich] > hi[ib][ich]) continue;
+        done = 0;
+
+        int next = r > 0 ? a + (int) lround(20 * log10(r / goal) / cfg->step_db) : lo[ib][ich];
+        if (next < lo[ib][ich] || next > hi[ib][ich] || next == a) next = (lo[ib][ich] + hi[ib][ich]) / 2;
+        atten[ib][ich] = next;
+      }
+    }
+
+    if (done) break;
+  }
+
+  //leave the best ones on the device
+  nuphase_set_attenuation(dev, result->atten[0], result->atten[1]);
+
+  result->converged = 1;
+  for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+  {
+    if (cfg->goal[ib] <= 0) continue;
+    for (ich = 0; ich < NP_NUM_CHAN; ich++)
+    {
+      if (best_err[ib][ich] < 0 || best_err[ib][ich] > cfg->tolerance * cfg->goal[ib]) result->converged = 0;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  result->seconds = timespec_difference_float(&t1, &t0);
+  return result->converged ? 0 : 1;
+}
+
+void nuphase_atten_print(FILE * f, const nuphase_atten_result_t * result)
+{
+  int ib, ich;
+  fprintf(f,"Attenuation tuning %s after %d iterations (%0.2f s)\n", result->converged ? "converged" : "did NOT converge",
+          result->iterations, result->seconds);
+  for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+  {
+    fprintf(f,"  board %d:", ib);
+    for (ich = 0; ich < NP_NUM_CHAN; ich++)
+    {
+      fprintf(f," %u (%0.2f)", result->atten[ib][ich], result->rms[ib][ich]);
+    }
+    fprintf(f,"\n");
+  }
+}
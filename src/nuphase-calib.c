@@ -0,0 +1,164 @@
+#include "nuphase-calib.h"
+#include "nuphase-common.h"
+#include "nuphase-atten.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+
+static const char * entry_names[] = { "alignment", "attenuation" };
+
+static nuphase_calib_entry_t * get_entry(nuphase_calib_t * calib, int i)
+{
+  return i == 0 ? &calib->alignment : &calib->attenuation;
+}
+
+int nuphase_calib_read(const char * file, nuphase_calib_t * calib)
+{
+  memset(calib,0,sizeof(*calib));
+
+  FILE * f = fopen(file,"r");
+  if (!f) return 1;
+
+  char line[256];
+  while (fgets(line, sizeof(line), f))
+  {
+    char name[32], key[32];
+    double val;
+    int ib, ich;
+    if (sscanf(line,"%31[^.].%31[^=]=%lf", name, key, &val) != 3) continue;
+
+    int i;
+    for (i = 0; i < (int) (sizeof(entry_names) / sizeof(*entry_names)); i++)
+    {
+      if (strcmp(name, entry_names[i])) continue;
+      nuphase_calib_entry_t * e = get_entry(calib, i);
+      if (!strcmp(key,"time")) e->time = (time_t) val;
+      else if (!strcmp(key,"firmware_id")) e->firmware_id = (uint32_t) val;
+      else if (!strcmp(key,"temp_master")) e->temp_master = val;
+      else if (!strcmp(key,"temp_slave")) e->temp_slave = val;
+      else if (!strcmp(key,"rms_master")) e->rms_master = val;
+      else if (!strcmp(key,"rms_slave")) e->rms_slave = val;
+      else if (sscanf(key,"atten%d_%d", &ib, &ich) == 2 && ib >= 0 && ib < NP_MAX_BOARDS && ich >= 0 && ich < NP_NUM_CHAN)
+      {
+        e->atten[ib][ich] = (uint8_t) val;
+        e->have_atten = 1;
+      }
+    }
+  }
+
+  fclose(f);
+  return 0;
+}
+
+int nuphase_calib_write(const char * file, const nuphase_calib_t * calib)
+{
+  char tmp[strlen(file) + sizeof(tmp_suffix)];
+  sprintf(tmp,"%s%s", file, tmp_suffix);
+
+  FILE * f = fopen(tmp,"w");
+  if (!f) return 1;
+
+  int i;
+  for (i = 0; i < (int) (sizeof(entry_names) / sizeof(*entry_names)); i++)
+  {
+    const nuphase_calib_entry_t * e = get_entry((nuphase_calib_t*) calib, i);
+    fprintf(f,"%s.time=%u\n", entry_names[i], (unsigned) e->time);
+    fprintf(f,"%s.firmware_id=%"PRIu32"\n", entry_names[i], e->firmware_id);
+    fprintf(f,"%s.temp_master=%g\n", entry_names[i], e->temp_master);
+    fprintf(f,"%s.temp_slave=%g\n", entry_names[i], e->temp_slave);
+    fprintf(f,"%s.rms_master=%g\n", entry_names[i], e->rms_master);
+    fprintf(f,"%s.rms_slave=%g\n", entry_names[i], e->rms_slave);
+
+    int ib, ich;
+    for (ib = 0; e->have_atten && ib < NP_MAX_BOARDS; ib++)
+    {
+      for (ich = 0; ich < NP_NUM_CHAN; ich++)
+      {
+        fprintf(f,"%s.atten%d_%d=%u\n", entry_names[i], ib, ich, e->atten[ib][ich]);
+      }
+    }
+  }
+
+  if (fclose(f)) return 1;
+  return rename(tmp, file);
+}
+
+uint32_t nuphase_calib_firmware_id(nuphase_dev_t * dev)
+{
+  nuphase_fwinfo_t info[2];
+  memset(info,0,sizeof(info));
+  nuphase_fwinfo(dev, &info[0], MASTER);
+  nuphase_fwinfo(dev, &info[1], SLAVE);
+  return crc32(0, (const Bytef*) info, sizeof(info));
+}
+
+void nuphase_calib_entry_set(nuphase_calib_entry_t * e, uint32_t firmware_id, const nuphase_hk_t * hk, double rms_master, double rms_slave,
+                             const uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN])
+{
+  e->time = time(0);
+  e->firmware_id = firmware_id;
+  e->temp_master = hk->temp_master;
+  e->temp_slave = hk->temp_slave;
+  e->rms_master = rms_master;
+  e->rms_slave = rms_slave;
+  e->have_atten = atten != 0;
+  if (atten) memcpy(e->atten, atten, sizeof(e->atten));
+  else memset(e->atten, 0, sizeof(e->atten));
+}
+
+static int rms_differs(double a, double b, double tolerance)
+{
+  return fabs(a - b) > tolerance * fabs(b);
+}
+
+const char * nuphase_calib_entry_mismatch(const nuphase_calib_entry_t * e, const nuphase_calib_limits_t * limits,
+                                          uint32_t firmware_id, const nuphase_hk_t * hk, double rms_master, double rms_slave)
+{
+  if (!e->time) return "no entry";
+  if (time(0) - e->time > limits->max_age) return "too old";
+  if (e->firmware_id != firmware_id) return "different firmware";
+  if (fabs(hk->temp_master - e->temp_master) > limits->max_temp_diff) return "master temperature changed";
+  if (fabs(hk->temp_slave - e->temp_slave) > limits->max_temp_diff) return "slave temperature changed";
+  if (rms_differs(rms_master, e->rms_master, limits->rms_tolerance) || rms_differs(rms_slave, e->rms_slave, limits->rms_tolerance))
+    return "different rms goals";
+  return 0;
+}
+
+int nuphase_calib_apply(nuphase_dev_t * dev, const nuphase_calib_entry_t * e)
+{
+  if (!e->have_atten) return 1;
+  return nuphase_set_attenuation(dev, e->atten[0], e->atten[1]) != 0;
+}
+
+int nuphase_calib_check(nuphase_dev_t * dev, const nuphase_calib_limits_t * limits, double rms_master, double rms_slave)
+{
+  const double goal[NP_MAX_BOARDS] = { rms_master, rms_slave };
+  double rms[NP_MAX_BOARDS][NP_NUM_CHAN];
+
+  if (!nuphase_atten_measure(dev, limits->check_events, rms))
+  {
+    fprintf(stderr,"Calibration check: no software trigger readout\n");
+    return 1;
+  }
+
+  int ret = 0;
+  int ib, ich;
+  for (ib = 0; ib < NP_MAX_BOARDS; ib++)
+  {
+    if (goal[ib] <= 0 || rms[ib][0] < 0) continue; // no goal, or not read out
+    for (ich = 0; ich < NP_NUM_CHAN; ich++)
+    {
+      if (rms_differs(rms[ib][ich], goal[ib], limits->rms_tolerance))
+      {
+        fprintf(stderr,"Calibration check: board %d channel %d rms %g, goal %g\n", ib, ich, rms[ib][ich], goal[ib]);
+        ret = 1;
+      }
+    }
+  }
+
+  return ret;
+}
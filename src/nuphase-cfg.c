@@ -29,6 +29,33 @@ void nuphase_start_config_init(nuphase_start_cfg_t * c)
   c->desired_rms_slave = 7.0; 
   c->out_dir = "/data/startup/"; 
   c->nchecks = 3; 
+  c->fpga_boot_timeout = 30; 
+  c->fpga_boot_min_wait = 5; 
+  c->reconfigure_timeout = 600; 
+  c->attenuation_timeout = 600; 
+  c->calib_cache_file = "/nuphase/calib.cache"; 
+  c->calib_max_age = 86400; 
+  c->calib_max_temp_diff = 5; 
+  c->calib_rms_tolerance = 0.25; 
+  c->calib_check_events = 4; 
+  c->native_attenuation = 1; 
+  c->atten_tolerance = 0.05; 
+  c->atten_step_db = 0.25; 
+  c->atten_max = 127; 
+  c->atten_events = 8; 
+  c->atten_max_iterations = 12; 
+}
+
+void nuphase_start_config_atten(const nuphase_start_cfg_t * c, nuphase_atten_cfg_t * atten) 
+{
+  nuphase_atten_cfg_init(atten); 
+  atten->goal[0] = c->desired_rms_master; 
+  atten->goal[1] = c->desired_rms_slave; 
+  atten->tolerance = c->atten_tolerance; 
+  atten->step_db = c->atten_step_db; 
+  atten->max_atten = c->atten_max; 
+  atten->nevents = c->atten_events; 
+  atten->max_iterations = c->atten_max_iterations; 
 }
 
 static void lookup_asps_method(const config_t * cfg, nuphase_asps_method_t * method, const char * key)
@@ -41,6 +68,50 @@ static void lookup_asps_method(const config_t * cfg, nuphase_asps_method_t * met
 }
 
 
+static const char * sched_policy_name(int policy) 
+{
+  switch (policy)
+  {
+    case SCHED_FIFO: 
+      return "fifo"; 
+    case SCHED_RR: 
+      return "rr"; 
+    default: 
+      return "other"; 
+  }
+}
+
+static void lookup_sched_policy(const config_t * cfg, int * policy, const char * key) 
+{
+  const char * str; 
+  if (config_lookup_string(cfg, key,&str)) 
+  {
+    *policy = !strcasecmp(str,"fifo") ? SCHED_FIFO : 
+              !strcasecmp(str,"rr") ? SCHED_RR : 
+              SCHED_OTHER; 
+  }
+}
+
+static void lookup_thread_cfg(const config_t * cfg, nuphase_thread_cfg_t * t, const char * name) 
+{
+  char buf[128]; 
+  sprintf(buf,"threads.%s_cpu", name); 
+  config_lookup_int(cfg, buf, &t->cpu); 
+  sprintf(buf,"threads.%s_policy", name); 
+  lookup_sched_policy(cfg, &t->policy, buf); 
+  sprintf(buf,"threads.%s_priority", name); 
+  config_lookup_int(cfg, buf, &t->priority); 
+}
+
+static void write_thread_cfg(FILE * f, const nuphase_thread_cfg_t * t, const char * name) 
+{
+  fprintf(f,"  // %s thread: cpu to pin to (-1 for any), policy (\"other\", \"fifo\" or \"rr\") and realtime priority\n", name); 
+  fprintf(f,"  %s_cpu = %d;\n", name, t->cpu); 
+  fprintf(f,"  %s_policy = \"%s\";\n", name, sched_policy_name(t->policy)); 
+  fprintf(f,"  %s_priority = %d;\n\n", name, t->priority); 
+}
+
+
 int nuphase_start_config_read(const char * file, nuphase_start_cfg_t * c) 
 {
   config_t cfg; 
@@ -57,6 +128,10 @@ int nuphase_start_config_read(const char * file, nuphase_start_cfg_t * c)
   }
   config_lookup_int(&cfg,"min_temperature", &c->min_temperature);
   config_lookup_int(&cfg,"nchecks", &c->nchecks);
+  config_lookup_int(&cfg,"fpga_boot_timeout", &c->fpga_boot_timeout);
+  config_lookup_int(&cfg,"fpga_boot_min_wait", &c->fpga_boot_min_wait);
+  config_lookup_int(&cfg,"reconfigure_timeout", &c->reconfigure_timeout);
+  config_lookup_int(&cfg,"attenuation_timeout", &c->attenuation_timeout);
   config_lookup_int(&cfg,"heater_current", &c->heater_current);
   config_lookup_int(&cfg,"poll_interval", &c->poll_interval);
   config_lookup_float(&cfg,"desired_rms_master", &c->desired_rms_master);
@@ -83,6 +158,22 @@ int nuphase_start_config_read(const char * file, nuphase_start_cfg_t * c)
     c->out_dir = strdup(out_dir); //memory leak :( 
   }
 
+  const char * calib_cache_file; 
+  if (config_lookup_string(&cfg, "calib_cache_file", &calib_cache_file))
+  {
+    c->calib_cache_file = strdup(calib_cache_file); //memory leak :( 
+  }
+  config_lookup_int(&cfg,"calib_max_age", &c->calib_max_age);
+  config_lookup_float(&cfg,"calib_max_temp_diff", &c->calib_max_temp_diff);
+  config_lookup_float(&cfg,"calib_rms_tolerance", &c->calib_rms_tolerance);
+  config_lookup_int(&cfg,"calib_check_events", &c->calib_check_events);
+  config_lookup_int(&cfg,"native_attenuation", &c->native_attenuation);
+  config_lookup_float(&cfg,"atten_tolerance", &c->atten_tolerance);
+  config_lookup_float(&cfg,"atten_step_db", &c->atten_step_db);
+  config_lookup_int(&cfg,"atten_max", &c->atten_max);
+  config_lookup_int(&cfg,"atten_events", &c->atten_events);
+  config_lookup_int(&cfg,"atten_max_iterations", &c->atten_max_iterations);
+
 
   config_destroy(&cfg); 
   return 0; 
@@ -115,6 +206,36 @@ int nuphase_start_config_write(const char * file, const nuphase_start_cfg_t * c)
   fprintf(f, "out_dir=\"%s\";\n\n", c->out_dir); 
   fprintf(f, "//number of checks for each temperature\n"); 
   fprintf(f, "nchecks=%d;\n\n", c->nchecks); 
+  fprintf(f, "//maximum time to wait for the boards to boot after powering on or reconfiguring, in seconds\n"); 
+  fprintf(f, "fpga_boot_timeout=%d;\n\n", c->fpga_boot_timeout); 
+  fprintf(f, "//minimum time to wait for the boards to boot, even if they already look ready, in seconds\n"); 
+  fprintf(f, "fpga_boot_min_wait=%d;\n\n", c->fpga_boot_min_wait); 
+  fprintf(f, "//maximum time for reconfigure_fpga_cmd, in seconds\n"); 
+  fprintf(f, "reconfigure_timeout=%d;\n\n", c->reconfigure_timeout); 
+  fprintf(f, "//maximum time for set_attenuation_cmd, in seconds\n"); 
+  fprintf(f, "attenuation_timeout=%d;\n\n", c->attenuation_timeout); 
+  fprintf(f, "//calibration cache: skip the alignment/attenuation scripts if the last result still applies (\"\" to disable)\n"); 
+  fprintf(f, "calib_cache_file=\"%s\";\n\n", c->calib_cache_file); 
+  fprintf(f, "//maximum age of a cached calibration, in seconds\n"); 
+  fprintf(f, "calib_max_age=%d;\n\n", c->calib_max_age); 
+  fprintf(f, "//maximum board temperature change since a cached calibration, in C\n"); 
+  fprintf(f, "calib_max_temp_diff=%f;\n\n", c->calib_max_temp_diff); 
+  fprintf(f, "//fractional tolerance on the rms goals (and the measured rms) for a cached calibration\n"); 
+  fprintf(f, "calib_rms_tolerance=%f;\n\n", c->calib_rms_tolerance); 
+  fprintf(f, "//number of software triggers to check a cached calibration with\n"); 
+  fprintf(f, "calib_check_events=%d;\n\n", c->calib_check_events); 
+  fprintf(f, "//tune the attenuations in process (1) instead of with set_attenuation_cmd (0)\n"); 
+  fprintf(f, "native_attenuation=%d;\n\n", c->native_attenuation); 
+  fprintf(f, "//native tuning: fractional tolerance on the rms goals\n"); 
+  fprintf(f, "atten_tolerance=%f;\n\n", c->atten_tolerance); 
+  fprintf(f, "//native tuning: dB per attenuation count\n"); 
+  fprintf(f, "atten_step_db=%f;\n\n", c->atten_step_db); 
+  fprintf(f, "//native tuning: largest attenuation setting\n"); 
+  fprintf(f, "atten_max=%d;\n\n", c->atten_max); 
+  fprintf(f, "//native tuning: software triggers per iteration\n"); 
+  fprintf(f, "atten_events=%d;\n\n", c->atten_events); 
+  fprintf(f, "//native tuning: maximum number of iterations\n"); 
+  fprintf(f, "atten_max_iterations=%d;\n\n", c->atten_max_iterations); 
   fclose(f); 
 
   return 0; 
@@ -132,6 +253,7 @@ void nuphase_hk_config_init(nuphase_hk_cfg_t * c)
   c->out_dir = "/data/hk/"; 
   c->max_secs_per_file = 600; 
   c->shm_name = "/hk.bin"; 
+  c->shm_nsamples = 720; 
   c->print_to_screen = 1; 
 }
 
@@ -152,6 +274,7 @@ int nuphase_hk_config_read(const char * file, nuphase_hk_cfg_t * c)
   config_lookup_int(&cfg,"interval", &c->interval);
   config_lookup_int(&cfg,"print_to_screen", &c->print_to_screen);
   config_lookup_int(&cfg,"max_secs_per_file", &c->max_secs_per_file);
+  config_lookup_int(&cfg,"shm_nsamples", &c->shm_nsamples);
   lookup_asps_method(&cfg, &c->asps_method, "asps_method"); 
 
 
@@ -188,6 +311,8 @@ int nuphase_hk_config_write(const char * file, const nuphase_hk_cfg_t * c)
   fprintf(f, "out_dir=\"%s\";\n\n", c->out_dir); 
   fprintf(f, "//shared binary data name \n"); 
   fprintf(f, "shm_name=\"%s\";\n\n", c->shm_name); 
+  fprintf(f, "//number of samples kept in shared memory (720 is an hour at a 5 second interval)\n"); 
+  fprintf(f, "shm_nsamples=%d;\n\n", c->shm_nsamples); 
   fprintf(f, "//1 to print to screen\n"); 
   fprintf(f, "print_to_screen=%d;\n\n", c->print_to_screen); 
   fclose(f); 
@@ -209,7 +334,9 @@ void nuphase_copy_config_init(nuphase_copy_cfg_t * c)
   c->free_space_delete_threshold = 12000; 
   c->delete_files_older_than = 7;  // ? hopefully this is enough! 
   c->wakeup_interval = 600; // every 10 mins
+  c->command_timeout = 3600; 
   c->dummy_mode = 0; 
+  c->dedup_dir = "/data-dedup"; 
 }
 
 
@@ -249,8 +376,15 @@ int nuphase_copy_config_read(const char * file, nuphase_copy_cfg_t * c)
   config_lookup_int(&cfg,"free_space_delete_threshold",&c->free_space_delete_threshold); 
   config_lookup_int(&cfg,"delete_files_older_than",&c->delete_files_older_than); 
   config_lookup_int(&cfg,"wakeup_interval",&c->wakeup_interval); 
+  config_lookup_int(&cfg,"command_timeout",&c->command_timeout); 
   config_lookup_int(&cfg,"dummy_mode",&c->dummy_mode); 
 
+  const char * dedup_dir_str; 
+  if (config_lookup_string(&cfg,"dedup_dir", &dedup_dir_str))
+  {
+    c->dedup_dir = strdup(dedup_dir_str); //memory leak, but not easy to do anything else here. 
+  } 
+
 
   config_destroy(&cfg); 
 
@@ -277,8 +411,12 @@ int nuphase_copy_config_write(const char * file, const nuphase_copy_cfg_t * c)
   fprintf(f,"delete_files_older_than = %d;\n\n", c->delete_files_older_than); 
   fprintf(f,"//This controls how long the process sleeps between copies / deletes\n"); 
   fprintf(f,"wakeup_interval = %d;\n\n", c->wakeup_interval); 
+  fprintf(f,"//rsync / delete commands taking longer than this (in seconds) are killed (and retried next wakeup)\n"); 
+  fprintf(f,"command_timeout = %d;\n\n", c->command_timeout); 
   fprintf(f,"//If non-zero, won't actually delete any files\n"); 
   fprintf(f,"dummy_mode = %d;\n\n", c->dummy_mode); 
+  fprintf(f,"//nuphase-acq's dedup_dir. Entries no run directory links to anymore are deleted after the old files (\"\" to not)\n"); 
+  fprintf(f,"dedup_dir = \"%s\";\n\n", c->dedup_dir); 
   fclose(f); 
 
   return 0; 
@@ -300,18 +438,31 @@ void nuphase_acq_config_init ( nuphase_acq_cfg_t * c)
   c->status_save_file = "/nuphase/last.st.bin"; 
   c->output_directory = "/data/" ; 
   c->alignment_command = "cd /home/nuphase/nuphase-python/;  python align_adcs.py" ; 
+  c->alignment_timeout = 900; 
 
   c->load_thresholds_from_status_file = 1; 
+  c->checkpoint_file = "/nuphase/acq.checkpoint"; 
+  c->checkpoint_interval = 10; 
+  c->checkpoint_max_age = 600; 
+  c->control_socket = "/tmp/nuphase-acq.sock"; 
 
   int i; 
   for ( i = 0; i < NP_NUM_BEAMS; i++) c->scaler_goal[i] = 1; 
 
 
   //TODO tune this 
-  c->k_p = 10; 
-  c->k_i = 10; 
-  c->k_d = 0; 
+  for ( i = 0; i < NP_NUM_BEAMS; i++) 
+  {
+    c->k_p[i] = 10; 
+    c->k_i[i] = 0.1; 
+    c->k_d[i] = 0; 
+  }
   c->max_threshold_increase = 500; 
+  c->max_threshold_decrease = 500; 
+  c->max_integral = 200; 
+  c->derivative_filter_tau = 5; 
+  c->gain_schedule_ratio = 0; 
+  c->gain_schedule_factor = 2; 
   c->trigger_mask = 0x7fff; 
   c->channel_mask = 0xff; 
   c->channel_read_mask[0] = 0xff;
@@ -325,6 +476,8 @@ void nuphase_acq_config_init ( nuphase_acq_cfg_t * c)
   c->poll_usecs = 500; 
 
   c->run_length = 7200; 
+  c->rollover = 1; 
+  c->livetime_interval = 60; 
   c->spi_clock = 20; 
   c->waveform_length = 512; 
   c->enable_phased_trigger = 1; 
@@ -365,10 +518,34 @@ void nuphase_acq_config_init ( nuphase_acq_cfg_t * c)
   c->status_per_file = 200; 
   c->surface_events_per_file = 100; 
   c->n_fast_scaler_avg = 20; 
-  c->realtime_priority = 20; 
+  c->rate_estimator = NP_RATE_BOXCAR; 
+  c->rate_ewma_tau = 10; 
+  c->rate_process_noise = 0.05; 
+  c->rate_noise_sigmas = 0; 
+  c->scaler_sample_interval = 0; 
+  c->threshold_deadband = 2; 
+  c->temperature_feedforward = 0; 
+  c->ff_temperature_sensor = "master"; 
+  c->ff_fit_tau = 3*24*3600; 
+  c->ff_temperature_tau = 300; 
+  c->ff_max_slope = 2000; 
+  c->ff_min_spread = 2; 
+  c->ff_settled_fraction = 0.3; 
+  c->ff_max_hk_age = 300; 
+  c->acq_thread.cpu = -1; 
+  c->acq_thread.policy = SCHED_FIFO; 
+  c->acq_thread.priority = 20; 
+  c->monitor_thread.cpu = -1; 
+  c->monitor_thread.policy = SCHED_OTHER; 
+  c->monitor_thread.priority = 0; 
+  c->write_thread.cpu = -1; 
+  c->write_thread.policy = SCHED_OTHER; 
+  c->write_thread.priority = 0; 
+  c->realtime_mode = 0; 
 
   c->copy_paths_to_rundir = "/home/nuphase/nuphase-python/output:/proc/loadavg"; 
   c->copy_configs = 1; 
+  c->dedup_dir = "/data-dedup"; 
   memset(c->trig_delays,0,sizeof(c->trig_delays)); 
 
   c->surface_readout = 1; 
@@ -381,6 +558,16 @@ void nuphase_acq_config_init ( nuphase_acq_cfg_t * c)
   c->surface_shutdown = 0; 
   c->surface_read_mask = 0xfc; 
 
+  c->free_space_check_interval = 10; 
+  c->free_space_compress_mb = 8000; 
+  c->free_space_prescale_mb = 4000; 
+  c->free_space_headers_only_mb = 2000; 
+  c->free_space_hysteresis_mb = 500; 
+  c->degraded_compression_level = 9; 
+  c->forced_trigger_prescale = 10; 
+  c->stats_file = "/nuphase/acq.stats"; 
+  c->metrics_shm = "/acq-metrics.bin"; 
+  c->metrics_interval = 1; 
 }
 
 int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c) 
@@ -408,17 +595,54 @@ int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c)
   }
 
   int tmp; 
+  const char * str; 
   if ( config_lookup_int(&cfg,"control.trigger_mask",&tmp))
     c->trigger_mask = tmp; 
   if (config_lookup_int(&cfg,"control.channel_mask",&tmp))
     c->channel_mask = tmp; 
-  config_lookup_float(&cfg,"control.k_p",&c->k_p); 
-  config_lookup_float(&cfg,"control.k_i",&c->k_i); 
-  config_lookup_float(&cfg,"control.k_d",&c->k_d); 
-  config_lookup_int(&cfg,"control.max_threshold_increase",&tmp); 
-  c->max_threshold_increase = tmp; 
+
+  //the gains can be set for all beams, then overriden per beam 
+  double gain; 
+  if (config_lookup_float(&cfg,"control.k_p",&gain)) 
+    for (i = 0; i < NP_NUM_BEAMS; i++) c->k_p[i] = gain; 
+  if (config_lookup_float(&cfg,"control.k_i",&gain)) 
+    for (i = 0; i < NP_NUM_BEAMS; i++) c->k_i[i] = gain; 
+  if (config_lookup_float(&cfg,"control.k_d",&gain)) 
+    for (i = 0; i < NP_NUM_BEAMS; i++) c->k_d[i] = gain; 
+
+  for (i = 0; i < NP_NUM_BEAMS; i++) 
+  {
+    char buf[128]; 
+    sprintf(buf, "control.beam_gains.beam%d.k_p",i); 
+    config_lookup_float(&cfg, buf, &c->k_p[i]); 
+    sprintf(buf, "control.beam_gains.beam%d.k_i",i); 
+    config_lookup_float(&cfg, buf, &c->k_i[i]); 
+    sprintf(buf, "control.beam_gains.beam%d.k_d",i); 
+    config_lookup_float(&cfg, buf, &c->k_d[i]); 
+  }
+
+  if (config_lookup_int(&cfg,"control.max_threshold_increase",&tmp))
+    c->max_threshold_increase = tmp; 
+  if (config_lookup_int(&cfg,"control.max_threshold_decrease",&tmp))
+    c->max_threshold_decrease = tmp; 
+  config_lookup_float(&cfg,"control.max_integral",&c->max_integral); 
+  config_lookup_float(&cfg,"control.derivative_filter_tau",&c->derivative_filter_tau); 
+  config_lookup_float(&cfg,"control.gain_schedule_ratio",&c->gain_schedule_ratio); 
+  config_lookup_float(&cfg,"control.gain_schedule_factor",&c->gain_schedule_factor); 
   config_lookup_int(&cfg,"control.min_threshold",&tmp); 
   c->min_threshold = tmp; 
+  config_lookup_float(&cfg,"control.threshold_deadband",&c->threshold_deadband); 
+  config_lookup_int(&cfg,"control.temperature_feedforward",&c->temperature_feedforward); 
+  if (config_lookup_string(&cfg,"control.ff_temperature_sensor",&str))
+  {
+    c->ff_temperature_sensor = strdup(str); 
+  }
+  config_lookup_float(&cfg,"control.ff_fit_tau",&c->ff_fit_tau); 
+  config_lookup_float(&cfg,"control.ff_temperature_tau",&c->ff_temperature_tau); 
+  config_lookup_float(&cfg,"control.ff_max_slope",&c->ff_max_slope); 
+  config_lookup_float(&cfg,"control.ff_min_spread",&c->ff_min_spread); 
+  config_lookup_float(&cfg,"control.ff_settled_fraction",&c->ff_settled_fraction); 
+  config_lookup_int(&cfg,"control.ff_max_hk_age",&c->ff_max_hk_age); 
   config_lookup_float(&cfg,"control.monitor_interval",&c->monitor_interval); 
   config_lookup_float(&cfg,"control.sw_trigger_interval",&c->sw_trigger_interval); 
   config_lookup_int(&cfg,"control.enable_phased_trigger",&c->enable_phased_trigger); 
@@ -427,7 +651,23 @@ int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c)
   config_lookup_float(&cfg,"control.slow_scaler_weight",&c->slow_scaler_weight); 
   config_lookup_int(&cfg,"control.n_fast_scaler_avg",&c->n_fast_scaler_avg); 
   config_lookup_int(&cfg,"control.subtract_gated",&c->subtract_gated); 
-  config_lookup_int(&cfg,"control.realtime_priority",&c->realtime_priority); 
+  if (config_lookup_string(&cfg,"control.rate_estimator",&str))
+  {
+    int e = nuphase_rate_estimator_from_name(str); 
+    if (e < 0) fprintf(stderr,"Unknown rate_estimator %s, keeping %s\n", str, nuphase_rate_estimator_name(c->rate_estimator)); 
+    else c->rate_estimator = e; 
+  }
+  config_lookup_float(&cfg,"control.rate_ewma_tau",&c->rate_ewma_tau); 
+  config_lookup_float(&cfg,"control.rate_process_noise",&c->rate_process_noise); 
+  config_lookup_float(&cfg,"control.rate_noise_sigmas",&c->rate_noise_sigmas); 
+  config_lookup_float(&cfg,"control.scaler_sample_interval",&c->scaler_sample_interval); 
+
+  //old way of setting the acq thread priority 
+  if (config_lookup_int(&cfg,"control.realtime_priority",&tmp) || config_lookup_int(&cfg,"output.realtime_priority",&tmp))
+  {
+    c->acq_thread.priority = tmp; 
+    c->acq_thread.policy = tmp > 0 ? SCHED_FIFO : SCHED_OTHER; 
+  }
   config_lookup_int(&cfg,"control.poll_usecs",&tmp); 
   c->poll_usecs = tmp; 
 
@@ -446,6 +686,20 @@ int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c)
 
   config_lookup_int(&cfg,"control.load_thresholds_from_status_file",&c->load_thresholds_from_status_file); 
 
+  const char * checkpoint_file = 0; 
+  if (config_lookup_string(&cfg, "control.checkpoint_file", &checkpoint_file))
+  {
+    c->checkpoint_file = strdup(checkpoint_file); 
+  }
+  config_lookup_int(&cfg,"control.checkpoint_interval",&c->checkpoint_interval); 
+  config_lookup_int(&cfg,"control.checkpoint_max_age",&c->checkpoint_max_age); 
+
+  const char * control_socket = 0; 
+  if (config_lookup_string(&cfg, "control.socket", &control_socket))
+  {
+    c->control_socket = strdup(control_socket); 
+  }
+
 
   const char *spi = 0; 
 
@@ -497,6 +751,7 @@ int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c)
     c->channel_read_mask[1] = tmp; 
 
   config_lookup_int(&cfg,"device.surface_read_mask",&c->surface_read_mask); 
+  config_lookup_int(&cfg,"device.alignment_timeout",&c->alignment_timeout); 
 
   const char * cmd; 
   if (config_lookup_string(&cfg, "device.alignment_command", &cmd) )
@@ -523,12 +778,45 @@ int nuphase_acq_config_read(const char * fi, nuphase_acq_cfg_t * c)
   }
 
 
+  const char * dedup_dir; 
+  if (config_lookup_string( &cfg, "output.dedup_dir", &dedup_dir))
+  {
+    c->dedup_dir = strdup(dedup_dir); 
+  }
+
+  const char * stats_file; 
+  if (config_lookup_string( &cfg, "output.stats_file", &stats_file))
+  {
+    c->stats_file = strdup(stats_file); 
+  }
+
+  const char * metrics_shm; 
+  if (config_lookup_string( &cfg, "output.metrics_shm", &metrics_shm))
+  {
+    c->metrics_shm = strdup(metrics_shm); 
+  }
+  config_lookup_int(&cfg,"output.metrics_interval", &c->metrics_interval); 
+
   config_lookup_int(&cfg,"output.print_interval", &c->print_interval); 
   config_lookup_int(&cfg,"output.run_length", &c->run_length); 
+  config_lookup_int(&cfg,"output.rollover", &c->rollover); 
+  config_lookup_int(&cfg,"output.livetime_interval", &c->livetime_interval); 
   config_lookup_int(&cfg,"output.events_per_file", &c->events_per_file); 
   config_lookup_int(&cfg,"output.surface_events_per_file", &c->surface_events_per_file); 
   config_lookup_int(&cfg,"output.status_per_file", &c->status_per_file); 
   config_lookup_int(&cfg,"output.copy_configs", &c->copy_configs); 
+  config_lookup_int(&cfg,"output.free_space_check_interval", &c->free_space_check_interval); 
+  config_lookup_int(&cfg,"output.free_space_compress_mb", &c->free_space_compress_mb); 
+  config_lookup_int(&cfg,"output.free_space_prescale_mb", &c->free_space_prescale_mb); 
+  config_lookup_int(&cfg,"output.free_space_headers_only_mb", &c->free_space_headers_only_mb); 
+  config_lookup_int(&cfg,"output.free_space_hysteresis_mb", &c->free_space_hysteresis_mb); 
+  config_lookup_int(&cfg,"output.degraded_compression_level", &c->degraded_compression_level); 
+  config_lookup_int(&cfg,"output.forced_trigger_prescale", &c->forced_trigger_prescale); 
+
+  lookup_thread_cfg(&cfg, &c->acq_thread, "acq"); 
+  lookup_thread_cfg(&cfg, &c->monitor_thread, "monitor"); 
+  lookup_thread_cfg(&cfg, &c->write_thread, "write"); 
+  config_lookup_int(&cfg,"threads.realtime_mode", &c->realtime_mode); 
 
   for (i = 0; i < NP_NUM_CHAN; i++)
   {
@@ -574,20 +862,74 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"   channel_mask = 0x%x;\n\n", c->channel_mask); 
 
   fprintf(f,"   // pid loop proportional term\n"); 
-  fprintf(f,"   k_p = %g;\n\n", c->k_p); 
+  fprintf(f,"   k_p = %g;\n\n", c->k_p[0]); 
 
   fprintf(f,"   // pid loop integral term\n"); 
-  fprintf(f,"   k_i = %g;\n\n", c->k_i);
+  fprintf(f,"   k_i = %g;\n\n", c->k_i[0]);
+
+  fprintf(f,"   // pid loop differential term (on the measured rate)\n"); 
+  fprintf(f,"   k_d = %g;\n\n", c->k_d[0]);
 
-  fprintf(f,"   // pid loop differential term\n"); 
-  fprintf(f,"   k_d = %g;\n\n", c->k_d);
+  fprintf(f,"   // per-beam overrides of the pid gains, e.g. beam_gains = { beam13 = { k_p = 5; k_i = 0.05; k_d = 0; }; };\n"); 
+  fprintf(f,"   beam_gains = {\n"); 
+  for (i = 1; i < NP_NUM_BEAMS; i++)
+  {
+    if (c->k_p[i] != c->k_p[0] || c->k_i[i] != c->k_i[0] || c->k_d[i] != c->k_d[0])
+    {
+      fprintf(f,"     beam%d = { k_p = %g; k_i = %g; k_d = %g; };\n", i, c->k_p[i], c->k_i[i], c->k_d[i]); 
+    }
+  }
+  fprintf(f,"    };\n\n"); 
 
   fprintf(f,"   // max threshold increase per step \n"); 
   fprintf(f,"   max_threshold_increase=%u;\n\n", c->max_threshold_increase); 
 
+  fprintf(f,"   // max threshold decrease per step \n"); 
+  fprintf(f,"   max_threshold_decrease=%u;\n\n", c->max_threshold_decrease); 
+
+  fprintf(f,"   // anti-windup: max size of the integral term, in threshold units (<= 0 for no limit)\n"); 
+  fprintf(f,"   max_integral = %g;\n\n", c->max_integral); 
+
+  fprintf(f,"   // time constant (in seconds) of the low pass filter on the derivative term (0 for none)\n"); 
+  fprintf(f,"   derivative_filter_tau = %g;\n\n", c->derivative_filter_tau); 
+
+  fprintf(f,"   // gain scheduling: when the rate is off from the goal by more than this factor (<= 1 to disable)...\n"); 
+  fprintf(f,"   gain_schedule_ratio = %g;\n\n", c->gain_schedule_ratio); 
+
+  fprintf(f,"   // ...multiply the gains by this\n"); 
+  fprintf(f,"   gain_schedule_factor = %g;\n\n", c->gain_schedule_factor); 
+
   fprintf(f,"   // minimum threshold for any beam\n"); 
   fprintf(f,"   min_threshold=%u;\n\n", c->min_threshold); 
 
+  fprintf(f,"   // only write thresholds when some beam moves by at least this much (smaller corrections accumulate)\n"); 
+  fprintf(f,"   threshold_deadband = %g;\n\n", c->threshold_deadband); 
+
+  fprintf(f,"   // temperature feed-forward: fit the thresholds against temperature (from nuphase-hk's shared memory)\n"); 
+  fprintf(f,"   //  and move them with the temperature, so the pid loop only corrects what's left (off by default until validated)\n"); 
+  fprintf(f,"   temperature_feedforward = %d;\n\n", c->temperature_feedforward); 
+
+  fprintf(f,"   // which temperature to use (\"master\", \"slave\", \"case\" or \"asps\")\n"); 
+  fprintf(f,"   ff_temperature_sensor = \"%s\";\n\n", c->ff_temperature_sensor); 
+
+  fprintf(f,"   // memory of the threshold vs. temperature fit (in seconds)\n"); 
+  fprintf(f,"   ff_fit_tau = %g;\n\n", c->ff_fit_tau); 
+
+  fprintf(f,"   // time constant for smoothing the temperature (in seconds)\n"); 
+  fprintf(f,"   ff_temperature_tau = %g;\n\n", c->ff_temperature_tau); 
+
+  fprintf(f,"   // don't use fits steeper than this (threshold units per degree)\n"); 
+  fprintf(f,"   ff_max_slope = %g;\n\n", c->ff_max_slope); 
+
+  fprintf(f,"   // don't use fits until the fitted temperatures have at least this standard deviation (degrees)\n"); 
+  fprintf(f,"   ff_min_spread = %g;\n\n", c->ff_min_spread); 
+
+  fprintf(f,"   // only fit when the rate is within this fraction of the goal\n"); 
+  fprintf(f,"   ff_settled_fraction = %g;\n\n", c->ff_settled_fraction); 
+
+  fprintf(f,"   // ignore housekeeping older than this (in seconds)\n"); 
+  fprintf(f,"   ff_max_hk_age = %d;\n\n", c->ff_max_hk_age); 
+
   fprintf(f,"   //monitoring interval, for PID loop (in seconds)\n"); 
   fprintf(f,"   monitor_interval = %g;\n\n",c->monitor_interval); 
 
@@ -612,6 +954,25 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"   //Whether or not to subtract off gated scalers\n"); 
   fprintf(f,"   subtract_gated = %d;\n\n", c->subtract_gated); 
 
+  fprintf(f,"   //Rate estimator for the pid loop: \"boxcar\" (average of n_fast_scaler_avg fast scalers, blended with the slow scaler using the weights),\n"); 
+  fprintf(f,"   // \"ewma\" (same, but exponentially weighted with rate_ewma_tau) or \"kalman\" (combines fast and slow scalers by their uncertainties)\n"); 
+  fprintf(f,"   // boxcar is what it always was\n"); 
+  fprintf(f,"   rate_estimator = \"%s\";\n\n", nuphase_rate_estimator_name(c->rate_estimator)); 
+
+  fprintf(f,"   //time constant of the ewma rate estimator (in seconds)\n"); 
+  fprintf(f,"   rate_ewma_tau = %g;\n\n", c->rate_ewma_tau); 
+
+  fprintf(f,"   //kalman rate estimator: expected fractional drift of the rate per sqrt(second)\n"); 
+  fprintf(f,"   rate_process_noise = %g;\n\n", c->rate_process_noise); 
+
+  fprintf(f,"   //rate errors within about this many standard deviations of the estimate are shrunk, which changes the control law (0, the default, to disable)\n"); 
+  fprintf(f,"   rate_noise_sigmas = %g;\n\n", c->rate_noise_sigmas); 
+
+  fprintf(f,"   //sample the scalers this often (in seconds) between monitor updates, for the rate estimate (0 to disable).\n"); 
+  fprintf(f,"   // Each sample is a full status read, so this adds SPI traffic (0.25 with monitor_interval = 1 is 4x the status reads).\n"); 
+  fprintf(f,"   // Note that with the boxcar estimator, n_fast_scaler_avg then counts samples, not monitor updates.\n"); 
+  fprintf(f,"   scaler_sample_interval = %g;\n\n", c->scaler_sample_interval); 
+
 
   fprintf(f,"   //File to persist the status info (primarily for saving thresholds between restarts)\n") ;
   fprintf(f,"   status_save_file = \"%s\"\n\n", c->status_save_file); 
@@ -619,6 +980,18 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"   // load thresholds from status file on start.\n");  
   fprintf(f,"   load_thresholds_from_status_file=%d\n\n", c->load_thresholds_from_status_file); 
 
+  fprintf(f,"   // File to checkpoint the controller state to (restored on start if recent enough, \"\" to disable)\n"); 
+  fprintf(f,"   checkpoint_file = \"%s\"\n\n", c->checkpoint_file); 
+
+  fprintf(f,"   // write the checkpoint every this many monitor updates (0 to disable)\n"); 
+  fprintf(f,"   checkpoint_interval = %d\n\n", c->checkpoint_interval); 
+
+  fprintf(f,"   // don't restore checkpoints older than this many seconds (0 for no limit)\n"); 
+  fprintf(f,"   checkpoint_max_age = %d\n\n", c->checkpoint_max_age); 
+
+  fprintf(f,"   // Unix socket for control commands (e.g. echo help | socat - UNIX-CONNECT:path), \"\" for none. Only read at startup.\n"); 
+  fprintf(f,"   socket = \"%s\"\n\n", c->control_socket); 
+
    fprintf(f,"   // Number of coincidences necessary for surface channels\n");
    fprintf(f,"   surface_num_coincidences = %d; \n\n", c->surface_num_coincidences); 
 
@@ -699,6 +1072,9 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"  //command used to run the alignment program.\n"); 
   fprintf(f,"  alignment_command=\"%s\",\n\n", c->alignment_command); 
 
+  fprintf(f,"  //seconds before the alignment command (or an FPGA reconfigure) is killed\n"); 
+  fprintf(f,"  alignment_timeout=%d;\n\n", c->alignment_timeout); 
+
   fprintf(f,"  //channel trig delays (right now can be 0-3)\n"); 
   fprintf(f,"  trig_delays = {\n"); 
   for (i = 0; i < NP_NUM_CHAN; i++)
@@ -729,9 +1105,24 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"  //print to screen interval (0 to disable)\n"); 
   fprintf(f,"  print_interval = %d;\n\n", c->print_interval); 
 
+  fprintf(f,"  //machine-readable stats (e.g. latency histograms), rewritten every print_interval (\"\" to disable)\n"); 
+  fprintf(f,"  stats_file = \"%s\";\n\n", c->stats_file); 
+
+  fprintf(f,"  //shared memory region with live metrics, read by nuphase-current-acq (\"\" to disable)\n"); 
+  fprintf(f,"  metrics_shm = \"%s\";\n\n", c->metrics_shm); 
+
+  fprintf(f,"  //how often the metrics are updated, in seconds\n"); 
+  fprintf(f,"  metrics_interval = %d;\n\n", c->metrics_interval); 
+
   fprintf(f,"  // run length, in seconds\n"); 
   fprintf(f,"  run_length = %d; \n\n",c->run_length); 
 
+  fprintf(f,"  // at the end of a run, 1 to continue into the next run without restarting, 0 to exit\n"); 
+  fprintf(f,"  rollover = %d; \n\n",c->rollover); 
+
+  fprintf(f,"  // how often (in seconds) to log livetime to the acq log (0 for only at the end of each run)\n"); 
+  fprintf(f,"  livetime_interval = %d; \n\n",c->livetime_interval); 
+
   fprintf(f,"  //events per output file\n");
   fprintf(f,"  events_per_file = %d;\n\n", c->events_per_file); 
 
@@ -742,9 +1133,6 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"  //statuses per output file\n"); 
   fprintf(f,"  status_per_file = %d;\n\n", c->status_per_file); 
 
-  fprintf(f,"  //realtime priority setting. If 0, will use non-realtime priority. Otherwise, SCHED_FIFO is used with the given priority\n"); 
-  fprintf(f,"  realtime_priority = %d;\n\n", c->realtime_priority); 
-
   fprintf(f,"  //Interval between polling SPI link for data. 0 to just sched_yield\n"); 
   fprintf(f,"  poll_usecs = %u;\n\n", c->poll_usecs); 
 
@@ -752,8 +1140,43 @@ int nuphase_acq_config_write(const char * fi, const nuphase_acq_cfg_t * c)
   fprintf(f,"  copy_paths_to_rundir = \"%s\";\n\n", c->copy_paths_to_rundir); 
 
   fprintf(f,"  //Whether or not to copy configs into run dir\n"); 
-  fprintf(f,"  copy_configs = %d;\n", c->copy_configs); 
+  fprintf(f,"  copy_configs = %d;\n\n", c->copy_configs); 
+
+  fprintf(f,"  //Files copied into run dirs are also hardlinked here, so unchanged ones are linked instead of copied next run (for up to a day).\n"); 
+  fprintf(f,"  //Must be on the same filesystem as output_directory, but outside nuphase-copy's local_path (\"\" to always copy)\n"); 
+  fprintf(f,"  dedup_dir = \"%s\";\n\n", c->dedup_dir); 
+
+  fprintf(f,"  //How often (in seconds) to check the free space in output_directory\n"); 
+  fprintf(f,"  free_space_check_interval = %d;\n\n", c->free_space_check_interval); 
+
+  fprintf(f,"  //Below this much free space (in MB), raise the compression level (<=0 to disable)\n"); 
+  fprintf(f,"  free_space_compress_mb = %d;\n\n", c->free_space_compress_mb); 
+
+  fprintf(f,"  //Below this much free space (in MB), also prescale forced triggers (<=0 to disable)\n"); 
+  fprintf(f,"  free_space_prescale_mb = %d;\n\n", c->free_space_prescale_mb); 
+
+  fprintf(f,"  //Below this much free space (in MB), only write headers and statuses (<=0 to disable)\n"); 
+  fprintf(f,"  free_space_headers_only_mb = %d;\n\n", c->free_space_headers_only_mb); 
 
+  fprintf(f,"  //Extra free space (in MB) needed above a threshold before leaving a degraded mode\n"); 
+  fprintf(f,"  free_space_hysteresis_mb = %d;\n\n", c->free_space_hysteresis_mb); 
+
+  fprintf(f,"  //gzip compression level used once free space is low\n"); 
+  fprintf(f,"  degraded_compression_level = %d;\n\n", c->degraded_compression_level); 
+
+  fprintf(f,"  //Only keep one in this many forced triggers once free space is lower still\n"); 
+  fprintf(f,"  forced_trigger_prescale = %d;\n", c->forced_trigger_prescale); 
+
+  fprintf(f,"};\n\n"); 
+
+  fprintf(f,"//settings related to thread scheduling. Require restart.\n"); 
+  fprintf(f,"threads: \n") ; 
+  fprintf(f,"{\n"); 
+  write_thread_cfg(f, &c->acq_thread, "acq"); 
+  write_thread_cfg(f, &c->monitor_thread, "monitor"); 
+  write_thread_cfg(f, &c->write_thread, "write"); 
+  fprintf(f,"  // lock all memory, prefault thread stacks and warn if threads run on non-isolated cpus\n"); 
+  fprintf(f,"  realtime_mode = %d;\n", c->realtime_mode); 
   fprintf(f,"};\n\n"); 
 
   return 0; 
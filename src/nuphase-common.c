@@ -4,6 +4,18 @@
 #include <stdlib.h> 
 #include <string.h> 
 #include <sys/stat.h> 
+#include <inttypes.h> 
+#include <pthread.h> 
+#include <signal.h> 
+#include <errno.h> 
+#include <unistd.h> 
+#include <poll.h> 
+#include <sys/signalfd.h> 
+#include <sys/inotify.h> 
+#include <sys/wait.h> 
+#include <spawn.h> 
+#include <fcntl.h> 
+#include <sched.h> 
 
 
 
@@ -73,4 +85,485 @@ int do_close(gzFile gzf, char * path)
 }
 
 
+void nuphase_latency_hist_reset(nuphase_latency_hist_t * h) 
+{
+  memset(h,0,sizeof(*h)); 
+}
+
+void nuphase_latency_hist_add(nuphase_latency_hist_t * h, const struct timespec * start, const struct timespec * end) 
+{
+  int64_t us = (end->tv_sec - start->tv_sec) * 1000000ll + (end->tv_nsec - start->tv_nsec) / 1000; 
+  if (us < 0) us = 0; 
+  if (us > UINT32_MAX) us = UINT32_MAX; 
+
+  int bin = us < 2 ? 0 : 31 - __builtin_clz((uint32_t) us); 
+  if (bin >= NUPHASE_LATENCY_NBINS) bin = NUPHASE_LATENCY_NBINS-1; 
+
+  h->counts[bin]++; 
+  h->n++; 
+  h->sum_us += us; 
+  if (us > h->max_us) h->max_us = us; 
+}
+
+uint32_t nuphase_latency_hist_quantile(const nuphase_latency_hist_t * h, double q) 
+{
+  if (!h->n) return 0; 
+
+  uint64_t goal = q * h->n; 
+  uint64_t sum = 0; 
+  int i; 
+  for (i = 0; i < NUPHASE_LATENCY_NBINS-1; i++) 
+  {
+    sum += h->counts[i]; 
+    if (sum > goal) 
+    {
+      uint32_t edge = 2u << i; 
+      return edge < h->max_us ? edge : h->max_us; 
+    }
+  }
+  return h->max_us; 
+}
+
+void nuphase_latency_hist_print(FILE * f, const char * name, const nuphase_latency_hist_t * h) 
+{
+  fprintf(f,"    %-20s n: %-8"PRIu64" mean: %-8.0f p50: %-8u p90: %-8u p99: %-8u max: %u (us)\n", name, h->n, 
+          h->n ? ((double) h->sum_us) / h->n : 0., 
+          nuphase_latency_hist_quantile(h,0.5), nuphase_latency_hist_quantile(h,0.9), nuphase_latency_hist_quantile(h,0.99), h->max_us); 
+}
+
+void nuphase_latency_hist_write(FILE * f, const char * name, const nuphase_latency_hist_t * h) 
+{
+  fprintf(f,"%s.n=%"PRIu64"\n", name, h->n); 
+  fprintf(f,"%s.sum_us=%"PRIu64"\n", name, h->sum_us); 
+  fprintf(f,"%s.max_us=%u\n", name, h->max_us); 
+  fprintf(f,"%s.p50_us=%u\n", name, nuphase_latency_hist_quantile(h,0.5)); 
+  fprintf(f,"%s.p99_us=%u\n", name, nuphase_latency_hist_quantile(h,0.99)); 
+  fprintf(f,"%s.bins=", name); 
+  int i; 
+  for (i = 0; i < NUPHASE_LATENCY_NBINS; i++) 
+  {
+    fprintf(f,"%s%u", i ? "," : "", h->counts[i]); 
+  }
+  fprintf(f,"\n"); 
+}
+
+
+/////////////////////////////////////////////////////
+// config reloading 
+
+static struct 
+{
+  pthread_t thread; 
+  int sfd; 
+  int ifd; 
+  char * watch_name; 
+  pthread_mutex_t lock; 
+  pthread_cond_t cond; 
+  int reload_pending; 
+  int quit; 
+  void (*on_quit)(void *); 
+  void * arg; 
+} reload = { .sfd = -1, .ifd = -1, .lock = PTHREAD_MUTEX_INITIALIZER }; 
+
+/* returns 1 if the config file was written (or moved into place) */ 
+static int reload_drain_inotify() 
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event)))); 
+  ssize_t len; 
+  int changed = 0; 
+
+  while ( (len = read(reload.ifd, buf, sizeof(buf))) > 0) 
+  {
+    char * ptr = buf; 
+    while (ptr < buf + len) 
+    {
+      const struct inotify_event * ev = (const struct inotify_event *) ptr; 
+      if (ev->len && !strcmp(ev->name, reload.watch_name)) changed = 1; 
+      ptr += sizeof(struct inotify_event) + ev->len; 
+    }
+  }
+
+  return changed; 
+}
+
+static void * reload_thread(void * v) 
+{
+  struct pollfd fds[2]; 
+  fds[0].fd = reload.sfd; 
+  fds[0].events = POLLIN; 
+  fds[1].fd = reload.ifd; 
+  fds[1].events = POLLIN; 
+  int nfds = reload.ifd >= 0 ? 2 : 1; 
+
+  while (1) 
+  {
+    if (poll(fds, nfds, -1) < 0) 
+    {
+      if (errno == EINTR) continue; 
+      fprintf(stderr,"Config reload thread: poll failed (%s)\n", strerror(errno)); 
+      break; 
+    }
 
+    int do_reload = 0; 
+    int do_quit = 0; 
+
+    if (fds[0].revents & POLLIN) 
+    {
+      struct signalfd_siginfo si; 
+      while (read(reload.sfd, &si, sizeof(si)) == sizeof(si))
+      {
+        if (si.ssi_signo == CONFIG_REREAD_SIGNAL) 
+        {
+          printf("Caught signal %d, will reread config\n", si.ssi_signo); 
+          do_reload = 1; 
+        }
+        else
+        {
+          fprintf(stderr,"Caught deadly signal %d\n", si.ssi_signo); 
+          do_quit = 1; 
+        }
+      }
+    }
+
+    if (nfds > 1 && (fds[1].revents & POLLIN) && reload_drain_inotify()) 
+    {
+      //editors like to write things in several steps, so let them finish 
+      usleep(200000); 
+      reload_drain_inotify(); 
+      printf("%s changed, will reread config\n", reload.watch_name); 
+      do_reload = 1; 
+    }
+
+    pthread_mutex_lock(&reload.lock); 
+    if (do_reload) reload.reload_pending = 1; 
+    if (do_quit) reload.quit = 1; 
+    pthread_cond_broadcast(&reload.cond); 
+    pthread_mutex_unlock(&reload.lock); 
+
+    if (do_quit && reload.on_quit) reload.on_quit(reload.arg); 
+  }
+
+  return 0; 
+}
+
+int nuphase_reload_start(nuphase_program_t program, void (*on_quit)(void *), void * arg) 
+{
+  sigset_t mask; 
+  sigemptyset(&mask); 
+  sigaddset(&mask, CONFIG_REREAD_SIGNAL); 
+  if (on_quit) 
+  {
+    sigaddset(&mask, SIGINT); 
+    sigaddset(&mask, SIGTERM); 
+    sigaddset(&mask, SIGUSR2); 
+  }
+
+  // blocked here, so inherited by every thread created after this 
+  if (pthread_sigmask(SIG_BLOCK, &mask, 0)) return 1; 
+
+  reload.sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC); 
+  if (reload.sfd < 0) 
+  {
+    fprintf(stderr,"Could not create signalfd (%s)\n", strerror(errno)); 
+    return 1; 
+  }
+
+  reload.on_quit = on_quit; 
+  reload.arg = arg; 
+
+  pthread_condattr_t attr; 
+  pthread_condattr_init(&attr); 
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); 
+  pthread_cond_init(&reload.cond, &attr); 
+  pthread_condattr_destroy(&attr); 
+
+  const char * watch = getenv(CONFIG_WATCH_ENV); 
+  char * cfg_file = 0; 
+  if (watch && *watch && strcmp(watch,"0") && !nuphase_get_cfg_file(&cfg_file, program)) 
+  {
+    // watch the directory, since editors often replace the file rather than writing it 
+    char * slash = strrchr(cfg_file,'/'); 
+    *slash = 0; 
+    reload.watch_name = strdup(slash+1); 
+    reload.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC); 
+    if (reload.ifd < 0 || inotify_add_watch(reload.ifd, cfg_file, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) 
+    {
+      fprintf(stderr,"Could not watch %s for config changes (%s)\n", cfg_file, strerror(errno)); 
+      if (reload.ifd >= 0) close(reload.ifd); 
+      reload.ifd = -1; 
+    }
+    free(cfg_file); 
+  }
+
+  if (pthread_create(&reload.thread, 0, reload_thread, 0)) 
+  {
+    fprintf(stderr,"Could not start config reload thread\n"); 
+    return 1; 
+  }
+  pthread_detach(reload.thread); 
+
+  return 0; 
+}
+
+int nuphase_reload_pending() 
+{
+  pthread_mutex_lock(&reload.lock); 
+  int ans = reload.reload_pending; 
+  reload.reload_pending = 0; 
+  pthread_mutex_unlock(&reload.lock); 
+  return ans; 
+}
+
+int nuphase_quit_requested() 
+{
+  pthread_mutex_lock(&reload.lock); 
+  int ans = reload.quit; 
+  pthread_mutex_unlock(&reload.lock); 
+  return ans; 
+}
+
+void nuphase_reload_sleep(double secs) 
+{
+  // if nuphase_reload_start wasn't called, nothing can wake us up early 
+  if (reload.sfd < 0) 
+  {
+    struct timespec ts = { .tv_sec = (time_t) secs, .tv_nsec = (secs - (time_t) secs) * 1e9 }; 
+    nanosleep(&ts, 0); 
+    return; 
+  }
+
+  struct timespec until; 
+  clock_gettime(CLOCK_MONOTONIC, &until); 
+  long long nsecs = until.tv_nsec + (long long) (secs * 1e9); 
+  until.tv_sec += nsecs / 1000000000; 
+  until.tv_nsec = nsecs % 1000000000; 
+
+  pthread_mutex_lock(&reload.lock); 
+  while (!reload.reload_pending && !reload.quit) 
+  {
+    if (pthread_cond_timedwait(&reload.cond, &reload.lock, &until) == ETIMEDOUT) break; 
+  }
+  pthread_mutex_unlock(&reload.lock); 
+}
+
+
+extern char ** environ; 
+
+/* reads whatever is available from fd into the result (up to capture bytes). Returns 0 at EOF */ 
+static int run_read_output(int fd, nuphase_cmd_result_t * r, size_t * len, size_t capture) 
+{
+  char buf[4096]; 
+  ssize_t n = read(fd, buf, sizeof(buf)); 
+  if (n == 0) return 0; 
+  if (n < 0) return errno == EAGAIN || errno == EINTR; 
+
+  size_t keep = *len + n > capture ? capture - *len : (size_t) n; 
+  if (keep) 
+  {
+    memcpy(r->output + *len, buf, keep); 
+    *len += keep; 
+    r->output[*len] = 0; 
+  }
+  return 1; 
+}
+
+int nuphase_run(const char * cmd, double timeout, size_t capture, nuphase_cmd_result_t * result) 
+{
+  nuphase_cmd_result_t dummy; 
+  nuphase_cmd_result_t * r = result ? result : &dummy; 
+  memset(r,0,sizeof(*r)); 
+  r->status = -1; 
+  if (!result) capture = 0; 
+
+  struct timespec start, now; 
+  clock_gettime(CLOCK_MONOTONIC, &start); 
+
+  int out[2] = {-1,-1}; 
+  if (capture) 
+  {
+    r->output = calloc(capture + 1, 1); 
+    if (!r->output || pipe2(out, O_CLOEXEC | O_NONBLOCK)) 
+    {
+      fprintf(stderr,"Could not capture output of %s\n", cmd); 
+      return -1; 
+    }
+  }
+
+  posix_spawn_file_actions_t actions; 
+  posix_spawn_file_actions_init(&actions); 
+  if (capture) 
+  {
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO); 
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDERR_FILENO); 
+  }
+
+  posix_spawnattr_t attr; 
+  posix_spawnattr_init(&attr); 
+  sigset_t empty, defaults; 
+  sigemptyset(&empty); 
+  sigemptyset(&defaults); 
+  sigaddset(&defaults, SIGINT); 
+  sigaddset(&defaults, SIGTERM); 
+  sigaddset(&defaults, SIGPIPE); 
+  sigaddset(&defaults, SIGUSR1); 
+  sigaddset(&defaults, SIGUSR2); 
+  struct sched_param sp = { .sched_priority = 0 }; 
+  posix_spawnattr_setsigmask(&attr, &empty); 
+  posix_spawnattr_setsigdefault(&attr, &defaults); 
+  posix_spawnattr_setpgroup(&attr, 0); 
+  posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER); 
+  posix_spawnattr_setschedparam(&attr, &sp); 
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSCHEDULER); 
+
+  pid_t pid; 
+  char * argv[] = { "sh", "-c", (char*) cmd, 0 }; 
+  int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ); 
+  posix_spawn_file_actions_destroy(&actions); 
+  posix_spawnattr_destroy(&attr); 
+  if (capture) close(out[1]); 
+
+  if (err) 
+  {
+    fprintf(stderr,"Could not run %s (%s)\n", cmd, strerror(err)); 
+    if (capture) close(out[0]); 
+    return -1; 
+  }
+
+  size_t len = 0; 
+  int open_out = capture; 
+  int wstatus = 0; 
+  int killed = 0; 
+  double kill_time = 0; 
+
+  while (1) 
+  {
+    pid_t ret = waitpid(pid, &wstatus, WNOHANG); 
+    if (ret == pid || (ret < 0 && errno != EINTR)) break; 
+
+    clock_gettime(CLOCK_MONOTONIC, &now); 
+    double elapsed = timespec_difference_float(&now, &start); 
+
+    if (timeout > 0 && elapsed > timeout) 
+    {
+      //the whole process group, in case it started other things 
+      if (!killed) 
+      {
+        fprintf(stderr,"%s took more than %g seconds, killing it\n", cmd, timeout); 
+        kill(-pid, SIGTERM); 
+        killed = 1; 
+        kill_time = elapsed; 
+        r->timed_out = 1; 
+      }
+      else if (killed == 1 && elapsed - kill_time > 2) 
+      {
+        kill(-pid, SIGKILL); 
+        killed = 2; 
+      }
+    }
+
+    if (open_out) 
+    {
+      struct pollfd pfd = { .fd = out[0], .events = POLLIN }; 
+      if (poll(&pfd, 1, 50) > 0) open_out = run_read_output(out[0], r, &len, capture); 
+    }
+    else
+    {
+      usleep(20000); 
+    }
+  }
+
+  //anything left 
+  while (open_out && run_read_output(out[0], r, &len, capture) && len < capture) 
+  {
+    struct pollfd pfd = { .fd = out[0], .events = POLLIN }; 
+    if (poll(&pfd, 1, 0) <= 0) break; 
+  }
+  if (capture) close(out[0]); 
+
+  clock_gettime(CLOCK_MONOTONIC, &now); 
+  r->seconds = timespec_difference_float(&now, &start); 
+
+  if (WIFEXITED(wstatus)) 
+  {
+    r->status = WEXITSTATUS(wstatus); 
+  }
+  else if (WIFSIGNALED(wstatus)) 
+  {
+    r->signal = WTERMSIG(wstatus); 
+    r->status = 128 + r->signal; 
+  }
+
+  return r->status; 
+}
+
+void nuphase_cmd_result_free(nuphase_cmd_result_t * result) 
+{
+  free(result->output); 
+  result->output = 0; 
+}
+
+void nuphase_run_report(const char * cmd, const nuphase_cmd_result_t * result, void * arg) 
+{
+  if (!result->status) return; 
+  fprintf(stderr,"%s %s (status %d) after %0.1f s%s%s\n", cmd, result->timed_out ? "timed out" : "failed", 
+          result->status, result->seconds, result->output && *result->output ? ":\n" : "", result->output ? result->output : ""); 
+}
+
+int nuphase_background_thread(void * (*fn)(void *), void * arg) 
+{
+  //not whatever the (maybe realtime) caller has 
+  pthread_attr_t attr; 
+  pthread_attr_init(&attr); 
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED); 
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED); 
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER); 
+  struct sched_param sp = { .sched_priority = 0 }; 
+  pthread_attr_setschedparam(&attr, &sp); 
+
+  pthread_t thread; 
+  int ret = pthread_create(&thread, &attr, fn, arg); 
+  pthread_attr_destroy(&attr); 
+  return ret; 
+}
+
+typedef struct run_async_args 
+{
+  char * cmd; 
+  double timeout; 
+  size_t capture; 
+  void (*done)(const char *, const nuphase_cmd_result_t *, void *); 
+  void * arg; 
+} run_async_args_t; 
+
+static void * run_async_thread(void * v) 
+{
+  run_async_args_t * a = v; 
+  nuphase_cmd_result_t result; 
+  nuphase_run(a->cmd, a->timeout, a->capture, &result); 
+  if (a->done) a->done(a->cmd, &result, a->arg); 
+  nuphase_cmd_result_free(&result); 
+  free(a->cmd); 
+  free(a); 
+  return 0; 
+}
+
+int nuphase_run_async(const char * cmd, double timeout, size_t capture, 
+                      void (*done)(const char * cmd, const nuphase_cmd_result_t * result, void * arg), void * arg) 
+{
+  run_async_args_t * a = malloc(sizeof(*a)); 
+  if (!a) return 1; 
+  a->cmd = strdup(cmd); 
+  a->timeout = timeout; 
+  a->capture = capture; 
+  a->done = done; 
+  a->arg = arg; 
+
+  if (nuphase_background_thread(run_async_thread, a)) 
+  {
+    fprintf(stderr,"Could not start a thread to run %s\n", cmd); 
+    free(a->cmd); 
+    free(a); 
+    return 1; 
+  }
+  return 0; 
+}
@@ -11,7 +11,9 @@
  * This program is used to copy things to a host and delete old files. 
  *
  *   - It uses rsync to copy to host (which requires that you have the keys set up properly on the remote host(ssh-copy-id is your friend)) 
+ *     Hardlinks (from nuphase-acq's dedup_dir) are kept, so deduplicated files are only sent once. 
  *   - If rsync is successful AND there is less disk space than the threshold, files older than X days are deleted (using find). 
+ *     Then anything in the dedup_dir that no run directory links to anymore is deleted too. 
  *
  */ 
 
@@ -21,14 +23,23 @@ static volatile int stop = 0;
 
 static char * copy_command = 0; 
 static char * delete_command = 0; 
+static char * prune_command = 0; 
 
 static void construct_commands() 
 {
   if (copy_command) free(copy_command); 
-  asprintf(&copy_command, "rsync  --exclude '*%s' -q -a %s/ %s@%s:%s", tmp_suffix, cfg.local_path, cfg.remote_user, cfg.remote_hostname, cfg.remote_path); 
+  asprintf(&copy_command, "rsync  --exclude '*%s' -q -a -H %s/ %s@%s:%s", tmp_suffix, cfg.local_path, cfg.remote_user, cfg.remote_hostname, cfg.remote_path); 
 
   if (delete_command) free(delete_command) ; 
   asprintf(&delete_command,"find %s -mtime +%d %s", cfg.local_path, cfg.delete_files_older_than, cfg.dummy_mode ? "-print" : "-delete"); 
+
+  //dedup entries with only the one link are only in the dedup dir 
+  if (prune_command) free(prune_command); 
+  prune_command = 0; 
+  if (cfg.dedup_dir && *cfg.dedup_dir) 
+  {
+    asprintf(&prune_command,"find %s -type f -links 1 %s", cfg.dedup_dir, cfg.dummy_mode ? "-print" : "-delete"); 
+  }
 }
 
 static int read_config()
@@ -46,20 +57,9 @@ static int read_config()
 }
 
 
-static void signal_handler(int signal, siginfo_t * sig, void * v) 
+static void on_quit(void * v) 
 {
-  switch (signal)
-  {
-    case SIGUSR1: 
-      read_config(); 
-      break; 
-    case SIGTERM: 
-    case SIGUSR2: 
-    case SIGINT: 
-    default: 
-      fprintf(stderr,"Caught deadly signal %d\n", signal); 
-      stop =1; 
-  }
+  stop = 1; 
 }
 
 
@@ -67,17 +67,8 @@ static void signal_handler(int signal, siginfo_t * sig, void * v)
 int main(int nargs, char ** arsg) 
 {
   
-  //set up signal handlers 
-  sigset_t empty;
-  sigemptyset(&empty); 
-  struct sigaction sa; 
-  sa.sa_mask = empty; 
-  sa.sa_flags = 0; 
-  sa.sa_sigaction = signal_handler; 
-  sigaction(SIGINT,  &sa,0); 
-  sigaction(SIGTERM, &sa,0); 
-  sigaction(SIGUSR1, &sa,0); 
-  sigaction(SIGUSR2, &sa,0); 
+  //set up signal handling (config rereads happen in the main loop) 
+  nuphase_reload_start(NUPHASE_COPY, on_quit, 0); 
 
   //set up config
   nuphase_copy_config_init(&cfg); 
@@ -86,7 +77,10 @@ int main(int nargs, char ** arsg)
   // main loop 
   while(!stop)
   {
-    int copy_ret = system(copy_command);
+    if (nuphase_reload_pending()) read_config(); 
+
+    nuphase_cmd_result_t result; 
+    int copy_ret = nuphase_run(copy_command, cfg.command_timeout, 4096, &result);
     if (!copy_ret)
     {
       //only try to delete if copy succeeded 
@@ -97,15 +91,18 @@ int main(int nargs, char ** arsg)
       printf("free MB: %d\n", free_mb); 
       if (free_mb < cfg.free_space_delete_threshold) 
       {
-        system(delete_command); 
+        nuphase_run(delete_command, cfg.command_timeout, 0, 0); 
+        if (prune_command) nuphase_run(prune_command, cfg.command_timeout, 0, 0); 
       }
     }
     else
     {
       fprintf(stderr,"rsync returned error code %d\n", copy_ret ); 
+      nuphase_run_report(copy_command, &result, 0); 
     }
+    nuphase_cmd_result_free(&result); 
 
-    sleep(cfg.wakeup_interval); 
+    nuphase_reload_sleep(cfg.wakeup_interval); 
   }
 
 
@@ -0,0 +1,114 @@
+#include "nuphase-cfg.h"
+#include "nuphase-common.h"
+#include "nuphase-metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Prints nuphase-acq's live metrics, or writes them as a prometheus textfile
+ *
+ * nuphase-current-acq              print once
+ * nuphase-current-acq -p file      write file (atomically) once
+ * nuphase-current-acq -p file -i 15  keep rewriting file every 15 seconds
+ */
+
+#define STALE_SECONDS 10
+
+static void usage()
+{
+  fprintf(stderr,"Usage: nuphase-current-acq [-p prometheus_textfile [-i interval]]\n");
+}
+
+static int write_prometheus(const char * path, const nuphase_acq_metrics_t * m)
+{
+  char tmp[strlen(path) + sizeof(tmp_suffix)];
+  sprintf(tmp,"%s%s", path, tmp_suffix);
+
+  FILE * f = fopen(tmp,"w");
+  if (!f)
+  {
+    fprintf(stderr,"Could not open %s\n", tmp);
+    return 1;
+  }
+
+  nuphase_metrics_prometheus(f, m);
+  if (fclose(f) || rename(tmp, path))
+  {
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * prometheus_file = 0;
+  int interval = 0;
+
+  int opt;
+  while ((opt = getopt(nargs, args, "p:i:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p': prometheus_file = optarg; break;
+      case 'i': interval = atoi(optarg); break;
+      default: usage(); return 1;
+    }
+  }
+
+  if (interval > 0 && !prometheus_file)
+  {
+    usage();
+    return 1;
+  }
+
+  nuphase_acq_cfg_t cfg;
+  nuphase_acq_config_init(&cfg);
+
+  char * config_name = 0;
+  nuphase_get_cfg_file(&config_name, NUPHASE_ACQ);
+  nuphase_acq_config_read(config_name, &cfg);
+
+  if (!cfg.metrics_shm || !*cfg.metrics_shm)
+  {
+    fprintf(stderr,"Metrics are disabled in %s\n", config_name);
+    return 1;
+  }
+
+  const nuphase_acq_metrics_t * shared = nuphase_metrics_map(cfg.metrics_shm);
+  if (!shared) return 1;
+
+  nuphase_acq_metrics_t m;
+  while (1)
+  {
+    if (nuphase_metrics_read(shared, &m))
+    {
+      fprintf(stderr,"Could not read a consistent copy of %s\n", cfg.metrics_shm);
+      if (!interval) return 1;
+    }
+    else
+    {
+      if (time(0) - (time_t) m.update_time > STALE_SECONDS)
+      {
+        fprintf(stderr,"Warning: metrics are %d seconds old. Is nuphase-acq (pid %d) running?\n",
+                (int) (time(0) - m.update_time), m.pid);
+      }
+
+      if (prometheus_file)
+      {
+        if (write_prometheus(prometheus_file, &m) && !interval) return 1;
+      }
+      else
+      {
+        nuphase_metrics_print(stdout, &m);
+      }
+    }
+
+    if (interval <= 0) break;
+    sleep(interval);
+  }
+
+  return 0;
+}
@@ -1,6 +1,11 @@
 #include "nuphase-cfg.h" 
 #include "nuphase-common.h" 
+#include "nuphase-hkshm.h" 
 #include <stdio.h> 
+#include <stdlib.h> 
+
+/* Prints the latest housekeeping from nuphase-hk's shared memory, 
+ * or the last n samples with nuphase-current-hk n */ 
 
 int main(int nargs, char ** args) 
 {
@@ -12,19 +17,47 @@ int main(int nargs, char ** args)
   nuphase_get_cfg_file(&config_name, NUPHASE_HK); 
   nuphase_hk_config_read(config_name, &cfg); 
 
-
-  char shbuf[512]; 
-  sprintf(shbuf,"/dev/shm/%s", cfg.shm_name); 
-
-  FILE * f = fopen(shbuf,"r"); 
-
-  nuphase_hk_t hk; 
-  fread(&hk, sizeof(hk),1, f); 
-
-  fclose(f); 
-  nuphase_hk_print(stdout, &hk); 
-
-
-  return 0; 
-
+  int n = nargs > 1 ? atoi(args[1]) : 1; 
+  if (n < 1) n = 1; 
+
+  nuphase_hk_shm_reader_t shm; 
+
+  if (nuphase_hk_shm_map(cfg.shm_name, &shm)) 
+  {
+    //maybe an older nuphase-hk, which only writes the single record 
+    char shbuf[512]; 
+    sprintf(shbuf,"/dev/shm/%s", cfg.shm_name); 
+
+    FILE * f = fopen(shbuf,"r"); 
+    if (!f) 
+    {
+      fprintf(stderr,"Could not open %s. Is nuphase-hk running?\n", shbuf); 
+      return 1; 
+    }
+
+    nuphase_hk_t hk; 
+    int ok = fread(&hk, sizeof(hk),1, f); 
+    fclose(f); 
+    if (!ok) return 1; 
+    nuphase_hk_print(stdout, &hk); 
+    return 0; 
+  }
+
+  nuphase_hk_t * hks = malloc(n * sizeof(nuphase_hk_t)); 
+  uint64_t * samples = malloc(n * sizeof(uint64_t)); 
+  int got = nuphase_hk_shm_last(&shm, n, hks, samples); 
+
+  int i; 
+  for (i = 0; i < got; i++) 
+  {
+    if (n > 1) printf("== sample %llu ==\n", (unsigned long long) samples[i]); 
+    nuphase_hk_print(stdout, &hks[i]); 
+  }
+
+  if (!got) fprintf(stderr,"No housekeeping in %s yet\n", cfg.shm_name); 
+
+  free(hks); 
+  free(samples); 
+  nuphase_hk_shm_unmap(&shm); 
+  return !got; 
 }
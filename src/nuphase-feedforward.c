@@ -0,0 +1,78 @@
+#include "nuphase-feedforward.h"
+#include <string.h>
+#include <math.h>
+
+
+void nuphase_ff_init(nuphase_ff_t * ff)
+{
+  memset(ff,0,sizeof(*ff));
+}
+
+void nuphase_ff_update_temperature(nuphase_ff_t * ff, const nuphase_ff_cfg_t * cfg, double temp, double dt)
+{
+  if (!ff->have_temp)
+  {
+    ff->temp = temp;
+    ff->dtemp = 0;
+    ff->have_temp = 1;
+    return;
+  }
+
+  double alpha = cfg->temp_tau > 0 && dt > 0 ? 1 - exp(-dt / cfg->temp_tau) : 1;
+  double old = ff->temp;
+  ff->temp += alpha * (temp - ff->temp);
+  ff->dtemp = ff->temp - old;
+}
+
+double nuphase_ff_update_beam(nuphase_ff_t * ff, const nuphase_ff_cfg_t * cfg, int ibeam, double threshold, double measured, double goal, double dt)
+{
+  if (!ff->have_temp) return 0;
+
+  //forget old stuff
+  double decay = cfg->fit_tau > 0 && dt > 0 ? exp(-dt / cfg->fit_tau) : 1;
+  ff->w[ibeam] *= decay;
+  ff->sx[ibeam] *= decay;
+  ff->sy[ibeam] *= decay;
+  ff->sxx[ibeam] *= decay;
+  ff->sxy[ibeam] *= decay;
+
+  //only use updates where the threshold was about right
+  if (goal > 0 && fabs(measured - goal) < cfg->settled_fraction * goal)
+  {
+    double x = ff->temp;
+    ff->w[ibeam] += 1;
+    ff->sx[ibeam] += x;
+    ff->sy[ibeam] += threshold;
+    ff->sxx[ibeam] += x*x;
+    ff->sxy[ibeam] += x*threshold;
+  }
+
+  ff->valid[ibeam] = 0;
+  if (ff->w[ibeam] < 2) return 0;
+
+  double mean_x = ff->sx[ibeam] / ff->w[ibeam];
+  double var_x = ff->sxx[ibeam] / ff->w[ibeam] - mean_x * mean_x;
+  if (var_x <= 0 || sqrt(var_x) < cfg->min_spread) return 0;
+
+  double mean_y = ff->sy[ibeam] / ff->w[ibeam];
+  double cov = ff->sxy[ibeam] / ff->w[ibeam] - mean_x * mean_y;
+  ff->slope[ibeam] = cov / var_x;
+
+  if (cfg->max_slope > 0 && fabs(ff->slope[ibeam]) > cfg->max_slope) return 0;
+
+  ff->valid[ibeam] = 1;
+  double step = ff->slope[ibeam] * ff->dtemp;
+  ff->total[ibeam] += step;
+  return step;
+}
+
+void nuphase_ff_print(FILE * f, const nuphase_ff_t * ff)
+{
+  fprintf(f,"===TEMPERATURE FEED-FORWARD (temperature: %0.2f)\n", ff->temp);
+  int ibeam;
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    fprintf(f,"   Beam %d :: slope: %g /deg%s :: weight: %0.1f :: total applied: %g\n", ibeam,
+            ff->slope[ibeam], ff->valid[ibeam] ? "" : " (not used)", ff->w[ibeam], ff->total[ibeam]);
+  }
+}
@@ -2,15 +2,13 @@
 #include <string.h>
 #include "nuphase-cfg.h" 
 #include "nuphase-common.h" 
-#include <fcntl.h> 
-#include <sys/mman.h> 
-#include <sys/stat.h>
+#include "nuphase-hkshm.h" 
 #include <signal.h>
 
 /** Housekeeping Program. 
  * 
  *  - Polls housekeeping info and saves to file
- *  - also makes hk available to shared memory location 
+ *  - also makes hk available to shared memory location (the last shm_nsamples of it, see nuphase-hkshm.h) 
  *  - with SIGUSR1, rereads config, also causing it to apply the power statuses. 
  *
  */ 
@@ -21,64 +19,32 @@ static char * config_file;
 
 
 static volatile int stop = 0; 
-static nuphase_hk_t * the_hk = 0;  
+static nuphase_hk_t the_hk; 
 
-static int shared_fd = 0; 
+static nuphase_hk_shm_t * shared = 0; 
 
 
-static int open_shared_fd() 
-{
-  shared_fd = shm_open(cfg.shm_name, O_CREAT | O_RDWR, 0666); 
-  if (shared_fd < 0) 
-  {
-    fprintf(stderr,"Could not open shared memory region %s\n", cfg.shm_name); 
-    return 1; 
-  }
-
-  if (ftruncate(shared_fd, sizeof(nuphase_hk_t))) 
-  {
-
-    fprintf(stderr,"Could not resize shared memory region %s\n", cfg.shm_name); 
-    close(shared_fd); 
-    shared_fd = -1; 
-    return 1; 
-  }
-
-   the_hk = mmap(0, sizeof(nuphase_hk_t), PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0); 
-
-   return shared_fd == 0; 
-}
-
 static int read_config() 
 {
 
   char * current_shm = strdupa(cfg.shm_name); 
+  int current_nsamples = cfg.shm_nsamples; 
 
   int ret =  nuphase_hk_config_read(config_file, &cfg); 
 
-  if (!shared_fd || strcmp(current_shm, cfg.shm_name))
+  if (!shared || strcmp(current_shm, cfg.shm_name) || current_nsamples != cfg.shm_nsamples)
   {
-    if (shared_fd) close(shared_fd); 
-    return ret + open_shared_fd(); 
+    nuphase_hk_shm_release(shared); 
+    shared = nuphase_hk_shm_create(cfg.shm_name, cfg.shm_nsamples); 
+    return ret + !shared; 
   }
 
   return ret; 
 }
 
-static void signal_handler(int signal, siginfo_t * sig, void * v) 
+static void on_quit(void * v) 
 {
-  switch (signal)
-  {
-    case SIGUSR1: 
-      read_config(); 
-      break; 
-    case SIGTERM: 
-    case SIGUSR2: 
-    case SIGINT: 
-    default: 
-      fprintf(stderr,"Caught deadly signal %d\n", signal); 
-      stop =1; 
-  }
+  stop = 1; 
 }
 
 static const char * mk_name(time_t t)
@@ -116,19 +82,8 @@ static const char * mk_name(time_t t)
 int main(int nargs, char ** args) 
 {
 
-  //set up signal handlers 
-  
-  sigset_t empty;
-  sigemptyset(&empty); 
-  struct sigaction sa; 
-  sa.sa_mask = empty; 
-  sa.sa_flags = 0; 
-  sa.sa_sigaction = signal_handler; 
-
-  sigaction(SIGINT,  &sa,0); 
-  sigaction(SIGTERM, &sa,0); 
-  sigaction(SIGUSR1, &sa,0); 
-  sigaction(SIGUSR2, &sa,0); 
+  //set up signal handling (config rereads happen in the main loop) 
+  nuphase_reload_start(NUPHASE_HK, on_quit, 0); 
 
 
   /** Initialize the configuration */ 
@@ -162,7 +117,10 @@ int main(int nargs, char ** args)
 
   while (!stop) 
   {
-    nuphase_hk(the_hk, cfg.asps_method) ; 
+    if (nuphase_reload_pending()) read_config(); 
+
+    nuphase_hk(&the_hk, cfg.asps_method) ; 
+    if (shared) nuphase_hk_shm_put(shared, &the_hk); 
 
     time_t now = time(0); 
 
@@ -175,14 +133,14 @@ int main(int nargs, char ** args)
       last = now; 
     }
 
-    nuphase_hk_gzwrite(outf, the_hk);
+    nuphase_hk_gzwrite(outf, &the_hk);
     if (cfg.print_to_screen)
-      nuphase_hk_print(stdout, the_hk); 
-    sleep(cfg.interval); 
+      nuphase_hk_print(stdout, &the_hk); 
+    nuphase_reload_sleep(cfg.interval); 
   }
 
 
-  close(shared_fd); 
+  nuphase_hk_shm_release(shared); 
   do_close(outf, outf_name); 
 
   return 0 ; 
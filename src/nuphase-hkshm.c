@@ -0,0 +1,210 @@
+#include "nuphase-hkshm.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* how many times a reader tries a record before giving up (the writer only holds it for a memcpy) */
+#define HK_SHM_READ_TRIES 1000
+
+size_t nuphase_hk_shm_size(int nrecords)
+{
+  return sizeof(nuphase_hk_shm_t) + nrecords * sizeof(nuphase_hk_shm_record_t);
+}
+
+static int header_ok(const nuphase_hk_shm_t * shm, size_t size)
+{
+  return shm->magic == NUPHASE_HK_SHM_MAGIC && shm->version == NUPHASE_HK_SHM_VERSION &&
+         shm->record_size == sizeof(nuphase_hk_shm_record_t) && shm->nrecords > 0 &&
+         nuphase_hk_shm_size(shm->nrecords) <= size;
+}
+
+nuphase_hk_shm_t * nuphase_hk_shm_create(const char * shm_name, int nrecords)
+{
+  if (nrecords < 1) nrecords = 1;
+  size_t size = nuphase_hk_shm_size(nrecords);
+
+  int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
+  if (fd < 0)
+  {
+    fprintf(stderr,"Could not open shared memory region %s (%s)\n", shm_name, strerror(errno));
+    return 0;
+  }
+
+  //only ever grow it, so readers that mapped a bigger ring don't fault
+  struct stat st;
+  if (fstat(fd, &st) || (st.st_size < (off_t) size && ftruncate(fd, size)))
+  {
+    fprintf(stderr,"Could not resize shared memory region %s (%s)\n", shm_name, strerror(errno));
+    close(fd);
+    return 0;
+  }
+  size_t old_size = st.st_size;
+
+  void * mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    fprintf(stderr,"Could not map shared memory region %s (%s)\n", shm_name, strerror(errno));
+    return 0;
+  }
+
+  nuphase_hk_shm_t * shm = mem;
+
+  //keep the samples (and their numbering) from a previous nuphase-hk if it's the same layout
+  if (old_size >= size && header_ok(shm, old_size) && shm->nrecords == (uint32_t) nrecords) return shm;
+
+  //readers see this as a change and map it again
+  __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  memset(&shm->records[0], 0, nrecords * sizeof(nuphase_hk_shm_record_t));
+  shm->nsamples = 0;
+  shm->nrecords = nrecords;
+  shm->record_size = sizeof(nuphase_hk_shm_record_t);
+  shm->version = NUPHASE_HK_SHM_VERSION;
+  __atomic_store_n(&shm->magic, NUPHASE_HK_SHM_MAGIC, __ATOMIC_RELEASE);
+  return shm;
+}
+
+uint64_t nuphase_hk_shm_put(nuphase_hk_shm_t * shm, const nuphase_hk_t * hk)
+{
+  uint64_t sample = shm->nsamples + 1;
+  nuphase_hk_shm_record_t * r = &shm->records[(sample - 1) % shm->nrecords];
+
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->sample = sample;
+  memcpy(&r->hk, hk, sizeof(*hk));
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&shm->nsamples, sample, __ATOMIC_RELEASE);
+
+  //and the compatibility copy
+  memcpy(&shm->latest, hk, sizeof(*hk));
+  return sample;
+}
+
+void nuphase_hk_shm_release(nuphase_hk_shm_t * shm)
+{
+  if (shm) munmap(shm, nuphase_hk_shm_size(shm->nrecords));
+}
+
+int nuphase_hk_shm_map(const char * shm_name, nuphase_hk_shm_reader_t * r)
+{
+  memset(r, 0, sizeof(*r));
+
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0) return 1;
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(nuphase_hk_shm_t))
+  {
+    close(fd);
+    return 1;
+  }
+
+  void * mem = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return 1;
+
+  const nuphase_hk_shm_t * shm = mem;
+  uint32_t nrecords = __atomic_load_n(&shm->nrecords, __ATOMIC_ACQUIRE);
+  if (!header_ok(shm, st.st_size) || nuphase_hk_shm_size(nrecords) > (size_t) st.st_size)
+  {
+    munmap(mem, st.st_size);
+    return 1;
+  }
+
+  r->shm = shm;
+  r->size = st.st_size;
+  r->nrecords = nrecords;
+  return 0;
+}
+
+void nuphase_hk_shm_unmap(nuphase_hk_shm_reader_t * r)
+{
+  if (r->shm) munmap((void*) r->shm, r->size);
+  memset(r, 0, sizeof(*r));
+}
+
+int nuphase_hk_shm_changed(const nuphase_hk_shm_reader_t * r)
+{
+  return !r->shm ||
+         __atomic_load_n(&r->shm->magic, __ATOMIC_ACQUIRE) != NUPHASE_HK_SHM_MAGIC ||
+         __atomic_load_n(&r->shm->nrecords, __ATOMIC_ACQUIRE) != r->nrecords;
+}
+
+/* copies out the given sample, if it's still in the ring. 0 on success.
+ * Only ever touches the records that were there when it was mapped. */
+static int read_sample(const nuphase_hk_shm_reader_t * r, uint64_t sample, nuphase_hk_t * hk)
+{
+  uint64_t index = (sample - 1) % r->nrecords;
+  if (nuphase_hk_shm_size(index + 1) > r->size) return 1;
+  const nuphase_hk_shm_record_t * rec = &r->shm->records[index];
+
+  int i;
+  for (i = 0; i < HK_SHM_READ_TRIES; i++)
+  {
+    if (nuphase_hk_shm_changed(r)) return 1;
+
+    uint32_t before = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      sched_yield();
+      continue;
+    }
+
+    uint64_t got = rec->sample;
+    memcpy(hk, &rec->hk, sizeof(*hk));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != before) continue;
+
+    //overwritten by a newer one, or the ring was remade while we copied
+    return got != sample || nuphase_hk_shm_changed(r);
+  }
+
+  return 1;
+}
+
+int nuphase_hk_shm_latest(const nuphase_hk_shm_reader_t * r, nuphase_hk_t * hk, uint64_t * sample)
+{
+  int i;
+  for (i = 0; i < HK_SHM_READ_TRIES; i++)
+  {
+    if (nuphase_hk_shm_changed(r)) return 1;
+    uint64_t n = __atomic_load_n(&r->shm->nsamples, __ATOMIC_ACQUIRE);
+    if (!n) return 1;
+    if (!read_sample(r, n, hk))
+    {
+      if (sample) *sample = n;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int nuphase_hk_shm_last(const nuphase_hk_shm_reader_t * r, int k, nuphase_hk_t * hks, uint64_t * samples)
+{
+  if (nuphase_hk_shm_changed(r)) return 0;
+
+  uint64_t n = __atomic_load_n(&r->shm->nsamples, __ATOMIC_ACQUIRE);
+  if (k > (int) r->nrecords) k = r->nrecords;
+  if ((uint64_t) k > n) k = n;
+
+  int ncopied = 0;
+  uint64_t s;
+  for (s = n - k + 1; s <= n; s++)
+  {
+    if (read_sample(r, s, &hks[ncopied])) continue;
+    if (samples) samples[ncopied] = s;
+    ncopied++;
+  }
+
+  return ncopied;
+}
@@ -0,0 +1,189 @@
+#include "nuphase-metrics.h"
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+const char * nuphase_metrics_latency_names[NUPHASE_METRICS_NLATENCY] = {"readout_to_commit","commit_to_pop","pop_to_written","close","readout_to_renamed"};
+const char * nuphase_metrics_dead_names[NUPHASE_METRICS_NDEAD] = { "buffer_full", "rollover", "phased_off" };
+const char * nuphase_metrics_backpressure_names[NUPHASE_METRICS_NBACKPRESSURE] = {"normal","compress","prescale","headers_only"};
+
+/* how many times a reader tries before giving up (the writer only holds it for a memcpy or so) */
+#define METRICS_READ_TRIES 1000
+
+void nuphase_metrics_init(nuphase_acq_metrics_t * m)
+{
+  memset(m,0,sizeof(*m));
+  m->magic = NUPHASE_METRICS_MAGIC;
+  m->version = NUPHASE_METRICS_VERSION;
+  m->size = sizeof(*m);
+}
+
+void nuphase_metrics_write_begin(nuphase_acq_metrics_t * m)
+{
+  __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void nuphase_metrics_write_end(nuphase_acq_metrics_t * m)
+{
+  __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+}
+
+int nuphase_metrics_read(const nuphase_acq_metrics_t * shared, nuphase_acq_metrics_t * out)
+{
+  if (shared->magic != NUPHASE_METRICS_MAGIC || shared->version != NUPHASE_METRICS_VERSION || shared->size != sizeof(*out))
+  {
+    return 1;
+  }
+
+  int i;
+  for (i = 0; i < METRICS_READ_TRIES; i++)
+  {
+    uint32_t before = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      sched_yield();
+      continue;
+    }
+
+    memcpy(out, shared, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == before) return 0;
+  }
+
+  return 1;
+}
+
+const nuphase_acq_metrics_t * nuphase_metrics_map(const char * shm_name)
+{
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    fprintf(stderr,"Could not open %s (%s). Is nuphase-acq running?\n", shm_name, strerror(errno));
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(nuphase_acq_metrics_t))
+  {
+    fprintf(stderr,"%s is too small, probably from a different version\n", shm_name);
+    close(fd);
+    return 0;
+  }
+
+  void * mem = mmap(0, sizeof(nuphase_acq_metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return mem == MAP_FAILED ? 0 : mem;
+}
+
+void nuphase_metrics_print(FILE * f, const nuphase_acq_metrics_t * m)
+{
+  int i;
+  fprintf(f,"nuphase-acq (pid %d), run %d, updated %u s ago, up %u s\n", m->pid, m->run,
+          (unsigned) (time(0) - m->update_time), (unsigned) (m->update_time - m->start_time));
+  fprintf(f,"  acq:     %"PRIu64" readouts, %"PRIu64" events\n", m->acq_readouts, m->acq_events);
+  fprintf(f,"  write:   %"PRIu64" events (%0.2f Hz), %"PRIu64" files, %"PRIu64" -> %"PRIu64" bytes (compression %0.2f)\n",
+          m->write_events, m->write_rate, m->write_files, m->write_bytes_in, m->write_bytes_out, m->compression_ratio);
+  fprintf(f,"  buffer:  %u / %u\n", m->buffer_occupancy, m->buffer_capacity);
+  fprintf(f,"  disk:    %d MB free, mode %s (prescaled: %"PRIu64", headers only: %"PRIu64")\n", m->free_mb,
+          m->backpressure_mode >= 0 && m->backpressure_mode < NUPHASE_METRICS_NBACKPRESSURE ? nuphase_metrics_backpressure_names[m->backpressure_mode] : "?",
+          m->nprescaled, m->nheaders_only);
+  fprintf(f,"  monitor: %"PRIu64" updates, %"PRIu64" threshold writes (%"PRIu64" suppressed), %"PRIu64" scaler samples (%"PRIu64" dropped)\n",
+          m->monitor_updates, m->threshold_writes, m->threshold_suppressed, m->scaler_samples, m->scaler_overruns);
+  fprintf(f,"  device:  %"PRIu64" readouts (%"PRIu64" waited, max %0.3f ms), %"PRIu64" commands\n",
+          m->dev_readouts, m->dev_readout_waits, m->dev_max_readout_wait_ns * 1e-6, m->dev_cmds);
+  fprintf(f,"  livetime: %0.5f over %0.1f s, dead (s):", m->livetime_fraction, m->elapsed_ns * 1e-9);
+  for (i = 0; i < NUPHASE_METRICS_NDEAD; i++) fprintf(f," %s=%0.3f", nuphase_metrics_dead_names[i], m->dead_ns[i] * 1e-9);
+  fprintf(f,"\n");
+
+  fprintf(f,"  beam    rate (Hz)       goal   threshold (target)\n");
+  for (i = 0; i < NP_NUM_BEAMS; i++)
+  {
+    fprintf(f,"  %2d  %7.3f +- %5.3f  %7.3f  %10u (%0.1f)\n", i, m->rate[i], m->rate_sigma[i], m->goal[i], m->threshold[i], m->target[i]);
+  }
+
+  fprintf(f,"  latencies:\n");
+  for (i = 0; i < NUPHASE_METRICS_NLATENCY; i++)
+  {
+    nuphase_latency_hist_print(f, nuphase_metrics_latency_names[i], &m->latency[i]);
+  }
+}
+
+void nuphase_metrics_prometheus(FILE * f, const nuphase_acq_metrics_t * m)
+{
+  int i, j;
+
+#define COUNTER(name, help, val) fprintf(f,"# HELP nuphase_acq_" name " " help "\n# TYPE nuphase_acq_" name " counter\nnuphase_acq_" name " %"PRIu64"\n", (uint64_t) (val))
+#define GAUGE(name, help, val) fprintf(f,"# HELP nuphase_acq_" name " " help "\n# TYPE nuphase_acq_" name " gauge\nnuphase_acq_" name " %.9g\n", (double) (val))
+
+  GAUGE("last_update_timestamp_seconds", "Unix time of the last metrics update", m->update_time);
+  GAUGE("start_timestamp_seconds", "Unix time nuphase-acq started", m->start_time);
+  GAUGE("run", "Current run number", m->run);
+  COUNTER("readouts_total", "Buffers read out by the acq thread", m->acq_readouts);
+  COUNTER("events_read_total", "Events read out by the acq thread", m->acq_events);
+  COUNTER("events_written_total", "Events popped by the write thread", m->write_events);
+  COUNTER("files_closed_total", "Output files closed", m->write_files);
+  COUNTER("bytes_uncompressed_total", "Uncompressed bytes in closed files", m->write_bytes_in);
+  COUNTER("bytes_written_total", "Compressed bytes in closed files", m->write_bytes_out);
+  GAUGE("write_rate_hz", "Events written per second", m->write_rate);
+  GAUGE("compression_ratio", "Uncompressed over compressed bytes", m->compression_ratio);
+  GAUGE("buffer_occupancy", "Buffers waiting to be written", m->buffer_occupancy);
+  GAUGE("buffer_capacity", "Buffer capacity", m->buffer_capacity);
+  GAUGE("free_space_megabytes", "Free space in the output directory", m->free_mb);
+  GAUGE("backpressure_mode", "0 normal, 1 compress, 2 prescale, 3 headers only", m->backpressure_mode);
+  COUNTER("forced_prescaled_total", "Forced triggers dropped by backpressure", m->nprescaled);
+  COUNTER("headers_only_total", "Events written without waveforms because of backpressure", m->nheaders_only);
+  COUNTER("monitor_updates_total", "Monitor thread updates", m->monitor_updates);
+  COUNTER("threshold_writes_total", "Threshold writes", m->threshold_writes);
+  COUNTER("threshold_suppressed_total", "Threshold writes suppressed by the deadband", m->threshold_suppressed);
+  COUNTER("scaler_samples_total", "Scaler samples", m->scaler_samples);
+  COUNTER("scaler_overruns_total", "Scaler samples dropped", m->scaler_overruns);
+  COUNTER("device_readouts_total", "Device readouts", m->dev_readouts);
+  COUNTER("device_readout_waits_total", "Readouts that waited for a device command", m->dev_readout_waits);
+  GAUGE("device_max_readout_wait_seconds", "Longest readout wait", m->dev_max_readout_wait_ns * 1e-9);
+  COUNTER("device_commands_total", "Device commands", m->dev_cmds);
+  GAUGE("run_elapsed_seconds", "Time since the start of the run", m->elapsed_ns * 1e-9);
+  GAUGE("livetime_fraction", "Livetime fraction of the run", m->livetime_fraction);
+
+#undef COUNTER
+#undef GAUGE
+
+  fprintf(f,"# HELP nuphase_acq_deadtime_seconds Deadtime in the run by source\n# TYPE nuphase_acq_deadtime_seconds gauge\n");
+  for (i = 0; i < NUPHASE_METRICS_NDEAD; i++)
+  {
+    fprintf(f,"nuphase_acq_deadtime_seconds{source=\"%s\"} %.9g\n", nuphase_metrics_dead_names[i], m->dead_ns[i] * 1e-9);
+  }
+
+  fprintf(f,"# HELP nuphase_acq_beam_rate_hz Estimated trigger rate per beam\n# TYPE nuphase_acq_beam_rate_hz gauge\n");
+  for (i = 0; i < NP_NUM_BEAMS; i++) fprintf(f,"nuphase_acq_beam_rate_hz{beam=\"%d\"} %.9g\n", i, m->rate[i]);
+  fprintf(f,"# HELP nuphase_acq_beam_rate_sigma_hz Uncertainty of the estimated rate per beam\n# TYPE nuphase_acq_beam_rate_sigma_hz gauge\n");
+  for (i = 0; i < NP_NUM_BEAMS; i++) fprintf(f,"nuphase_acq_beam_rate_sigma_hz{beam=\"%d\"} %.9g\n", i, m->rate_sigma[i]);
+  fprintf(f,"# HELP nuphase_acq_beam_goal_hz Rate goal per beam\n# TYPE nuphase_acq_beam_goal_hz gauge\n");
+  for (i = 0; i < NP_NUM_BEAMS; i++) fprintf(f,"nuphase_acq_beam_goal_hz{beam=\"%d\"} %.9g\n", i, m->goal[i]);
+  fprintf(f,"# HELP nuphase_acq_beam_threshold Applied threshold per beam\n# TYPE nuphase_acq_beam_threshold gauge\n");
+  for (i = 0; i < NP_NUM_BEAMS; i++) fprintf(f,"nuphase_acq_beam_threshold{beam=\"%d\"} %u\n", i, m->threshold[i]);
+
+  //the bins are log2 in us, and the last one has everything longer
+  fprintf(f,"# HELP nuphase_acq_latency_seconds Latency of each stage of writing events\n# TYPE nuphase_acq_latency_seconds histogram\n");
+  for (i = 0; i < NUPHASE_METRICS_NLATENCY; i++)
+  {
+    const nuphase_latency_hist_t * h = &m->latency[i];
+    const char * name = nuphase_metrics_latency_names[i];
+    uint64_t cumulative = 0;
+    for (j = 0; j < NUPHASE_LATENCY_NBINS - 1; j++)
+    {
+      cumulative += h->counts[j];
+      fprintf(f,"nuphase_acq_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %"PRIu64"\n", name, ldexp(1e-6, j+1), cumulative);
+    }
+    fprintf(f,"nuphase_acq_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n", name, h->n);
+    fprintf(f,"nuphase_acq_latency_seconds_sum{stage=\"%s\"} %.9g\n", name, h->sum_us * 1e-6);
+    fprintf(f,"nuphase_acq_latency_seconds_count{stage=\"%s\"} %"PRIu64"\n", name, h->n);
+  }
+}
@@ -0,0 +1,111 @@
+#include "nuphase-pid.h"
+#include <string.h>
+#include <math.h>
+
+
+void nuphase_pid_cfg_set_gains(nuphase_pid_cfg_t * cfg, double k_p, double k_i, double k_d)
+{
+  int ibeam;
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    cfg->gains[ibeam].k_p = k_p;
+    cfg->gains[ibeam].k_i = k_i;
+    cfg->gains[ibeam].k_d = k_d;
+  }
+}
+
+void nuphase_pid_init(nuphase_pid_t * pid)
+{
+  memset(pid,0,sizeof(*pid));
+}
+
+double nuphase_pid_update(nuphase_pid_t * pid, const nuphase_pid_cfg_t * cfg, int ibeam, double measured, double variance, double goal, double dt)
+{
+  nuphase_pid_gains_t g = cfg->gains[ibeam];
+
+  //gain scheduling, to get there faster when we're way off
+  if (cfg->schedule_ratio > 1 && goal > 0)
+  {
+    double ratio = measured / goal;
+    if (ratio > cfg->schedule_ratio || ratio < 1./cfg->schedule_ratio)
+    {
+      g.k_p *= cfg->schedule_factor;
+      g.k_i *= cfg->schedule_factor;
+      g.k_d *= cfg->schedule_factor;
+    }
+  }
+
+  double e = measured - goal;
+
+  // don't chase noise: shrink errors that aren't significant
+  double sigma = variance > 0 ? sqrt(variance) : 0;
+  if (cfg->noise_sigmas > 0 && sigma > 0)
+  {
+    double noise = cfg->noise_sigmas * sigma;
+    e *= e*e / (e*e + noise*noise);
+  }
+
+  // derivative on the measurement (so goal changes don't kick), low pass filtered
+  if (pid->n[ibeam] > 0 && dt > 0)
+  {
+    double raw = (measured - pid->last_measured[ibeam]) / dt;
+    double alpha = cfg->d_filter_tau > 0 ? dt / (cfg->d_filter_tau + dt) : 1;
+    pid->dmeasured[ibeam] += alpha * (raw - pid->dmeasured[ibeam]);
+  }
+
+  // don't keep integrating in the direction we're already limited in
+  double integral = pid->integral[ibeam];
+  if (!( (pid->limited[ibeam] > 0 && e > 0) || (pid->limited[ibeam] < 0 && e < 0)))
+  {
+    integral += e * dt;
+  }
+
+  //clamp the integral term
+  if (cfg->max_integral > 0 && g.k_i != 0)
+  {
+    double max = cfg->max_integral / fabs(g.k_i);
+    if (integral > max) integral = max;
+    if (integral < -max) integral = -max;
+  }
+
+  double step = g.k_p * e + g.k_i * integral + g.k_d * pid->dmeasured[ibeam];
+
+  int limited = 0;
+  if (cfg->max_step_up > 0 && step > cfg->max_step_up)
+  {
+    step = cfg->max_step_up;
+    limited = 1;
+  }
+  else if (cfg->max_step_down > 0 && step < -cfg->max_step_down)
+  {
+    step = -cfg->max_step_down;
+    limited = -1;
+  }
+
+  pid->integral[ibeam] = integral;
+  pid->error[ibeam] = e;
+  pid->last_measured[ibeam] = measured;
+  pid->step[ibeam] = step;
+  pid->sigma[ibeam] = sigma;
+  pid->limited[ibeam] = limited;
+  pid->n[ibeam]++;
+
+  return step;
+}
+
+void nuphase_pid_print(FILE * f, const nuphase_pid_t * pid, const nuphase_pid_cfg_t * cfg)
+{
+  fprintf(f,"===PID STATE (n: %d)\n", pid->n[0]);
+  int ibeam;
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    fprintf(f,"   Beam %d :: error: %g ::  integral: %g :: d(measured)/dt: %g :: last_measured: %g+/-%g :: step: %g%s", ibeam,
+            pid->error[ibeam], pid->integral[ibeam], pid->dmeasured[ibeam], pid->last_measured[ibeam], pid->sigma[ibeam], pid->step[ibeam],
+            pid->limited[ibeam] ? " (limited)" : "");
+    if (cfg)
+    {
+      fprintf(f," :: k_p=%g, k_i=%g, k_d=%g", cfg->gains[ibeam].k_p, cfg->gains[ibeam].k_i, cfg->gains[ibeam].k_d);
+    }
+    fprintf(f,"\n");
+  }
+}
@@ -0,0 +1,201 @@
+#include "nuphase-rate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+
+static const char * estimator_names[] = { "boxcar", "ewma", "kalman" };
+
+
+int nuphase_rate_init(nuphase_rate_t * r, int n)
+{
+  int ibeam;
+  if (n < 1) n = 1;
+
+  memset(r,0,sizeof(*r));
+
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    r->buf[ibeam] = calloc(n, sizeof(*r->buf[ibeam]));
+    if (!r->buf[ibeam]) return 1;
+  }
+
+  r->sz = n;
+  return 0;
+}
+
+void nuphase_rate_free(nuphase_rate_t * r)
+{
+  int ibeam;
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    free(r->buf[ibeam]);
+    r->buf[ibeam] = 0;
+  }
+}
+
+double nuphase_rate_fast_avg(const nuphase_rate_t * r, int ibeam)
+{
+  size_t max = r->i < r->sz ? r->i : r->sz;
+  if (!max) return 0;
+  return ((double) r->sum[ibeam]) / max;
+}
+
+/* Poisson variance of a rate measured from counts over t seconds (with zero counts treated as one, so it's never 0) */
+static double count_variance(double counts, double t)
+{
+  return (counts > 1 ? counts : 1) / (t * t);
+}
+
+/* blends the fast and slow rates with the static weights */
+static void blend(const nuphase_rate_cfg_t * cfg, double fast, double fast_var, double slow, double slow_var, double * rate, double * var)
+{
+  double w = cfg->slow_weight + cfg->fast_weight;
+  *rate = (cfg->slow_weight * slow + cfg->fast_weight * fast) / w;
+  *var = (cfg->slow_weight * cfg->slow_weight * slow_var + cfg->fast_weight * cfg->fast_weight * fast_var) / (w*w);
+}
+
+void nuphase_rate_update(nuphase_rate_t * r, const nuphase_rate_cfg_t * cfg, const nuphase_status_t * st, double dt)
+{
+  int ibeam;
+  const double t_fast = NP_SCALER_TIME(SCALER_FAST);
+  const double t_slow = NP_SCALER_TIME(SCALER_SLOW);
+  const double t_gated = NP_SCALER_TIME(SCALER_SLOW_GATED);
+  int first = r->i == 0;
+
+  //if we read faster than the fast scaler updates, we see the same value more than once
+  double fast_repeat = dt > 0 && dt < t_fast ? t_fast / dt : 1;
+
+  double alpha = cfg->ewma_tau > 0 && dt > 0 ? 1 - exp(-dt / cfg->ewma_tau) : 1;
+
+  r->slow_age += dt;
+  int use_slow = first || r->slow_age >= t_slow;
+  if (use_slow) r->slow_age = 0;
+
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    uint16_t fast_counts = st->beam_scalers[SCALER_FAST][ibeam];
+    uint16_t slow_counts = st->beam_scalers[SCALER_SLOW][ibeam];
+    double fast = fast_counts / t_fast;
+    double fast_var = count_variance(fast_counts, t_fast) * fast_repeat;
+    double slow = slow_counts / t_slow;
+    double slow_var = count_variance(slow_counts, t_slow);
+
+    // boxcar
+    r->sum[ibeam] -= r->buf[ibeam][r->i % r->sz];
+    r->sum[ibeam] += fast_counts;
+    r->buf[ibeam][r->i % r->sz] = fast_counts;
+
+    // ewma
+    if (first)
+    {
+      r->ewma[ibeam] = fast;
+      r->ewma_var[ibeam] = fast_var;
+    }
+    else
+    {
+      r->ewma[ibeam] += alpha * (fast - r->ewma[ibeam]);
+      r->ewma_var[ibeam] = (1-alpha)*(1-alpha) * r->ewma_var[ibeam] + alpha * alpha * fast_var;
+    }
+
+    // kalman
+    if (first)
+    {
+      r->x[ibeam] = fast;
+      r->P[ibeam] = fast_var;
+    }
+    else
+    {
+      //predict: the rate does a random walk (with a floor so it can get off of zero)
+      double scale = r->x[ibeam] > 1./t_fast ? r->x[ibeam] : 1./t_fast;
+      r->P[ibeam] += cfg->process_noise * cfg->process_noise * scale * scale * dt;
+
+      double K = r->P[ibeam] / (r->P[ibeam] + fast_var);
+      r->x[ibeam] += K * (fast - r->x[ibeam]);
+      r->P[ibeam] *= (1-K);
+    }
+
+    if (use_slow && !first)
+    {
+      double K = r->P[ibeam] / (r->P[ibeam] + slow_var);
+      r->x[ibeam] += K * (slow - r->x[ibeam]);
+      r->P[ibeam] *= (1-K);
+    }
+  }
+
+  r->i++;
+  r->estimator = cfg->estimator;
+
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    uint16_t slow_counts = st->beam_scalers[SCALER_SLOW][ibeam];
+    double slow = slow_counts / t_slow;
+    double slow_var = count_variance(slow_counts, t_slow);
+    double rate, var;
+
+    switch (cfg->estimator)
+    {
+      case NP_RATE_KALMAN:
+        rate = r->x[ibeam];
+        var = r->P[ibeam];
+        break;
+      case NP_RATE_EWMA:
+        blend(cfg, r->ewma[ibeam], r->ewma_var[ibeam], slow, slow_var, &rate, &var);
+        break;
+      case NP_RATE_BOXCAR:
+      default:
+      {
+        size_t n = r->i < r->sz ? r->i : r->sz;
+        double box = nuphase_rate_fast_avg(r, ibeam) / t_fast;
+        double box_var = count_variance(r->sum[ibeam], t_fast) / (n * n);
+        blend(cfg, box, box_var, slow, slow_var, &rate, &var);
+        break;
+      }
+    }
+
+    if (cfg->subtract_gated)
+    {
+      uint16_t gated_counts = st->beam_scalers[SCALER_SLOW_GATED][ibeam];
+      rate -= gated_counts / t_gated;
+      var += count_variance(gated_counts, t_gated);
+    }
+
+    r->rate[ibeam] = rate;
+    r->variance[ibeam] = var;
+  }
+}
+
+const char * nuphase_rate_estimator_name(nuphase_rate_estimator_t e)
+{
+  if (e < NP_RATE_BOXCAR || e > NP_RATE_KALMAN) return "unknown";
+  return estimator_names[e];
+}
+
+int nuphase_rate_estimator_from_name(const char * name)
+{
+  int i;
+  for (i = 0; i < (int) (sizeof(estimator_names) / sizeof(*estimator_names)); i++)
+  {
+    if (!strcasecmp(name, estimator_names[i])) return i;
+  }
+  return -1;
+}
+
+void nuphase_rate_print(FILE * f, const nuphase_rate_t * r)
+{
+  int ibeam;
+  fprintf(f,"Running average of %zu fast scalers:\n\t", r->i < r->sz ? r->i : r->sz);
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    fprintf(f,"%0.4g  ", nuphase_rate_fast_avg(r, ibeam) );
+  }
+  fprintf(f,"\n");
+
+  fprintf(f,"Rate estimate (%s), Hz:\n\t", nuphase_rate_estimator_name(r->estimator));
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    fprintf(f,"%0.4g+/-%0.2g  ", r->rate[ibeam], sqrt(r->variance[ibeam]));
+  }
+  fprintf(f,"\n");
+}
@@ -0,0 +1,364 @@
+#include "nuphase-snapshot.h"
+#include "nuphase-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <zlib.h>
+
+#define SNAPSHOT_BUFSIZE (1 << 16)
+
+/* dedup entries older than this (in seconds) aren't linked to anymore, but replaced by a fresh copy */
+#define SNAPSHOT_DEDUP_MAX_AGE 86400
+
+
+/* crc32 of the whole file */
+static int hash_file(const char * path, uint32_t * crc)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 1;
+
+  char * buf = malloc(SNAPSHOT_BUFSIZE);
+  uLong c = crc32(0, Z_NULL, 0);
+  ssize_t n = -1;
+  while (buf && (n = read(fd, buf, SNAPSHOT_BUFSIZE)) > 0)
+  {
+    c = crc32(c, (const Bytef*) buf, n);
+  }
+
+  free(buf);
+  close(fd);
+  *crc = c;
+  return n != 0;
+}
+
+/* 1 if the two files have identical contents */
+static int same_contents(const char * a, const char * b, off_t size)
+{
+  struct stat st;
+  if (stat(a, &st) || st.st_size != size) return 0;
+
+  int fa = open(a, O_RDONLY | O_CLOEXEC);
+  int fb = open(b, O_RDONLY | O_CLOEXEC);
+  char * bufa = malloc(SNAPSHOT_BUFSIZE);
+  char * bufb = malloc(SNAPSHOT_BUFSIZE);
+  int same = fa >= 0 && fb >= 0 && bufa && bufb;
+
+  while (same)
+  {
+    ssize_t na = read(fa, bufa, SNAPSHOT_BUFSIZE);
+    if (na <= 0)
+    {
+      same = na == 0 && read(fb, bufb, 1) == 0;
+      break;
+    }
+
+    ssize_t nb = 0;
+    while (nb < na)
+    {
+      ssize_t n = read(fb, bufb + nb, na - nb);
+      if (n <= 0) break;
+      nb += n;
+    }
+    same = nb == na && !memcmp(bufa, bufb, na);
+  }
+
+  if (fa >= 0) close(fa);
+  if (fb >= 0) close(fb);
+  free(bufa);
+  free(bufb);
+  return same;
+}
+
+/* copies everything from in to out, trying the cheapest way first */
+static int copy_data(int in, int out, off_t size)
+{
+  off_t done = 0;
+  ssize_t n;
+
+  //files that say they're empty (like in /proc) can still have something to read, so only read/write for those
+  if (size > 0)
+  {
+#ifdef FICLONE
+    if (!ioctl(out, FICLONE, in)) return 0;
+#endif
+
+    while ((n = copy_file_range(in, 0, out, 0, SNAPSHOT_BUFSIZE << 4, 0)) > 0 || (n < 0 && errno == EINTR))
+    {
+      if (n > 0) done += n;
+    }
+    if (n == 0 && done) return 0;
+    if (done) return 1; // failed partway, so the offsets are somewhere in the middle
+
+    while ((n = sendfile(out, in, 0, SNAPSHOT_BUFSIZE << 4)) > 0 || (n < 0 && errno == EINTR))
+    {
+      if (n > 0) done += n;
+    }
+    if (n == 0 && done) return 0;
+    if (done) return 1;
+  }
+
+  char * buf = malloc(SNAPSHOT_BUFSIZE);
+  if (!buf) return 1;
+
+  int ret = 0;
+  while ((n = read(in, buf, SNAPSHOT_BUFSIZE)) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      ret = 1;
+      break;
+    }
+
+    ssize_t written = 0;
+    while (written < n)
+    {
+      ssize_t w = write(out, buf + written, n - written);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) break;
+      written += w;
+    }
+
+    if (written < n)
+    {
+      ret = 1;
+      break;
+    }
+  }
+
+  free(buf);
+  return ret;
+}
+
+static int copy_file(const char * src, const struct stat * st, const char * dest,
+                     const char * dedup_dir, int backup, nuphase_snapshot_stats_t * stats)
+{
+  if (backup && !access(dest, F_OK))
+  {
+    char old[strlen(dest) + 2];
+    sprintf(old, "%s~", dest);
+    rename(dest, old);
+  }
+
+  //never write into an existing destination (it might be a hardlink), always replace it
+  char tmp[strlen(dest) + sizeof(tmp_suffix)];
+  sprintf(tmp, "%s%s", dest, tmp_suffix);
+  unlink(tmp);
+
+  char stored[dedup_dir ? strlen(dedup_dir) + 32 : 1];
+  stored[0] = 0;
+  int stale = 0;
+  uint32_t crc;
+  if (dedup_dir && st->st_size > 0 && !hash_file(src, &crc))
+  {
+    snprintf(stored, sizeof(stored), "%s/%" PRIx64 "-%08" PRIx32, dedup_dir, (uint64_t) st->st_size, crc);
+
+    //every link shares the inode's mtime, so only link to recent ones; nuphase-copy deletes by age
+    struct stat stored_st;
+    stale = !stat(stored, &stored_st) && time(0) - stored_st.st_mtime > SNAPSHOT_DEDUP_MAX_AGE;
+
+    if (!stale && same_contents(stored, src, st->st_size) && !link(stored, tmp) && !rename(tmp, dest))
+    {
+      stats->linked++;
+      stats->bytes_linked += st->st_size;
+      return 0;
+    }
+    unlink(tmp);
+  }
+
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+  {
+    fprintf(stderr, "Could not open %s (%s)\n", src, strerror(errno));
+    return 1;
+  }
+
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st->st_mode & 07777);
+  if (out < 0)
+  {
+    fprintf(stderr, "Could not open %s (%s)\n", tmp, strerror(errno));
+    close(in);
+    return 1;
+  }
+
+  int ret = copy_data(in, out, st->st_size);
+  close(in);
+  if (close(out)) ret = 1;
+
+  if (ret || rename(tmp, dest))
+  {
+    fprintf(stderr, "Could not copy %s to %s\n", src, dest);
+    unlink(tmp);
+    return 1;
+  }
+
+  stats->files++;
+  stats->bytes_copied += st->st_size;
+
+  //keep it for next time, unless there's already something (recent) there
+  if (*stored)
+  {
+    if (stale) unlink(stored);
+    link(dest, stored);
+  }
+  return 0;
+}
+
+static int copy_path(const char * src, const char * dest_dir, const char * dedup_dir, int backup,
+                     int top, nuphase_snapshot_stats_t * stats)
+{
+  //the last component, ignoring trailing slashes
+  size_t len = strlen(src);
+  while (len > 1 && src[len-1] == '/') len--;
+  size_t start = len;
+  while (start > 0 && src[start-1] != '/') start--;
+
+  char dest[strlen(dest_dir) + len - start + 2];
+  snprintf(dest, sizeof(dest), "%s/%.*s", dest_dir, (int) (len - start), src + start);
+
+  //like cp, symlinks given directly are followed, but ones inside directories are copied as they are
+  struct stat st;
+  if (top ? stat(src, &st) : lstat(src, &st))
+  {
+    fprintf(stderr, "Could not stat %s (%s)\n", src, strerror(errno));
+    return 1;
+  }
+
+  if (S_ISREG(st.st_mode))
+  {
+    return copy_file(src, &st, dest, dedup_dir, backup, stats);
+  }
+
+  if (S_ISLNK(st.st_mode))
+  {
+    char target[4096];
+    ssize_t n = readlink(src, target, sizeof(target) - 1);
+    if (n < 0) return 1;
+    target[n] = 0;
+    unlink(dest);
+    return symlink(target, dest);
+  }
+
+  if (!S_ISDIR(st.st_mode)) return 0; // nothing to copy for devices, fifos, etc.
+
+  if (mkdir(dest, st.st_mode & 07777) && errno != EEXIST)
+  {
+    fprintf(stderr, "Could not make %s (%s)\n", dest, strerror(errno));
+    return 1;
+  }
+  stats->dirs++;
+
+  DIR * dir = opendir(src);
+  if (!dir) return 1;
+
+  int ret = 0;
+  struct dirent * ent;
+  while ((ent = readdir(dir)))
+  {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    char child[strlen(src) + strlen(ent->d_name) + 2];
+    snprintf(child, sizeof(child), "%s/%s", src, ent->d_name);
+    if (copy_path(child, dest, dedup_dir, backup, 0, stats))
+    {
+      stats->errors++;
+      ret = 1;
+    }
+  }
+
+  closedir(dir);
+  return ret;
+}
+
+int nuphase_snapshot_copy(const char * src, const char * dest_dir, const char * dedup_dir, int backup, nuphase_snapshot_stats_t * stats)
+{
+  nuphase_snapshot_stats_t dummy;
+  if (!stats)
+  {
+    memset(&dummy, 0, sizeof(dummy));
+    stats = &dummy;
+  }
+
+  if (dedup_dir && !*dedup_dir) dedup_dir = 0;
+  if (dedup_dir && mkdir_if_needed(dedup_dir)) dedup_dir = 0;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int ret = copy_path(src, dest_dir, dedup_dir, backup, 1, stats);
+  if (ret) stats->errors++;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  stats->seconds += timespec_difference_float(&t1, &t0);
+  return ret;
+}
+
+
+typedef struct snapshot_args
+{
+  char * paths;
+  char * dest_dir;
+  char * dedup_dir;
+  int backup;
+} snapshot_args_t;
+
+static void * snapshot_thread(void * v)
+{
+  snapshot_args_t * a = v;
+  nuphase_snapshot_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+
+  if (mkdir_if_needed(a->dest_dir))
+  {
+    fprintf(stderr, "Could not make %s, not copying %s\n", a->dest_dir, a->paths);
+  }
+  else
+  {
+    char * save_ptr = 0;
+    char * path = strtok_r(a->paths, ":", &save_ptr);
+    while (path)
+    {
+      nuphase_snapshot_copy(path, a->dest_dir, a->dedup_dir, a->backup, &stats);
+      path = strtok_r(NULL, ":", &save_ptr);
+    }
+
+    printf("Copied into %s: %d files (%" PRIu64 " bytes), %d linked (%" PRIu64 " bytes), %d errors, %0.3f s\n",
+           a->dest_dir, stats.files, stats.bytes_copied, stats.linked, stats.bytes_linked, stats.errors, stats.seconds);
+  }
+
+  free(a->paths);
+  free(a->dest_dir);
+  free(a->dedup_dir);
+  free(a);
+  return 0;
+}
+
+int nuphase_snapshot_async(const char * paths, const char * dest_dir, const char * dedup_dir, int backup)
+{
+  if (!paths || !*paths) return 0;
+
+  snapshot_args_t * a = malloc(sizeof(*a));
+  if (!a) return 1;
+  a->paths = strdup(paths);
+  a->dest_dir = strdup(dest_dir);
+  a->dedup_dir = dedup_dir && *dedup_dir ? strdup(dedup_dir) : 0;
+  a->backup = backup;
+
+  if (nuphase_background_thread(snapshot_thread, a))
+  {
+    fprintf(stderr, "Could not start a thread to copy %s\n", paths);
+    free(a->paths);
+    free(a->dest_dir);
+    free(a->dedup_dir);
+    free(a);
+    return 1;
+  }
+  return 0;
+}
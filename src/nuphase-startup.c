@@ -2,11 +2,17 @@
  * \file nuphase-startup.c
  *
  * Startup program. This makes sure the FPGA's dont' turn on
- * until it's warm enough and that the heater is running properly. 
+ * until it's warm enough and that the heater is running properly, 
+ * then reconfigures the FPGA's and tunes the attenuations. 
  *
- * In the future, it may do an attenuation scan as well. 
+ * It's a state machine (see startup_phase_t), driven by one loop that also keeps 
+ * polling the housekeeping: boards are powered as soon as each is warm enough, 
+ * waits for the FPGA's are readiness checks (both boards reporting sensible firmware 
+ * info, after at least fpga_boot_min_wait) with timeouts, 
+ * and the reconfigure command runs in the background while we keep polling. 
  *
- * Right now this doesn't save any output (although I suppose things will be logged)
+ * The housekeeping goes to out_dir, and the time spent in each phase to 
+ * a .phases file next to it. 
  *
  **/ 
 
@@ -14,9 +20,12 @@
 #include "nuphasehk.h" 
 #include "nuphase-cfg.h" 
 #include "nuphase-common.h" 
+#include "nuphase-calib.h" 
 #include <stdio.h> 
 #include <string.h> 
 #include <signal.h>
+#include <stdlib.h> 
+#include <unistd.h> 
 
 
 static nuphase_start_cfg_t cfg; 
@@ -33,32 +42,264 @@ static int read_config()
   return 0; 
 }
 
+static void calib_limits(nuphase_calib_limits_t * limits) 
+{
+  limits->max_age = cfg.calib_max_age; 
+  limits->max_temp_diff = cfg.calib_max_temp_diff; 
+  limits->rms_tolerance = cfg.calib_rms_tolerance; 
+  limits->check_events = cfg.calib_check_events; 
+}
+
+/* the acq config (for the spi devices and the configured attenuations) */ 
+static void read_acq_config(nuphase_acq_cfg_t * acq_cfg) 
+{
+  nuphase_acq_config_init(acq_cfg); 
+  char * acq_config_file; 
+  if (!nuphase_get_cfg_file(&acq_config_file, NUPHASE_ACQ))
+  {
+    nuphase_acq_config_read(acq_config_file, acq_cfg); 
+    free(acq_config_file); 
+  }
+}
+
+/* opens the device, using the spi devices from the acq config */ 
+static nuphase_dev_t * open_device() 
+{
+  nuphase_acq_cfg_t acq_cfg; 
+  read_acq_config(&acq_cfg); 
+  return nuphase_open(acq_cfg.spi_devices[0], acq_cfg.spi_devices[1], 0, 1); 
+}
 
-static void signal_handler(int signal, siginfo_t * sig, void * v) 
+/* Returns 1 if the cached attenuation still applies (and, once set, passes the on-device check), so the script can be skipped. 
+ * The cached attenuations are left on the device. */ 
+static int attenuation_cached(const nuphase_hk_t * hk) 
 {
-  switch (signal)
+  if (!strlen(cfg.calib_cache_file)) return 0; 
+
+  nuphase_calib_t calib; 
+  if (nuphase_calib_read(cfg.calib_cache_file, &calib)) return 0; 
+
+  nuphase_calib_limits_t limits; 
+  calib_limits(&limits); 
+
+  nuphase_dev_t * dev = open_device(); 
+  if (!dev) return 0; 
+
+  int ok = 0; 
+  const char * why = nuphase_calib_entry_mismatch(&calib.attenuation, &limits, nuphase_calib_firmware_id(dev), hk, 
+                                                  cfg.desired_rms_master, cfg.desired_rms_slave); 
+  if (why) 
+  {
+    printf("Not using cached attenuation: %s\n", why); 
+  }
+  else if (nuphase_calib_apply(dev, &calib.attenuation)) 
   {
-    case SIGUSR1: 
-      read_config(); 
-      break; 
-    default: 
-      fprintf(stderr,"Caught signal %d\n", signal); 
+    printf("Not using cached attenuation: no attenuations recorded\n"); 
   }
+  else if (nuphase_calib_check(dev, &limits, cfg.desired_rms_master, cfg.desired_rms_slave))
+  {
+    printf("Not using cached attenuation: on-device check failed\n"); 
+  }
+  else
+  {
+    ok = 1; 
+  }
+
+  nuphase_close(dev); 
+  return ok; 
+}
+
+/* Tunes the attenuations in process, and appends the result to attenuation.log in out_dir. 
+ * Returns 0 on success */ 
+static int tune_attenuation(nuphase_atten_result_t * result) 
+{
+  nuphase_dev_t * dev = open_device(); 
+  if (!dev) 
+  {
+    fprintf(stderr,"Couldn't open device to tune attenuations\n"); 
+    return 1; 
+  }
+
+  nuphase_atten_cfg_t atten_cfg; 
+  nuphase_start_config_atten(&cfg, &atten_cfg); 
+  //start from the configured attenuations (which is also what boards with no goal get) 
+  nuphase_acq_cfg_t acq_cfg; 
+  read_acq_config(&acq_cfg); 
+  int ret = nuphase_atten_tune(dev, &atten_cfg, acq_cfg.attenuation, result); 
+  nuphase_close(dev); 
+  nuphase_atten_print(stdout, result); 
+
+  char buf[1024]; 
+  snprintf(buf, sizeof(buf), "%s/attenuation.log", cfg.out_dir); 
+  FILE * log = fopen(buf,"a"); 
+  if (log) 
+  {
+    int ib, ich; 
+    fprintf(log,"%u iterations=%d seconds=%0.3f converged=%d", (unsigned) time(0), result->iterations, result->seconds, result->converged); 
+    for (ib = 0; ib < NP_MAX_BOARDS; ib++) 
+    {
+      for (ich = 0; ich < NP_NUM_CHAN; ich++) 
+      {
+        fprintf(log," %u:%0.2f", result->atten[ib][ich], result->rms[ib][ich]); 
+      }
+    }
+    fprintf(log,"\n"); 
+    fclose(log); 
+  }
+
+  return ret; 
+}
+
+/* records a successful attenuation in the cache. atten is what was tuned (NULL if not known, 
+ * e.g. from the script, in which case the entry can't be used next time) */ 
+static void attenuation_record(const nuphase_hk_t * hk, const uint8_t atten[NP_MAX_BOARDS][NP_NUM_CHAN]) 
+{
+  if (!strlen(cfg.calib_cache_file)) return; 
+
+  nuphase_dev_t * dev = open_device(); 
+  if (!dev) return; 
+
+  nuphase_calib_t calib; 
+  nuphase_calib_read(cfg.calib_cache_file, &calib); 
+  nuphase_calib_entry_set(&calib.attenuation, nuphase_calib_firmware_id(dev), hk, cfg.desired_rms_master, cfg.desired_rms_slave, atten); 
+  nuphase_close(dev); 
+
+  if (nuphase_calib_write(cfg.calib_cache_file, &calib))
+  {
+    fprintf(stderr,"Could not write %s\n", cfg.calib_cache_file); 
+  }
+}
+
+
+
+typedef enum startup_phase
+{
+  PHASE_WARMUP,        // heating, powering each board once it's warm enough
+  PHASE_POWER_ON,      // heaters off, everything on 
+  PHASE_FPGA_BOOT,     // waiting for the boards to boot
+  PHASE_RECONFIGURE,   // reconfigure_fpga_cmd running in the background 
+  PHASE_FPGA_READY,    // waiting for the boards to boot after reconfiguring 
+  PHASE_ATTENUATION,   // cached, native or set_attenuation_cmd
+  PHASE_DONE, 
+  NPHASES
+} startup_phase_t; 
+
+static const char * phase_names[NPHASES] = { "warmup", "power_on", "fpga_boot", "reconfigure", "fpga_ready", "attenuation", "done" }; 
+
+static struct timespec phase_start[NPHASES]; 
+static double phase_seconds[NPHASES]; 
+
+static void enter_phase(startup_phase_t * phase, startup_phase_t next) 
+{
+  struct timespec now; 
+  clock_gettime(CLOCK_MONOTONIC, &now); 
+  phase_seconds[*phase] = timespec_difference_float(&now, &phase_start[*phase]); 
+  printf("Startup phase %s took %0.1f s, now %s\n", phase_names[*phase], phase_seconds[*phase], phase_names[next]); 
+  phase_start[next] = now; 
+  *phase = next; 
+}
+
+/* seconds since the current phase started */ 
+static double phase_elapsed(startup_phase_t phase) 
+{
+  struct timespec now; 
+  clock_gettime(CLOCK_MONOTONIC, &now); 
+  return timespec_difference_float(&now, &phase_start[phase]); 
+}
+
+/* writes the phase durations (key=value) next to the hk file */ 
+static void write_phases(const char * hk_name, double total) 
+{
+  if (!hk_name) return; 
+
+  //hk_name ends in .hk.gz.tmp
+  char buf[strlen(hk_name) + 16]; 
+  strcpy(buf, hk_name); 
+  char * ext = strstr(buf, ".hk.gz"); 
+  if (ext) *ext = 0; 
+  strcat(buf, ".phases"); 
+
+  FILE * f = fopen(buf,"w"); 
+  if (!f) return; 
+  int i; 
+  for (i = 0; i < PHASE_DONE; i++) 
+  {
+    fprintf(f,"%s_s=%0.3f\n", phase_names[i], phase_seconds[i]); 
+  }
+  fprintf(f,"total_s=%0.3f\n", total); 
+  fclose(f); 
+}
+
+/* The device used to poll the boards while waiting for them, kept open across polls. 
+ * It's closed before anything else (the reconfigure command, the attenuation tuning) talks to the boards. */ 
+static nuphase_dev_t * wait_dev = 0; 
+
+static void wait_dev_close() 
+{
+  if (wait_dev) nuphase_close(wait_dev); 
+  wait_dev = 0; 
+}
+
+/* An unbooted FPGA still answers the SPI transfer, with all zeros or all ones, 
+ * so check that what it says makes sense for this board */ 
+static int fwinfo_valid(const nuphase_fwinfo_t * info, nuphase_which_board_t which) 
+{
+  const uint64_t dna_mask = (1ull << 57) - 1; //the device DNA is 57 bits 
+  uint64_t dna = info->dna & dna_mask; 
+
+  if (dna == 0 || dna == dna_mask) return 0; 
+  if (info->ver.major == 0 || info->ver.major == 0xf) return 0; 
+  if (info->date.month < 1 || info->date.month > 12 || info->date.day < 1) return 0; 
+  return info->ver.master == (which == MASTER); 
+}
+
+/* 1 if both boards report sensible firmware info */ 
+static int boards_ready() 
+{
+  if (!wait_dev) wait_dev = open_device(); 
+  if (!wait_dev) return 0; 
+
+  nuphase_fwinfo_t info[2]; 
+  memset(info,0,sizeof(info)); 
+  return !nuphase_fwinfo(wait_dev, &info[0], MASTER) && fwinfo_valid(&info[0], MASTER) && 
+         !nuphase_fwinfo(wait_dev, &info[1], SLAVE) && fwinfo_valid(&info[1], SLAVE); 
 }
 
+/* set from the runner thread when reconfigure_fpga_cmd finishes */ 
+static volatile int reconfigure_done = 0; 
+
+static void reconfigure_finished(const char * cmd, const nuphase_cmd_result_t * result, void * arg) 
+{
+  nuphase_run_report(cmd, result, arg); 
+  __atomic_store_n(&reconfigure_done, 1, __ATOMIC_RELEASE); 
+}
+
+static void attenuate(const nuphase_hk_t * hk) 
+{
+  char cmd[1024]; 
+  sprintf(cmd,"%s %g %g", cfg.set_attenuation_cmd, cfg.desired_rms_master, cfg.desired_rms_slave); 
+  if (attenuation_cached(hk)) 
+  {
+    printf("Cached attenuation still good, not tuning\n"); 
+  }
+  else if (cfg.native_attenuation) 
+  {
+    nuphase_atten_result_t result; 
+    if (!tune_attenuation(&result)) attenuation_record(hk, result.atten); 
+  }
+  else
+  {
+    printf("Running: %s\n", cmd); 
+    if (!nuphase_run(cmd, cfg.attenuation_timeout, 0, 0)) attenuation_record(hk, 0); 
+  }
+}
 
 
 int main (int nargs, char ** args) 
 {
 
-  //set up signal handlers 
-  sigset_t empty;
-  sigemptyset(&empty); 
-  struct sigaction sa; 
-  sa.sa_mask = empty; 
-  sa.sa_flags = 0; 
-  sa.sa_sigaction = signal_handler; 
-  sigaction(SIGUSR1, &sa,0); 
+  //config rereads are requested on the reload thread and done in the loop below
+  nuphase_reload_start(NUPHASE_STARTUP, 0, 0); 
 
 
 
@@ -66,6 +307,10 @@ int main (int nargs, char ** args)
   nuphase_start_config_init(&cfg); 
   read_config(); 
   
+  struct timespec boot; 
+  clock_gettime(CLOCK_MONOTONIC, &boot); 
+  startup_phase_t phase = PHASE_WARMUP; 
+  phase_start[phase] = boot; 
 
 
   //turn off all fpga gpio's 
@@ -91,129 +336,188 @@ int main (int nargs, char ** args)
   }
 
 
-
-  //wait a little bit
-  sleep(1); 
-
-
-
   nuphase_hk_t hk; 
   int master_ok = 0; 
   int slave_ok = 0; 
-  // now loop until the temperature is warm enough 
-  while (master_ok < cfg.nchecks || slave_ok < cfg.nchecks) 
-  {
-
-    int short_circuit = 0;
-    //get the hk info 
-    nuphase_hk(&hk, cfg.asps_method); 
-    nuphase_hk_print(stdout,&hk); 
-    if (out) 
-    {
-      nuphase_hk_gzwrite(out, &hk); 
-    }
+  int reconfigure_started = 0; 
+  struct timespec last_hk = {0,0}; 
 
+  while (phase != PHASE_DONE) 
+  {
+    if (nuphase_reload_pending()) read_config(); 
 
-    if (hk.temp_master >= cfg.min_temperature && master_ok < cfg.nchecks)
+    //keep polling the hk whatever we're doing 
+    struct timespec now; 
+    clock_gettime(CLOCK_MONOTONIC, &now); 
+    int hk_due = !last_hk.tv_sec || timespec_difference_float(&now, &last_hk) >= cfg.poll_interval; 
+    if (hk_due) 
     {
-
-      master_ok++; 
-      printf("Master OK %d\n", master_ok); 
-      short_circuit=1;
-
-      //safe to turn it on
-      if (master_ok >= cfg.nchecks && slave_ok < cfg.nchecks) //only turn on if slave not already on
+      nuphase_hk(&hk, cfg.asps_method); 
+      nuphase_hk_print(stdout,&hk); 
+      if (out) 
       {
-        printf("Turning on Master (and turning off aux heater) \n"); 
-        nuphase_set_gpio_power_state( NP_FPGA_POWER_MASTER, NP_FPGA_POWER_MASTER | NP_AUX_HEATER); 
-        sleep(1); 
+        nuphase_hk_gzwrite(out, &hk); 
       }
+      last_hk = now; 
     }
 
-    if (hk.temp_slave >= cfg.min_temperature && slave_ok < cfg.nchecks)
+    switch (phase) 
     {
-
-      slave_ok++; 
-      printf("Slave OK %d\n", slave_ok); 
-      short_circuit=1;
-
-      if (slave_ok >= cfg.nchecks && master_ok < cfg.nchecks) //only turn on if master not already on
+      case PHASE_WARMUP: 
       {
-        printf("Turning on slave\n"); 
-        nuphase_set_gpio_power_state( NP_FPGA_POWER_SLAVE, NP_FPGA_POWER_SLAVE); 
-        sleep(1); 
+        if (!hk_due) break; 
+        int short_circuit = 0; 
+
+        if (hk.temp_master >= cfg.min_temperature && master_ok < cfg.nchecks)
+        {
+          master_ok++; 
+          printf("Master OK %d\n", master_ok); 
+          short_circuit = 1; 
+
+          //safe to turn it on, so it boots while the slave warms up 
+          if (master_ok >= cfg.nchecks && slave_ok < cfg.nchecks) //only turn on if slave not already on
+          {
+            printf("Turning on Master (and turning off aux heater) \n"); 
+            nuphase_set_gpio_power_state( NP_FPGA_POWER_MASTER, NP_FPGA_POWER_MASTER | NP_AUX_HEATER); 
+          }
+        }
+
+        if (hk.temp_slave >= cfg.min_temperature && slave_ok < cfg.nchecks)
+        {
+          slave_ok++; 
+          printf("Slave OK %d\n", slave_ok); 
+          short_circuit = 1; 
+
+          if (slave_ok >= cfg.nchecks && master_ok < cfg.nchecks) //only turn on if master not already on
+          {
+            printf("Turning on slave\n"); 
+            nuphase_set_gpio_power_state( NP_FPGA_POWER_SLAVE, NP_FPGA_POWER_SLAVE); 
+          }
+        }
+
+        if (master_ok >= cfg.nchecks && slave_ok >= cfg.nchecks) 
+        {
+          enter_phase(&phase, PHASE_POWER_ON); 
+          break; 
+        }
+
+        //check again right away 
+        if (short_circuit) 
+        {
+          last_hk.tv_sec = 0; 
+          break; 
+        }
+
+        //make sure that the asps heater is on 
+        if (hk.asps_heater_current != cfg.heater_current) 
+        {
+            nuphase_set_asps_heater_current(cfg.heater_current, cfg.asps_method); 
+        }
+
+        //make sure that the aux heater is on if the master is not 
+        nuphase_set_gpio_power_state(master_ok >= cfg.nchecks ? 0 : NP_AUX_HEATER, NP_AUX_HEATER); 
+        break; 
       }
-    }
 
-    if (short_circuit) continue; 
+      case PHASE_POWER_ON: 
+        //turn off heaters
+        printf("Turning off heaters\n"); 
+        nuphase_set_asps_heater_current(0, cfg.asps_method); 
+        nuphase_set_gpio_power_state(0, NP_AUX_HEATER); 
+
+        printf("Turning everything on\n"); 
+
+        //turn on the master and spi
+        nuphase_set_gpio_power_state( GPIO_FPGA_ALL, GPIO_FPGA_ALL); 
+
+        //turn on the downhole??? 
+        // (not yet) 
+
+        last_hk.tv_sec = 0; //take a reading of the final state 
+        enter_phase(&phase, PHASE_FPGA_BOOT); 
+        break; 
+
+      case PHASE_FPGA_BOOT: 
+        //never earlier than fpga_boot_min_wait, whatever the boards say 
+        if (phase_elapsed(phase) < cfg.fpga_boot_min_wait) break; 
+        if (boards_ready()) 
+        {
+          wait_dev_close(); 
+          enter_phase(&phase, strlen(cfg.reconfigure_fpga_cmd) ? PHASE_RECONFIGURE : PHASE_ATTENUATION); 
+        }
+        else if (phase_elapsed(phase) > cfg.fpga_boot_timeout) 
+        {
+          fprintf(stderr,"Boards not ready after %d seconds, carrying on anyway\n", cfg.fpga_boot_timeout); 
+          wait_dev_close(); 
+          enter_phase(&phase, strlen(cfg.reconfigure_fpga_cmd) ? PHASE_RECONFIGURE : PHASE_ATTENUATION); 
+        }
+        break; 
+
+      case PHASE_RECONFIGURE: 
+        //the runner kills it after reconfigure_timeout 
+        if (!reconfigure_started) 
+        {
+          printf("Reconfiguring FGPAs with command: %s\n", cfg.reconfigure_fpga_cmd); 
+          reconfigure_started = 1; 
+          if (nuphase_run_async(cfg.reconfigure_fpga_cmd, cfg.reconfigure_timeout, 4096, reconfigure_finished, 0)) 
+          {
+            enter_phase(&phase, PHASE_FPGA_READY); 
+          }
+        }
+        else if (__atomic_load_n(&reconfigure_done, __ATOMIC_ACQUIRE)) 
+        {
+          enter_phase(&phase, PHASE_FPGA_READY); 
+        }
+        break; 
+
+      case PHASE_FPGA_READY: 
+        if (phase_elapsed(phase) < cfg.fpga_boot_min_wait) break; 
+        if (boards_ready()) 
+        {
+          wait_dev_close(); 
+          enter_phase(&phase, PHASE_ATTENUATION); 
+        }
+        else if (phase_elapsed(phase) > cfg.fpga_boot_timeout) 
+        {
+          fprintf(stderr,"Boards not ready after %d seconds, carrying on anyway\n", cfg.fpga_boot_timeout); 
+          wait_dev_close(); 
+          enter_phase(&phase, PHASE_ATTENUATION); 
+        }
+        break; 
+
+      case PHASE_ATTENUATION: 
+        if (cfg.native_attenuation || strlen(cfg.set_attenuation_cmd))
+        {
+          attenuate(&hk); 
+        }
+        enter_phase(&phase, PHASE_DONE); 
+        break; 
+
+      default: 
+        break; 
+    }
 
+    if (phase == PHASE_DONE) break; 
 
-    //make sure that the asps heater is on 
-    if (hk.asps_heater_current != cfg.heater_current) 
+    //the warmup only does something when there's new hk, the waits check about once a second  
+    if (phase == PHASE_WARMUP) 
     {
-        nuphase_set_asps_heater_current(cfg.heater_current, cfg.asps_method); 
+      if (last_hk.tv_sec) nuphase_reload_sleep(cfg.poll_interval); 
     }
-
-    //make sure that the aux heater is on if the master is not 
-    nuphase_set_gpio_power_state(master_ok >= cfg.nchecks ? 0 : NP_AUX_HEATER, NP_AUX_HEATER); 
- 
-    sleep(cfg.poll_interval); 
+    else if (phase != PHASE_POWER_ON && phase != PHASE_ATTENUATION) nuphase_reload_sleep(1); 
   } 
 
-
-
-  //turn off heaters
-  printf("Turning off heaters\n"); 
-  nuphase_set_asps_heater_current(0, cfg.asps_method); 
-  nuphase_set_gpio_power_state(0, NP_AUX_HEATER); 
-
-  //wait a bit 
-  usleep(100000); 
-
-  printf("Turning everything on\n"); 
-
-  //turn on the master and spi
-  nuphase_set_gpio_power_state( GPIO_FPGA_ALL, GPIO_FPGA_ALL); 
-
-
-  //turn on the downhole??? 
-  // (not yet) 
-
-
-  usleep(100000); 
-  printf("Final state: \n"); 
-
-  nuphase_hk(&hk, cfg.asps_method); 
-  nuphase_hk_print(stdout,&hk); 
-
-  if (out) 
-  {
-    nuphase_hk_gzwrite(out, &hk); 
-  }
-
-  int wait_this_long = 30;
-
-  if (strlen(cfg.reconfigure_fpga_cmd))
-  {
-    sleep(wait_this_long); 
-    wait_this_long = 0; 
-    printf("Reconfiguring FGPAs with command: %s\n", cfg.reconfigure_fpga_cmd); 
-    system(cfg.reconfigure_fpga_cmd);
-  }
-
-  if (strlen(cfg.set_attenuation_cmd))
-  {
-    char cmd[1024]; 
-    sprintf(cmd,"%s %g %g", cfg.set_attenuation_cmd, cfg.desired_rms_master, cfg.desired_rms_slave); 
-    printf("Waiting for everything to be on\n"); 
-    sleep(wait_this_long); 
-    printf("Running: %s\n", cmd); 
-    system(cmd); 
-  }
+  struct timespec end; 
+  clock_gettime(CLOCK_MONOTONIC, &end); 
+  double total = timespec_difference_float(&end, &boot); 
+  printf("Startup took %0.1f s\n", total); 
+  write_phases(out_name, total); 
 
   if (out) //take another reading here 
   {
+    printf("Final state: \n"); 
     nuphase_hk(&hk, cfg.asps_method); 
+    nuphase_hk_print(stdout,&hk); 
     nuphase_hk_gzwrite(out, &hk); 
     do_close(out, out_name); 
   }
@@ -0,0 +1,602 @@
+/*
+ * \file nuphase-threshold-sim.c
+ *
+ * Offline simulator for the threshold control in nuphase-acq.
+ *
+ * Reads recorded status files (e.g. run123/status/ *.status.gz) and fits, for
+ * each beam, a model of the rate as a function of threshold:
+ *
+ *    rate = exp(a - b * threshold)
+ *
+ * using the slow scalers. Then, for every point of a grid of controller settings,
+ * it runs the same rate estimation and pid code that nuphase-acq uses against
+ * that model (with Poisson-fluctuating scalers), starting from thresholds that
+ * give start_factor times the goal rate (as after a restart) and optionally
+ * with a noise burst partway through. For each point it reports
+ *
+ *   - settling time (since the last disturbance, until the rate stays within tolerance of the goal)
+ *   - overshoot (fractional excursion past the goal after first crossing it)
+ *   - rms of the fractional rate error over the second half of the simulation
+ *
+ * averaged over beams and trials. The grid is split across threads.
+ *
+ * Everything not in the grid (step limits, anti-windup, etc.) comes from the acq config.
+ */
+
+#include "nuphase-cfg.h"
+#include "nuphase-common.h"
+#include "nuphase-pid.h"
+#include "nuphase-rate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+
+
+/* rate model for one beam */
+typedef struct beam_model
+{
+  double a;
+  double b;
+  int npoints;
+  int usable;
+} beam_model_t;
+
+static beam_model_t model[NP_NUM_BEAMS];
+
+/* one point in the grid */
+typedef struct sim_params
+{
+  double k_p;
+  double k_i;
+  double k_d;
+  double fast_weight;
+  int n_fast_avg;
+  nuphase_rate_estimator_t estimator;
+} sim_params_t;
+
+typedef struct sim_result
+{
+  double settling_time;
+  double overshoot;
+  double rms;
+  int nunsettled;
+} sim_result_t;
+
+/* the things that are the same for every point */
+static struct
+{
+  nuphase_acq_cfg_t acq;
+  double duration;
+  double start_factor;
+  double tolerance;
+  double burst_at;
+  double burst_length;
+  double burst_factor;
+  int ntrials;
+  unsigned seed;
+} sim;
+
+static sim_params_t * grid = 0;
+static sim_result_t * results = 0;
+static int ngrid = 0;
+static volatile int next_point = 0;
+
+
+//////////////////////////////////////////////
+// random numbers (each simulation has its own state, so threads don't share)
+
+static double uniform(uint64_t * state)
+{
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return ((*state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double gaussian(uint64_t * state)
+{
+  double u1 = uniform(state);
+  double u2 = uniform(state);
+  if (u1 < 1e-300) u1 = 1e-300;
+  return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static double poisson(uint64_t * state, double lambda)
+{
+  if (lambda <= 0) return 0;
+
+  if (lambda > 30)
+  {
+    double x = floor(lambda + sqrt(lambda) * gaussian(state) + 0.5);
+    return x < 0 ? 0 : x;
+  }
+
+  double L = exp(-lambda);
+  double p = 1;
+  int k = 0;
+  do
+  {
+    k++;
+    p *= uniform(state);
+  } while (p > L);
+
+  return k-1;
+}
+
+
+//////////////////////////////////////////////
+// the model
+
+static int fit_model(int nfiles, char ** files)
+{
+  double sx[NP_NUM_BEAMS] = {0}, sy[NP_NUM_BEAMS] = {0}, sxx[NP_NUM_BEAMS] = {0}, sxy[NP_NUM_BEAMS] = {0};
+  int ibeam, ifile;
+  int nstatus = 0;
+
+  memset(model,0,sizeof(model));
+
+  for (ifile = 0; ifile < nfiles; ifile++)
+  {
+    gzFile f = gzopen(files[ifile],"r");
+    if (!f)
+    {
+      fprintf(stderr,"Could not open %s\n", files[ifile]);
+      continue;
+    }
+
+    nuphase_status_t st;
+    while (!nuphase_status_gzread(f, &st))
+    {
+      nstatus++;
+      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+      {
+        double counts = st.beam_scalers[SCALER_SLOW][ibeam];
+        if (counts <= 0) continue;
+
+        double x = st.trigger_thresholds[ibeam];
+        double y = log(counts / NP_SCALER_TIME(SCALER_SLOW));
+        sx[ibeam] += x;
+        sy[ibeam] += y;
+        sxx[ibeam] += x*x;
+        sxy[ibeam] += x*y;
+        model[ibeam].npoints++;
+      }
+    }
+    gzclose(f);
+  }
+
+  printf("Read %d statuses from %d files\n", nstatus, nfiles);
+
+  int nusable = 0;
+  for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+  {
+    int n = model[ibeam].npoints;
+    double denom = n * sxx[ibeam] - sx[ibeam] * sx[ibeam];
+    if (n < 3 || denom <= 0)
+    {
+      printf("  Beam %d: not enough distinct thresholds (%d points), skipping\n", ibeam, n);
+      continue;
+    }
+
+    double slope = (n * sxy[ibeam] - sx[ibeam] * sy[ibeam]) / denom;
+    double intercept = (sy[ibeam] - slope * sx[ibeam]) / n;
+
+    if (slope >= 0)
+    {
+      printf("  Beam %d: rate doesn't fall with threshold (slope %g), skipping\n", ibeam, slope);
+      continue;
+    }
+
+    model[ibeam].a = intercept;
+    model[ibeam].b = -slope;
+    model[ibeam].usable = 1;
+    nusable++;
+    printf("  Beam %d: rate = exp(%g - %g * threshold) from %d points. Goal of %g Hz at threshold %.0f\n",
+           ibeam, model[ibeam].a, model[ibeam].b, n, sim.acq.scaler_goal[ibeam],
+           (model[ibeam].a - log(sim.acq.scaler_goal[ibeam])) / model[ibeam].b);
+  }
+
+  return nusable == 0;
+}
+
+static double model_rate(int ibeam, double threshold, double t)
+{
+  double rate = exp(model[ibeam].a - model[ibeam].b * threshold);
+  if (sim.burst_length > 0 && t >= sim.burst_at && t < sim.burst_at + sim.burst_length)
+  {
+    rate *= sim.burst_factor;
+  }
+  return rate;
+}
+
+
+//////////////////////////////////////////////
+// the simulation
+
+static void simulate(const sim_params_t * p, sim_result_t * result, uint64_t seed)
+{
+  double interval = sim.acq.monitor_interval > 0 ? sim.acq.monitor_interval : 1;
+  int nsteps = sim.duration / interval;
+  int slow_steps = NP_SCALER_TIME(SCALER_SLOW) / interval;
+  if (slow_steps < 1) slow_steps = 1;
+
+  double last_disturbance = sim.burst_length > 0 ? sim.burst_at : 0;
+
+  nuphase_pid_cfg_t pid_cfg;
+  pid_cfg.max_step_up = sim.acq.max_threshold_increase;
+  pid_cfg.max_step_down = sim.acq.max_threshold_decrease;
+  pid_cfg.max_integral = sim.acq.max_integral;
+  pid_cfg.d_filter_tau = sim.acq.derivative_filter_tau;
+  pid_cfg.schedule_ratio = sim.acq.gain_schedule_ratio;
+  pid_cfg.schedule_factor = sim.acq.gain_schedule_factor;
+  pid_cfg.noise_sigmas = sim.acq.rate_noise_sigmas;
+  nuphase_pid_cfg_set_gains(&pid_cfg, p->k_p, p->k_i, p->k_d);
+
+  nuphase_rate_cfg_t rate_cfg;
+  rate_cfg.fast_weight = p->fast_weight;
+  rate_cfg.slow_weight = 1 - p->fast_weight;
+  rate_cfg.subtract_gated = 0; //the model has no gated rate
+  rate_cfg.estimator = p->estimator;
+  rate_cfg.ewma_tau = sim.acq.rate_ewma_tau;
+  rate_cfg.process_noise = sim.acq.rate_process_noise;
+
+  memset(result,0,sizeof(*result));
+
+  int trial;
+  int nbeams = 0;
+  for (trial = 0; trial < sim.ntrials; trial++)
+  {
+    uint64_t rng = seed * 6364136223846793005ull + trial * 1442695040888963407ull + 1;
+    nuphase_pid_t pid;
+    nuphase_rate_t rate;
+    nuphase_pid_init(&pid);
+    nuphase_rate_init(&rate, p->n_fast_avg);
+
+    double threshold[NP_NUM_BEAMS];
+    double slow_accum[NP_NUM_BEAMS] = {0};
+    double last_out[NP_NUM_BEAMS];
+    double overshoot[NP_NUM_BEAMS] = {0};
+    double sum_sq[NP_NUM_BEAMS] = {0};
+    int crossed[NP_NUM_BEAMS] = {0};
+    int nsq = 0;
+    nuphase_status_t st;
+    memset(&st,0,sizeof(st));
+
+    int ibeam;
+    for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+    {
+      if (!model[ibeam].usable) continue;
+      threshold[ibeam] = (model[ibeam].a - log(sim.start_factor * sim.acq.scaler_goal[ibeam])) / model[ibeam].b;
+      last_out[ibeam] = 0;
+    }
+
+    int istep;
+    for (istep = 0; istep < nsteps; istep++)
+    {
+      double t = istep * interval;
+      int update_slow = (istep+1) % slow_steps == 0;
+
+      //make a fake status
+      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+      {
+        if (!model[ibeam].usable) continue;
+        double r = model_rate(ibeam, threshold[ibeam], t);
+        double fast = poisson(&rng, r * NP_SCALER_TIME(SCALER_FAST));
+        st.beam_scalers[SCALER_FAST][ibeam] = fast > UINT16_MAX ? UINT16_MAX : fast;
+
+        slow_accum[ibeam] += r * interval;
+        if (update_slow)
+        {
+          double slow = poisson(&rng, slow_accum[ibeam] * NP_SCALER_TIME(SCALER_SLOW) / (slow_steps * interval));
+          st.beam_scalers[SCALER_SLOW][ibeam] = slow > UINT16_MAX ? UINT16_MAX : slow;
+          slow_accum[ibeam] = 0;
+        }
+        st.trigger_thresholds[ibeam] = threshold[ibeam];
+      }
+
+      //what the monitor thread does
+      nuphase_rate_update(&rate, &rate_cfg, &st, interval);
+      for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+      {
+        if (!model[ibeam].usable) continue;
+        double goal = sim.acq.scaler_goal[ibeam];
+        threshold[ibeam] += nuphase_pid_update(&pid, &pid_cfg, ibeam, rate.rate[ibeam], rate.variance[ibeam], goal, interval);
+        if (threshold[ibeam] < sim.acq.min_threshold) threshold[ibeam] = sim.acq.min_threshold;
+
+        //figures of merit use the true rate
+        double frac = (model_rate(ibeam, threshold[ibeam], t + interval) - goal) / goal;
+        if (fabs(frac) > sim.tolerance) last_out[ibeam] = t + interval;
+
+        int above = sim.start_factor >= 1;
+        if (!crossed[ibeam] && (above ? frac < 0 : frac > 0)) crossed[ibeam] = 1;
+        if (crossed[ibeam])
+        {
+          double past = above ? -frac : frac;
+          if (past > overshoot[ibeam]) overshoot[ibeam] = past;
+        }
+
+        if (istep >= nsteps/2)
+        {
+          sum_sq[ibeam] += frac * frac;
+        }
+      }
+      if (istep >= nsteps/2) nsq++;
+    }
+
+    for (ibeam = 0; ibeam < NP_NUM_BEAMS; ibeam++)
+    {
+      if (!model[ibeam].usable) continue;
+      nbeams++;
+      double settle = last_out[ibeam] - last_disturbance;
+      if (last_out[ibeam] >= nsteps * interval)
+      {
+        result->nunsettled++;
+        settle = sim.duration - last_disturbance;
+      }
+      result->settling_time += settle > 0 ? settle : 0;
+      result->overshoot += overshoot[ibeam];
+      result->rms += nsq ? sqrt(sum_sq[ibeam] / nsq) : 0;
+    }
+
+    nuphase_rate_free(&rate);
+  }
+
+  if (nbeams)
+  {
+    result->settling_time /= nbeams;
+    result->overshoot /= nbeams;
+    result->rms /= nbeams;
+  }
+}
+
+static void * sim_thread(void * v)
+{
+  while (1)
+  {
+    int i = __sync_fetch_and_add(&next_point, 1);
+    if (i >= ngrid) break;
+    simulate(&grid[i], &results[i], sim.seed + i);
+  }
+  return 0;
+}
+
+
+//////////////////////////////////////////////
+// the grid
+
+/* parses either a comma separated list (1,2,5) or a range (start:stop:step) */
+static int parse_list(const char * str, double ** vals)
+{
+  double start, stop, step;
+  int n = 0;
+
+  if (sscanf(str,"%lf:%lf:%lf", &start, &stop, &step) == 3 && step > 0)
+  {
+    int max = (stop - start) / step + 1.5;
+    *vals = malloc(max * sizeof(double));
+    for (n = 0; n < max; n++) (*vals)[n] = start + n * step;
+    return n;
+  }
+
+  char * copy = strdup(str);
+  char * save_ptr = 0;
+  char * tok = strtok_r(copy,",",&save_ptr);
+  *vals = 0;
+  while (tok)
+  {
+    *vals = realloc(*vals, (n+1) * sizeof(double));
+    (*vals)[n++] = atof(tok);
+    tok = strtok_r(NULL,",",&save_ptr);
+  }
+  free(copy);
+  return n;
+}
+
+static int compare_results(const void * a, const void * b)
+{
+  const sim_result_t * ra = &results[*(const int*) a];
+  const sim_result_t * rb = &results[*(const int*) b];
+  if (ra->nunsettled != rb->nunsettled) return ra->nunsettled - rb->nunsettled;
+  if (ra->settling_time != rb->settling_time) return ra->settling_time < rb->settling_time ? -1 : 1;
+  return ra->rms < rb->rms ? -1 : ra->rms > rb->rms;
+}
+
+static void usage()
+{
+  fprintf(stderr,"usage: nuphase-threshold-sim [options] file.status.gz [file2.status.gz ...]\n");
+  fprintf(stderr,"  Grid options take a list (1,2,5) or a range (start:stop:step). Defaults come from the acq config.\n");
+  fprintf(stderr,"   --kp LIST, --ki LIST, --kd LIST   pid gains\n");
+  fprintf(stderr,"   --fast-weight LIST                fast scaler weight (slow weight is 1 - this)\n");
+  fprintf(stderr,"   --navg LIST                       number of fast scalers to average\n");
+  fprintf(stderr,"   --estimator LIST                  rate estimators to try (boxcar,ewma,kalman)\n");
+  fprintf(stderr,"   --config FILE                     acq config to use (default: the usual one)\n");
+  fprintf(stderr,"   --duration SECS                   length of each simulation (default 600)\n");
+  fprintf(stderr,"   --start-factor X                  start at X times the goal rate (default 10)\n");
+  fprintf(stderr,"   --tolerance X                     settled means within this fraction of the goal (default 0.2)\n");
+  fprintf(stderr,"   --burst-at SECS --burst-length SECS --burst-factor X   add a noise burst\n");
+  fprintf(stderr,"   --trials N                        trials per point (default 4)\n");
+  fprintf(stderr,"   --threads N                       (default: number of cpus)\n");
+  fprintf(stderr,"   --seed N\n");
+  exit(1);
+}
+
+int main(int nargs, char ** args)
+{
+  const char * kp_str = 0, *ki_str = 0, *kd_str = 0, *fw_str = 0, *navg_str = 0, *est_str = 0;
+  char * cfgpath = 0;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  sim.duration = 600;
+  sim.start_factor = 10;
+  sim.tolerance = 0.2;
+  sim.burst_at = 0;
+  sim.burst_length = 0;
+  sim.burst_factor = 10;
+  sim.ntrials = 4;
+  sim.seed = 1;
+
+  static struct option opts[] =
+  {
+    {"kp", required_argument, 0, 'p'},
+    {"ki", required_argument, 0, 'i'},
+    {"kd", required_argument, 0, 'd'},
+    {"fast-weight", required_argument, 0, 'w'},
+    {"navg", required_argument, 0, 'n'},
+    {"estimator", required_argument, 0, 'e'},
+    {"config", required_argument, 0, 'c'},
+    {"duration", required_argument, 0, 'T'},
+    {"start-factor", required_argument, 0, 's'},
+    {"tolerance", required_argument, 0, 't'},
+    {"burst-at", required_argument, 0, 'a'},
+    {"burst-length", required_argument, 0, 'l'},
+    {"burst-factor", required_argument, 0, 'f'},
+    {"trials", required_argument, 0, 'N'},
+    {"threads", required_argument, 0, 'j'},
+    {"seed", required_argument, 0, 'S'},
+    {"help", no_argument, 0, 'h'},
+    {0,0,0,0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(nargs, args, "p:i:d:w:n:e:c:T:s:t:a:l:f:N:j:S:h", opts, 0)) != -1)
+  {
+    switch (opt)
+    {
+      case 'p': kp_str = optarg; break;
+      case 'i': ki_str = optarg; break;
+      case 'd': kd_str = optarg; break;
+      case 'w': fw_str = optarg; break;
+      case 'n': navg_str = optarg; break;
+      case 'e': est_str = optarg; break;
+      case 'c': cfgpath = strdup(optarg); break;
+      case 'T': sim.duration = atof(optarg); break;
+      case 's': sim.start_factor = atof(optarg); break;
+      case 't': sim.tolerance = atof(optarg); break;
+      case 'a': sim.burst_at = atof(optarg); break;
+      case 'l': sim.burst_length = atof(optarg); break;
+      case 'f': sim.burst_factor = atof(optarg); break;
+      case 'N': sim.ntrials = atoi(optarg); break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'S': sim.seed = atoi(optarg); break;
+      default: usage();
+    }
+  }
+
+  if (optind >= nargs) usage();
+
+  nuphase_acq_config_init(&sim.acq);
+  if (cfgpath || !nuphase_get_cfg_file(&cfgpath, NUPHASE_ACQ))
+  {
+    printf("Using config file: %s\n", cfgpath);
+    nuphase_acq_config_read(cfgpath, &sim.acq);
+  }
+
+  if (fit_model(nargs - optind, args + optind))
+  {
+    fprintf(stderr,"No usable beams, giving up.\n");
+    return 1;
+  }
+
+  //set up the grid (defaults from the config)
+  double *kp, *ki, *kd, *fw, *navg;
+  int nkp = kp_str ? parse_list(kp_str, &kp) : 1;
+  int nki = ki_str ? parse_list(ki_str, &ki) : 1;
+  int nkd = kd_str ? parse_list(kd_str, &kd) : 1;
+  int nfw = fw_str ? parse_list(fw_str, &fw) : 1;
+  int nnavg = navg_str ? parse_list(navg_str, &navg) : 1;
+  double def_kp = sim.acq.k_p[0], def_ki = sim.acq.k_i[0], def_kd = sim.acq.k_d[0];
+  double def_fw = sim.acq.fast_scaler_weight / (sim.acq.fast_scaler_weight + sim.acq.slow_scaler_weight);
+  double def_navg = sim.acq.n_fast_scaler_avg;
+  if (!kp_str) kp = &def_kp;
+  if (!ki_str) ki = &def_ki;
+  if (!kd_str) kd = &def_kd;
+  if (!fw_str) fw = &def_fw;
+  if (!navg_str) navg = &def_navg;
+
+  int est[3] = { sim.acq.rate_estimator };
+  int nest = 1;
+  if (est_str)
+  {
+    char * copy = strdup(est_str);
+    char * save_ptr = 0;
+    char * tok = strtok_r(copy,",",&save_ptr);
+    nest = 0;
+    while (tok && nest < 3)
+    {
+      est[nest] = nuphase_rate_estimator_from_name(tok);
+      if (est[nest] < 0)
+      {
+        fprintf(stderr,"Unknown estimator %s\n", tok);
+        usage();
+      }
+      nest++;
+      tok = strtok_r(NULL,",",&save_ptr);
+    }
+    free(copy);
+  }
+
+  ngrid = nkp * nki * nkd * nfw * nnavg * nest;
+  if (ngrid <= 0) usage();
+  grid = calloc(ngrid, sizeof(*grid));
+  results = calloc(ngrid, sizeof(*results));
+
+  int i = 0, a,b,c,d,e,g;
+  for (a = 0; a < nkp; a++)
+    for (b = 0; b < nki; b++)
+      for (c = 0; c < nkd; c++)
+        for (d = 0; d < nfw; d++)
+          for (e = 0; e < nnavg; e++)
+            for (g = 0; g < nest; g++)
+            {
+              grid[i].k_p = kp[a];
+              grid[i].k_i = ki[b];
+              grid[i].k_d = kd[c];
+              grid[i].fast_weight = fw[d];
+              grid[i].n_fast_avg = navg[e];
+              grid[i].estimator = est[g];
+              i++;
+            }
+
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > ngrid) nthreads = ngrid;
+  printf("Simulating %d parameter sets (%d trials of %g s each) on %d threads\n", ngrid, sim.ntrials, sim.duration, nthreads);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t threads[nthreads];
+  for (i = 0; i < nthreads; i++) pthread_create(&threads[i], 0, sim_thread, 0);
+  for (i = 0; i < nthreads; i++) pthread_join(threads[i], 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%10s %10s %10s %8s %6s %7s | %12s %10s %10s %10s\n", "k_p", "k_i", "k_d", "fast_w", "navg", "est", "settling(s)", "overshoot", "rms", "unsettled");
+  for (i = 0; i < ngrid; i++)
+  {
+    printf("%10g %10g %10g %8g %6d %7s | %12.1f %10.3f %10.3f %10d\n", grid[i].k_p, grid[i].k_i, grid[i].k_d, grid[i].fast_weight, grid[i].n_fast_avg,
+           nuphase_rate_estimator_name(grid[i].estimator),
+           results[i].settling_time, results[i].overshoot, results[i].rms, results[i].nunsettled);
+  }
+
+  int * order = malloc(ngrid * sizeof(int));
+  for (i = 0; i < ngrid; i++) order[i] = i;
+  qsort(order, ngrid, sizeof(int), compare_results);
+
+  printf("\nBest settings (fewest unsettled, then settling time, then rms):\n");
+  for (i = 0; i < ngrid && i < 10; i++)
+  {
+    int j = order[i];
+    printf("  k_p=%g k_i=%g k_d=%g fast_scaler_weight=%g n_fast_scaler_avg=%d rate_estimator=%s :: settling %.1f s, overshoot %.3f, rms %.3f, unsettled %d\n",
+           grid[j].k_p, grid[j].k_i, grid[j].k_d, grid[j].fast_weight, grid[j].n_fast_avg, nuphase_rate_estimator_name(grid[j].estimator),
+           results[j].settling_time, results[j].overshoot, results[j].rms, results[j].nunsettled);
+  }
+
+  printf("\nDone in %g s\n", timespec_difference_float(&end, &start));
+
+  return 0;
+}